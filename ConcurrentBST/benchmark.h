@@ -0,0 +1,275 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// the baseline: std::map behind one mutex
+struct LockedMap
+{
+    std::mutex m;
+    std::map<K,V> map;
+};
+
+bool get(LockedMap& bst, K k, V& v)
+{
+    std::unique_lock<std::mutex> mapLock(bst.m);
+    return get(bst.map, k, v);
+}
+
+void put(LockedMap& bst, K k, V v)
+{
+    std::unique_lock<std::mutex> mapLock(bst.m);
+    put(bst.map, k, v);
+}
+
+void remove(LockedMap& bst, K k)
+{
+    std::unique_lock<std::mutex> mapLock(bst.m);
+    remove(bst.map, k);
+}
+
+struct BenchConfig
+{
+    std::string name;
+    int threads;
+    double seconds;
+    // the map starts with prefill of the workload's keys
+    unsigned prefill;
+    Workload workload;
+    // each thread cycles through this many pre-generated operations
+    unsigned opsPerThread;
+    // thread t runs on cpus[t % cpus.size()] (see topology.h); no CPUs for
+    // Unpinned
+    Placement placement;
+    std::vector<int> cpus;
+    // every thread counts cycles, cache misses etc. over the timed region
+    // (see perfcounters.h)
+    bool counters;
+};
+
+struct BenchResult
+{
+    BenchConfig config;
+    std::string map;
+    double seconds;
+    std::vector<unsigned long long> ops;
+    // one per thread if the config asked for counters, else none
+    std::vector<PerfCounts> counters;
+
+    unsigned long long totalOps() const
+    {
+        unsigned long long total = 0;
+        for (unsigned long long n : ops)
+            total += n;
+        return total;
+    }
+
+    PerfCounts totalCounters() const
+    {
+        if (counters.empty())
+            return PerfCounts();
+        PerfCounts total = counters[0];
+        for (std::size_t t = 1; t < counters.size(); ++t)
+            total += counters[t];
+        return total;
+    }
+};
+
+// with equal put and remove frequencies, a key range of twice the prefill
+// keeps the map at about its prefilled size, and about half the gets hit
+// (under a uniform distribution)
+BenchConfig benchConfig(const std::string& name, int threads, double seconds, unsigned prefill, float ratioPut, float ratioRemove, float ratioGet,
+                        KeyDist dist = KeyDist::Uniform)
+{
+    BenchConfig config = { name, threads, seconds, prefill, workload(dist, static_cast<K>(2 * prefill), ratioPut, ratioRemove, ratioGet), 1 << 20,
+                           Placement::Unpinned, std::vector<int>(), false };
+    return config;
+}
+
+// prefills the map before the clock starts, and every thread pins itself
+// (if the config says so), opens its counters (likewise) and generates its own stream of operations (in
+// parallel with the others) before it reaches the start barrier; then they run until the main thread says stop,
+// checking every few operations. each thread measures its own time and
+// counts its own events, from the barrier to its last operation
+template <typename Map>
+BenchResult runBenchmark(const std::string& mapName, const BenchConfig& config)
+{
+    Map map;
+    std::vector<K> prefill(config.workload.keyRange);
+    std::iota(prefill.begin(), prefill.end(), 1);
+    std::shuffle(prefill.begin(), prefill.end(), std::mt19937(config.workload.keyRange));
+    for (unsigned i = 0; i < config.prefill; ++i)
+        put(map, prefill[i], prefill[i]);
+    std::vector<std::vector<Operation> > threadOps(config.threads);
+
+    BenchResult result = { config, mapName, 0, std::vector<unsigned long long>(config.threads, 0),
+                           std::vector<PerfCounts>(config.counters ? config.threads : 0) };
+    std::vector<double> elapsed(config.threads, 0);
+    std::atomic<int> ready(0);
+    std::atomic<bool> go(false), stop(false);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < config.threads; ++t)
+        threads.push_back( std::thread([&, t]()
+        {
+            if (!config.cpus.empty())
+                pinCurrentThread(config.cpus[t % config.cpus.size()]);
+            std::vector<Operation>& ops = threadOps[t];
+            OpGenerator(config.workload, t, config.threads, 1).fill(ops, config.opsPerThread);
+            std::unique_ptr<PerfCounters> counters;
+            if (config.counters)
+                counters.reset(new PerfCounters());
+            V value = 0;
+            unsigned long long done = 0;
+            std::size_t i = 0;
+            ++ready;
+            while (!go.load(std::memory_order_acquire))
+                std::this_thread::yield();
+            auto start = std::chrono::steady_clock::now();
+            if (counters)
+                counters->start();
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                for (int batch = 0; batch < 64; ++batch)
+                {
+                    const Operation& op = ops[i];
+                    switch (op.op)
+                    {
+                        case Put: put(map, op.elem.first, op.elem.second); break;
+                        case Remove: remove(map, op.elem.first); break;
+                        case Get: get(map, op.elem.first, value); break;
+                    }
+                    if (++i == ops.size())
+                        i = 0;
+                }
+                done += 64;
+            }
+            if (counters)
+                counters->stop();
+            auto end = std::chrono::steady_clock::now();
+            result.ops[t] = done;
+            elapsed[t] = std::chrono::duration<double>(end - start).count();
+            if (counters)
+                result.counters[t] = counters->read();
+        }) );
+    while (ready.load() != config.threads)
+        std::this_thread::yield();
+    go.store(true, std::memory_order_release);
+    std::this_thread::sleep_for(std::chrono::duration<double>(config.seconds));
+    stop = true;
+    for (std::thread& th : threads)
+        th.join();
+    for (double s : elapsed)
+        result.seconds = std::max(result.seconds, s);
+    return result;
+}
+
+// each event per operation, comma-separated and (like the ops) in
+// parallel to the throughput; an event that wasn't counted is left empty
+void printCSVPerOp(std::ostream& os, const PerfCounts& counts, unsigned long long ops)
+{
+    for (int e = 0; e < NumPerfEvents; ++e)
+    {
+        os << ",";
+        if (counts.counted(e) && ops > 0)
+            os << static_cast<double>(counts.values[e]) / ops;
+    }
+}
+
+// the counted events per operation for people, e.g. in a summary
+void printPerOp(std::ostream& os, const PerfCounts& counts, unsigned long long ops)
+{
+    if (!counts.any())
+    {
+        os << "no counters (perf events unavailable here)";
+        return;
+    }
+    const char* separator = "";
+    for (int e = 0; e < NumPerfEvents; ++e)
+        if (counts.counted(e))
+        {
+            os << separator << std::setprecision(3) << static_cast<double>(counts.values[e]) / std::max(1ULL, ops) << " " << perfEventName(e);
+            separator = ", ";
+        }
+    if (counts.counted(PerfCycles) && counts.counted(PerfInstructions) && counts.values[PerfCycles] > 0)
+        os << " per op (IPC " << std::setprecision(3) << static_cast<double>(counts.values[PerfInstructions]) / counts.values[PerfCycles] << ")";
+    else
+        os << " per op";
+    if (!counts.counted(PerfCycles) && !counts.counted(PerfInstructions))
+        os << " (no hardware events here)";
+}
+
+// one row per thread plus a "total" row per result; the event columns are
+// empty unless the run counted them
+void printCSV(std::ostream& os, const std::vector<BenchResult>& results)
+{
+    os << "workload,map,threads,placement,seconds,prefill,keys,key_range,put,remove,get,thread,ops,ops_per_sec";
+    for (int e = 0; e < NumPerfEvents; ++e)
+        os << "," << perfEventName(e) << "_per_op";
+    os << "\n";
+    for (const BenchResult& r : results)
+    {
+        const BenchConfig& c = r.config;
+        const Workload& w = c.workload;
+        std::stringstream prefix;
+        prefix << c.name << "," << r.map << "," << c.threads << "," << placementName(c.placement) << "," << r.seconds << "," << c.prefill << "," << distName(w.dist) << "," << w.keyRange << ","
+               << w.ratioPut << "," << w.ratioRemove << "," << w.ratioGet << ",";
+        for (int t = 0; t < c.threads; ++t)
+        {
+            os << prefix.str() << t << "," << r.ops[t] << "," << static_cast<unsigned long long>(r.ops[t] / r.seconds);
+            printCSVPerOp(os, r.counters.empty() ? PerfCounts() : r.counters[t], r.ops[t]);
+            os << "\n";
+        }
+        os << prefix.str() << "total," << r.totalOps() << "," << static_cast<unsigned long long>(r.totalOps() / r.seconds);
+        printCSVPerOp(os, r.totalCounters(), r.totalOps());
+        os << "\n";
+    }
+}
+
+void printJSON(std::ostream& os, const std::vector<BenchResult>& results)
+{
+    os << "[\n";
+    for (std::size_t i = 0; i < results.size(); ++i)
+    {
+        const BenchResult& r = results[i];
+        const BenchConfig& c = r.config;
+        const Workload& w = c.workload;
+        os << "  {\"workload\": \"" << c.name << "\", \"map\": \"" << r.map << "\", \"threads\": " << c.threads
+           << ", \"placement\": \"" << placementName(c.placement) << "\", \"seconds\": " << r.seconds << ", \"prefill\": " << c.prefill << ", \"keys\": \"" << distName(w.dist) << "\", \"key_range\": " << w.keyRange
+           << ", \"put\": " << w.ratioPut << ", \"remove\": " << w.ratioRemove << ", \"get\": " << w.ratioGet
+           << ", \"ops\": " << r.totalOps() << ", \"ops_per_sec\": " << static_cast<unsigned long long>(r.totalOps() / r.seconds)
+           << ", \"ops_per_thread\": [";
+        for (int t = 0; t < c.threads; ++t)
+            os << (t ? ", " : "") << r.ops[t];
+        os << "]";
+        PerfCounts counts = r.totalCounters();
+        if (counts.any())
+        {
+            os << ", \"per_op\": {";
+            const char* separator = "";
+            for (int e = 0; e < NumPerfEvents; ++e)
+                if (counts.counted(e))
+                {
+                    os << separator << "\"" << perfEventName(e) << "\": " << static_cast<double>(counts.values[e]) / std::max(1ULL, r.totalOps());
+                    separator = ", ";
+                }
+            os << "}";
+        }
+        os << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    os << "]\n";
+}
+
+#endif
@@ -0,0 +1,3 @@
+#include "blinktree.h"
+
+template class BLinkTreeMap<int, int>;
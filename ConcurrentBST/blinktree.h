@@ -0,0 +1,752 @@
+#ifndef BLINKTREE_H
+#define BLINKTREE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "epoch.h"
+#include "slab.h"
+
+// every node of the B-link tree takes this many bytes: four cache lines, of
+// which a lookup reads the header and the keys, and then one child pointer
+// or value
+const std::size_t BLinkNodeBytes = 256;
+// plenty for a fan-out of at least 4
+const unsigned BLinkMaxLevels = 32;
+// spins on a locked node before yielding the CPU to whoever holds it
+const int BLinkSpinCount = 64;
+
+// what all nodes start with. a node holds the keys in [its low key, high),
+// where its low key is the high key of its left neighbour and a node
+// without a high key is the last of its level. a split moves the upper half
+// of a node to a new right neighbour and lowers the node's high key, so a
+// key a descent is looking for is always in the node it got to or somewhere
+// to the right of it, along the next links (Lehman and Yao, "Efficient
+// Locking for Concurrent Operations on B-Trees", 1981). a node that was
+// merged into its left neighbour is the one exception: its next leads back
+// left, to the node that has its keys now.
+//
+// readers go over a node while a writer may be changing it, so everything
+// in one is a std::atomic, loaded and stored relaxed; the version's
+// acquire/release and the fences around it order the rest
+template <typename K, typename V>
+struct alignas(SlabSizeClass) BLinkNode
+{
+    // odd while a writer holds the node; unlocking moves it on by one more,
+    // so a reader that sees the same even version before and after reading
+    // the node read it whole
+    std::atomic<std::uint64_t> version;
+    std::atomic<BLinkNode*> next;
+    std::atomic<unsigned> count;
+    // 0 for leaves; never changes
+    const unsigned level;
+    std::atomic<bool> hasHigh;
+    std::atomic<bool> merged;
+    std::atomic<K> high;
+
+    explicit BLinkNode(unsigned level) : version(0), next(nullptr), count(0), level(level), hasHigh(false), merged(false), high() {}
+};
+
+// count keys and as many values, sorted
+template <typename K, typename V>
+struct BLinkLeaf : BLinkNode<K, V>
+{
+    static constexpr unsigned Capacity = static_cast<unsigned>((BLinkNodeBytes - sizeof(BLinkNode<K, V>)) / (sizeof(std::atomic<K>) + sizeof(std::atomic<V>)));
+
+    std::atomic<K> keys[Capacity];
+    std::atomic<V> values[Capacity];
+
+    BLinkLeaf() : BLinkNode<K, V>(0) {}
+};
+
+// count keys and count + 1 children; child i holds the keys from keys[i - 1]
+// up to keys[i]
+template <typename K, typename V>
+struct BLinkInner : BLinkNode<K, V>
+{
+    static constexpr unsigned Capacity = static_cast<unsigned>((BLinkNodeBytes - sizeof(BLinkNode<K, V>) - sizeof(void*)) / (sizeof(std::atomic<K>) + sizeof(void*)));
+
+    std::atomic<K> keys[Capacity];
+    std::atomic<BLinkNode<K, V>*> children[Capacity + 1];
+
+    explicit BLinkInner(unsigned level) : BLinkNode<K, V>(level) {}
+};
+
+// std::copy and std::copy_backward for the atomic arrays in nodes, which
+// only writers holding the lock move entries around in
+template <typename T>
+void blinkCopy(const std::atomic<T>* first, const std::atomic<T>* last, std::atomic<T>* out)
+{
+    for (; first != last; ++first, ++out)
+        out->store(first->load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+template <typename T>
+void blinkCopyBackward(const std::atomic<T>* first, const std::atomic<T>* last, std::atomic<T>* outLast)
+{
+    while (last != first)
+        (--outLast)->store((--last)->load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+// where a key goes among a node's n sorted keys: lowerBound counts the keys
+// less than k, upperBound the keys not greater than k. a binary search in
+// general; for int keys in their natural order, every key is compared at
+// once, four to an SSE2 instruction, which costs no more than the branches
+// a binary search would mispredict at these sizes
+template <typename K, typename Compare>
+struct BLinkSearch
+{
+    static unsigned lowerBound(const std::atomic<K>* keys, unsigned n, const K& k, const Compare& comp)
+    {
+        unsigned lo = 0;
+        while (n > 0)
+        {
+            unsigned half = n / 2;
+            if (comp(keys[lo + half].load(std::memory_order_relaxed), k))
+            {
+                lo += half + 1;
+                n -= half + 1;
+            }
+            else
+                n = half;
+        }
+        return lo;
+    }
+
+    static unsigned upperBound(const std::atomic<K>* keys, unsigned n, const K& k, const Compare& comp)
+    {
+        unsigned lo = 0;
+        while (n > 0)
+        {
+            unsigned half = n / 2;
+            if (!comp(k, keys[lo + half].load(std::memory_order_relaxed)))
+            {
+                lo += half + 1;
+                n -= half + 1;
+            }
+            else
+                n = half;
+        }
+        return lo;
+    }
+};
+
+#ifdef __SSE2__
+// the keys are loaded into a buffer first, since SSE2 can't load atomics
+template <>
+struct BLinkSearch<int, std::less<int> >
+{
+    static constexpr unsigned MaxKeys = BLinkNodeBytes / sizeof(int);
+
+    static void load(const std::atomic<int>* from, unsigned n, int* keys)
+    {
+        for (unsigned i = 0; i < n; ++i)
+            keys[i] = from[i].load(std::memory_order_relaxed);
+    }
+
+    static unsigned lowerBound(const std::atomic<int>* from, unsigned n, int k, const std::less<int>&)
+    {
+        int keys[MaxKeys];
+        load(from, n, keys);
+        __m128i key = _mm_set1_epi32(k);
+        unsigned less = 0;
+        unsigned i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128i four = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+            less += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(four, key))));
+        }
+        for (; i < n; ++i)
+            less += keys[i] < k;
+        return less;
+    }
+
+    static unsigned upperBound(const std::atomic<int>* from, unsigned n, int k, const std::less<int>&)
+    {
+        int keys[MaxKeys];
+        load(from, n, keys);
+        __m128i key = _mm_set1_epi32(k);
+        unsigned notGreater = 0;
+        unsigned i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128i four = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+            notGreater += 4 - __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(four, key))));
+        }
+        for (; i < n; ++i)
+            notGreater += keys[i] <= k;
+        return notGreater;
+    }
+};
+#endif
+
+// a concurrent B+-tree with right links (B-link tree), with the same
+// get/put/remove as ConcurrentBSTMap. a node holds as many keys as fit in
+// BLinkNodeBytes, so a lookup in a map much bigger than the cache misses on
+// a handful of nodes instead of on every level of a binary tree.
+//
+// readers take no locks: like ConcurrentBSTMap's descents they read a node
+// between two loads of its version and go over it again if it changed. a
+// writer locks the one leaf its key belongs in, moving right first if a
+// split got there before it. a full leaf is split in two, and the new one is
+// added to its parent after the leaf is unlocked, which may split the parent
+// in turn; until then the next link leads there. a put or get never holds
+// more than one lock, and nobody ever waits on a lock to read.
+//
+// a remove that leaves its leaf less than a quarter full merges it with a
+// neighbour that has the same parent, locking the parent and then the two
+// nodes from left to right. the left one takes the right one's keys, and the
+// right one is retired to the map's EpochManager once the parent no longer
+// links to it. a parent left less than a quarter full is merged with a
+// neighbour of its own in the same way. two nodes are only merged if they
+// fill at most three quarters of one, so that the next few puts don't split
+// them again, unless one of them is empty; a node whose neighbours are too
+// full stays as it is, and the root never comes back down.
+// keys and values must be trivially copyable, since nodes keep them in
+// std::atomics: a reader may load them while a writer is changing them and
+// only then find out it has to throw them away. no ordered queries, batches
+// or snapshots
+template <typename K, typename V, typename Compare = std::less<K>, typename Alloc = std::allocator<std::pair<const K, V> > >
+class BLinkTreeMap
+{
+    static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value, "B-link tree nodes keep keys and values in std::atomics");
+
+public:
+    typedef BLinkNode<K, V>* NodePtr;
+    typedef BLinkLeaf<K, V> Leaf;
+    typedef BLinkInner<K, V> Inner;
+
+    explicit BLinkTreeMap(const Compare& comp = Compare(), const Alloc& alloc = Alloc());
+    ~BLinkTreeMap();
+
+    // put and remove return the value the key had, if it had one
+    std::optional<V> get(const K& k);
+    std::optional<V> put(const K& k, const V& v);
+    std::optional<V> remove(const K& k);
+    // as ConcurrentBSTMap::quiescent and ::clear
+    void quiescent();
+    void clear();
+    // levels from the root down to the leaves, counting both
+    unsigned height() const;
+
+private:
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<char> RegionAlloc;
+    typedef std::allocator_traits<RegionAlloc> RegionAllocTraits;
+    typedef BLinkSearch<K, Compare> Search;
+
+    static_assert(sizeof(Leaf) <= BLinkNodeBytes && sizeof(Inner) <= BLinkNodeBytes, "nodes must fit in BLinkNodeBytes");
+    static_assert(Leaf::Capacity >= 4 && Inner::Capacity >= 4, "keys or values too big for BLinkNodeBytes");
+
+    // the inner nodes a writer's descent went through, by level, so that a
+    // split knows where to start looking for the parent
+    struct Path
+    {
+        NodePtr parents[BLinkMaxLevels];
+        unsigned levels;
+    };
+
+    // the leaf k belongs in, without locking anything
+    NodePtr findLeaf(const K& k, Path* path);
+    // the node at level that k belongs in; the root must be at least that high
+    NodePtr findAt(unsigned level, const K& k);
+    // locks the node k belongs in, starting from node, which must be it or
+    // to the left of it on the same level, or merged into one that is
+    NodePtr lockCovering(NodePtr node, const K& k);
+    // does k belong somewhere other than node, along its next link?
+    bool beyond(NodePtr node, const K& k) const { return node->merged.load(std::memory_order_relaxed) || (node->hasHigh.load(std::memory_order_relaxed) && !comp(k, node->high.load(std::memory_order_relaxed))); }
+    // adds the link to right, the new node that holds the keys from sep on,
+    // to the level above it, splitting as many levels as need it
+    void addToParent(unsigned level, K sep, NodePtr right, const Path& path);
+    void insertInner(Inner* node, const K& sep, NodePtr right);
+    // merges the node at level that k belongs in with a neighbour, if they
+    // fit, and then the parent if that leaves it less than a quarter full
+    void mergeAt(unsigned level, const K& k, const Path& path);
+
+    static std::uint64_t stableVersion(NodePtr node);
+    static bool validate(NodePtr node, std::uint64_t version);
+    static void lock(NodePtr node);
+    static void unlock(NodePtr node);
+    static Leaf* asLeaf(NodePtr node) { return static_cast<Leaf*>(node); }
+    static Inner* asInner(NodePtr node) { return static_cast<Inner*>(node); }
+
+    Leaf* newLeaf();
+    Inner* newInner(unsigned level);
+    static void deleteNode(void* context, void* p);
+    static void* allocateRegion(void* context, std::size_t bytes);
+    static void deallocateRegion(void* context, void* p, std::size_t bytes);
+    BLinkTreeMap(const BLinkTreeMap& rhs);
+    BLinkTreeMap& operator=(const BLinkTreeMap& rhs);
+
+    Compare comp;
+    RegionAlloc regionAlloc;
+    SlabPool nodePool;
+    // the first node of the top level; only ever replaced by a new root
+    // above it, which takes rootMutex
+    std::atomic<NodePtr> root;
+    std::mutex rootMutex;
+    EpochManager epoch;
+};
+
+template <typename K, typename V, typename Compare, typename Alloc>
+BLinkTreeMap<K, V, Compare, Alloc>::BLinkTreeMap(const Compare& comp, const Alloc& alloc)
+    : comp(comp), regionAlloc(alloc), nodePool(BLinkNodeBytes, allocateRegion, deallocateRegion, this), root(nullptr), rootMutex(),
+      epoch(deleteNode, this)
+{
+    root.store(newLeaf(), std::memory_order_relaxed);
+}
+
+// the nodes are trivially destructible, so there is nothing to do but give
+// the memory back, which epoch (for the retired nodes) and then nodePool do
+// on their own
+template <typename K, typename V, typename Compare, typename Alloc>
+BLinkTreeMap<K, V, Compare, Alloc>::~BLinkTreeMap()
+{}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<V> BLinkTreeMap<K, V, Compare, Alloc>::get(const K& k)
+{
+    EpochManager::Guard guard(epoch);
+    NodePtr node = findLeaf(k, nullptr);
+    while (true)
+    {
+        std::uint64_t version = stableVersion(node);
+        if (beyond(node, k))
+        {
+            NodePtr next = node->next.load(std::memory_order_relaxed);
+            if (validate(node, version))
+                node = next;
+            continue;
+        }
+        Leaf* leaf = asLeaf(node);
+        unsigned n = leaf->count.load(std::memory_order_relaxed);
+        unsigned i = Search::lowerBound(leaf->keys, n, k, comp);
+        bool found = i < n && !comp(k, leaf->keys[i].load(std::memory_order_relaxed));
+        V v = found ? leaf->values[i].load(std::memory_order_relaxed) : V();
+        if (validate(node, version))
+            return found ? std::optional<V>(v) : std::nullopt;
+    }
+}
+
+// a full leaf keeps its lower half and the new key, if that belongs there;
+// the upper half goes to a new leaf linked in to its right before the old
+// one is unlocked. a key past the end of the leaf goes to the new one on its
+// own instead, so that keys put in ascending order fill their leaves all the
+// way up rather than leaving every one of them half empty
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<V> BLinkTreeMap<K, V, Compare, Alloc>::put(const K& k, const V& v)
+{
+    EpochManager::Guard guard(epoch);
+    Path path;
+    Leaf* leaf = asLeaf(lockCovering(findLeaf(k, &path), k));
+    unsigned n = leaf->count.load(std::memory_order_relaxed);
+    unsigned i = Search::lowerBound(leaf->keys, n, k, comp);
+    if (i < n && !comp(k, leaf->keys[i].load(std::memory_order_relaxed)))
+    {
+        V old = leaf->values[i].load(std::memory_order_relaxed);
+        leaf->values[i].store(v, std::memory_order_relaxed);
+        unlock(leaf);
+        return old;
+    }
+    Leaf* target = leaf;
+    Leaf* right = nullptr;
+    K sep = K();
+    if (n == Leaf::Capacity)
+    {
+        unsigned half = i == n ? n : n / 2;
+        right = newLeaf();
+        blinkCopy(leaf->keys + half, leaf->keys + n, right->keys);
+        blinkCopy(leaf->values + half, leaf->values + n, right->values);
+        right->count.store(n - half, std::memory_order_relaxed);
+        right->hasHigh.store(leaf->hasHigh.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        right->high.store(leaf->high.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        right->next.store(leaf->next.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        leaf->count.store(half, std::memory_order_relaxed);
+        if (i > half || i == n)
+        {
+            target = right;
+            i -= half;
+        }
+        n = target->count.load(std::memory_order_relaxed);
+    }
+    blinkCopyBackward(target->keys + i, target->keys + n, target->keys + n + 1);
+    blinkCopyBackward(target->values + i, target->values + n, target->values + n + 1);
+    target->keys[i].store(k, std::memory_order_relaxed);
+    target->values[i].store(v, std::memory_order_relaxed);
+    target->count.store(n + 1, std::memory_order_relaxed);
+    if (right != nullptr)
+    {
+        sep = right->keys[0].load(std::memory_order_relaxed);
+        leaf->hasHigh.store(true, std::memory_order_relaxed);
+        leaf->high.store(sep, std::memory_order_relaxed);
+        leaf->next.store(right, std::memory_order_release);
+    }
+    unlock(leaf);
+    if (right != nullptr)
+        addToParent(0, sep, right, path);
+    return std::nullopt;
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<V> BLinkTreeMap<K, V, Compare, Alloc>::remove(const K& k)
+{
+    EpochManager::Guard guard(epoch);
+    Path path;
+    Leaf* leaf = asLeaf(lockCovering(findLeaf(k, &path), k));
+    unsigned n = leaf->count.load(std::memory_order_relaxed);
+    unsigned i = Search::lowerBound(leaf->keys, n, k, comp);
+    if (i == n || comp(k, leaf->keys[i].load(std::memory_order_relaxed)))
+    {
+        unlock(leaf);
+        return std::nullopt;
+    }
+    V old = leaf->values[i].load(std::memory_order_relaxed);
+    blinkCopy(leaf->keys + i + 1, leaf->keys + n, leaf->keys + i);
+    blinkCopy(leaf->values + i + 1, leaf->values + n, leaf->values + i);
+    leaf->count.store(n - 1, std::memory_order_relaxed);
+    unlock(leaf);
+    if (n - 1 < Leaf::Capacity / 4)
+        mergeAt(0, k, path);
+    return old;
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+void BLinkTreeMap<K, V, Compare, Alloc>::quiescent()
+{
+    epoch.quiescent();
+}
+
+// nobody may be using the map
+template <typename K, typename V, typename Compare, typename Alloc>
+void BLinkTreeMap<K, V, Compare, Alloc>::clear()
+{
+    epoch.reclaimAll();
+    nodePool.release();
+    root.store(newLeaf(), std::memory_order_relaxed);
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+unsigned BLinkTreeMap<K, V, Compare, Alloc>::height() const
+{
+    return root.load(std::memory_order_acquire)->level + 1;
+}
+
+// a node that changes under a descent is read again, not the whole descent:
+// whatever moved out of it went right, and the next links lead there
+template <typename K, typename V, typename Compare, typename Alloc>
+typename BLinkTreeMap<K, V, Compare, Alloc>::NodePtr BLinkTreeMap<K, V, Compare, Alloc>::findLeaf(const K& k, Path* path)
+{
+    NodePtr node = root.load(std::memory_order_acquire);
+    if (path != nullptr)
+    {
+        path->levels = node->level + 1;
+        for (unsigned l = 0; l < path->levels && l < BLinkMaxLevels; ++l)
+            path->parents[l] = nullptr;
+    }
+    while (node->level > 0)
+    {
+        std::uint64_t version = stableVersion(node);
+        NodePtr next;
+        if (beyond(node, k))
+            next = node->next.load(std::memory_order_relaxed);
+        else
+        {
+            Inner* inner = asInner(node);
+            unsigned i = Search::upperBound(inner->keys, inner->count.load(std::memory_order_relaxed), k, comp);
+            next = inner->children[i].load(std::memory_order_acquire);
+            if (path != nullptr && node->level < BLinkMaxLevels)
+                path->parents[node->level] = node;
+        }
+        if (validate(node, version))
+            node = next;
+    }
+    return node;
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+typename BLinkTreeMap<K, V, Compare, Alloc>::NodePtr BLinkTreeMap<K, V, Compare, Alloc>::findAt(unsigned level, const K& k)
+{
+    NodePtr node = root.load(std::memory_order_acquire);
+    while (node->level > level)
+    {
+        std::uint64_t version = stableVersion(node);
+        NodePtr next;
+        if (beyond(node, k))
+            next = node->next.load(std::memory_order_relaxed);
+        else
+        {
+            Inner* inner = asInner(node);
+            unsigned i = Search::upperBound(inner->keys, inner->count.load(std::memory_order_relaxed), k, comp);
+            next = inner->children[i].load(std::memory_order_acquire);
+        }
+        if (validate(node, version))
+            node = next;
+    }
+    return node;
+}
+
+// one lock at a time: the node is let go of before its right neighbour is
+// locked. the caller's epoch keeps the neighbour from being freed, and it
+// still holds everything from the node's high key on, or it was merged
+// into a node that does
+template <typename K, typename V, typename Compare, typename Alloc>
+typename BLinkTreeMap<K, V, Compare, Alloc>::NodePtr BLinkTreeMap<K, V, Compare, Alloc>::lockCovering(NodePtr node, const K& k)
+{
+    lock(node);
+    while (beyond(node, k))
+    {
+        NodePtr next = node->next.load(std::memory_order_relaxed);
+        unlock(node);
+        node = next;
+        lock(node);
+    }
+    return node;
+}
+
+// the parent is the one the descent came through, or one to the right of
+// it. a split of the root adds a level: the new root has the old one, which
+// is always the first node of its level, and right as its children; if
+// another split got to it first, sep goes into the level that one made
+template <typename K, typename V, typename Compare, typename Alloc>
+void BLinkTreeMap<K, V, Compare, Alloc>::addToParent(unsigned level, K sep, NodePtr right, const Path& path)
+{
+    while (true)
+    {
+        if (root.load(std::memory_order_acquire)->level == level)
+        {
+            std::lock_guard<std::mutex> rootLock(rootMutex);
+            NodePtr top = root.load(std::memory_order_relaxed);
+            if (top->level == level)
+            {
+                Inner* newRoot = newInner(level + 1);
+                newRoot->keys[0].store(sep, std::memory_order_relaxed);
+                newRoot->children[0].store(top, std::memory_order_relaxed);
+                newRoot->children[1].store(right, std::memory_order_relaxed);
+                newRoot->count.store(1, std::memory_order_relaxed);
+                root.store(newRoot, std::memory_order_release);
+                return;
+            }
+        }
+        unsigned parentLevel = level + 1;
+        NodePtr start = parentLevel < path.levels && parentLevel < BLinkMaxLevels ? path.parents[parentLevel] : nullptr;
+        if (start == nullptr)
+            start = findAt(parentLevel, sep);
+        Inner* parent = asInner(lockCovering(start, sep));
+        unsigned n = parent->count.load(std::memory_order_relaxed);
+        if (n < Inner::Capacity)
+        {
+            insertInner(parent, sep, right);
+            unlock(parent);
+            return;
+        }
+        // the middle key moves up; the keys after it and the children from
+        // just after it on go right. as with leaves, a separator past the
+        // end leaves the node full, but for the last key, which moves up
+        unsigned half = Search::upperBound(parent->keys, n, sep, comp) == n ? n - 1 : n / 2;
+        Inner* sibling = newInner(parentLevel);
+        K up = parent->keys[half].load(std::memory_order_relaxed);
+        blinkCopy(parent->keys + half + 1, parent->keys + n, sibling->keys);
+        for (unsigned c = half + 1; c <= n; ++c)
+            sibling->children[c - half - 1].store(parent->children[c].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        sibling->count.store(n - half - 1, std::memory_order_relaxed);
+        sibling->hasHigh.store(parent->hasHigh.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        sibling->high.store(parent->high.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        sibling->next.store(parent->next.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        parent->count.store(half, std::memory_order_relaxed);
+        parent->hasHigh.store(true, std::memory_order_relaxed);
+        parent->high.store(up, std::memory_order_relaxed);
+        parent->next.store(sibling, std::memory_order_release);
+        insertInner(comp(sep, up) ? parent : sibling, sep, right);
+        unlock(parent);
+        level = parentLevel;
+        sep = up;
+        right = sibling;
+    }
+}
+
+// the child sep goes in after is the node that was split, or one to the
+// right of it that is still waiting for its own link; either way it holds
+// the keys just below sep
+template <typename K, typename V, typename Compare, typename Alloc>
+void BLinkTreeMap<K, V, Compare, Alloc>::insertInner(Inner* node, const K& sep, NodePtr right)
+{
+    unsigned n = node->count.load(std::memory_order_relaxed);
+    unsigned i = Search::upperBound(node->keys, n, sep, comp);
+    blinkCopyBackward(node->keys + i, node->keys + n, node->keys + n + 1);
+    for (unsigned c = n + 1; c > i + 1; --c)
+        node->children[c].store(node->children[c - 1].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    node->keys[i].store(sep, std::memory_order_relaxed);
+    node->children[i + 1].store(right, std::memory_order_release);
+    node->count.store(n + 1, std::memory_order_relaxed);
+}
+
+// the parent is locked first, then the two children from left to right, the
+// same order any other merge takes them in, while puts and splits hold one
+// lock at a time. a left child whose next isn't the right one has split and
+// the new node isn't in the parent yet, so the two are left alone; a right
+// child that has split hands its next to the left one, and the new node's
+// link goes in after the left one when its turn comes
+template <typename K, typename V, typename Compare, typename Alloc>
+void BLinkTreeMap<K, V, Compare, Alloc>::mergeAt(unsigned level, const K& k, const Path& path)
+{
+    while (root.load(std::memory_order_acquire)->level > level)
+    {
+        unsigned parentLevel = level + 1;
+        NodePtr start = parentLevel < path.levels && parentLevel < BLinkMaxLevels ? path.parents[parentLevel] : nullptr;
+        if (start == nullptr)
+            start = findAt(parentLevel, k);
+        Inner* parent = asInner(lockCovering(start, k));
+        unsigned n = parent->count.load(std::memory_order_relaxed);
+        if (n == 0)
+        {
+            // nothing to merge with here, but the parent may have a neighbour
+            unlock(parent);
+            level = parentLevel;
+            continue;
+        }
+        unsigned i = Search::upperBound(parent->keys, n, k, comp);
+        unsigned j = i < n ? i : i - 1;
+        NodePtr left = parent->children[j].load(std::memory_order_relaxed);
+        NodePtr right = parent->children[j + 1].load(std::memory_order_relaxed);
+        lock(left);
+        lock(right);
+        unsigned ln = left->count.load(std::memory_order_relaxed);
+        unsigned rn = right->count.load(std::memory_order_relaxed);
+        unsigned capacity = level == 0 ? Leaf::Capacity : Inner::Capacity;
+        unsigned total = level == 0 ? ln + rn : ln + 1 + rn;
+        bool fits = total <= capacity && (total <= capacity - capacity / 4 || ln == 0 || rn == 0);
+        if (!fits || left->next.load(std::memory_order_relaxed) != right)
+        {
+            unlock(right);
+            unlock(left);
+            unlock(parent);
+            return;
+        }
+        if (level == 0)
+        {
+            blinkCopy(asLeaf(right)->keys, asLeaf(right)->keys + rn, asLeaf(left)->keys + ln);
+            blinkCopy(asLeaf(right)->values, asLeaf(right)->values + rn, asLeaf(left)->values + ln);
+            left->count.store(ln + rn, std::memory_order_relaxed);
+        }
+        else
+        {
+            // the separator between the two comes down between their keys
+            Inner* l = asInner(left);
+            Inner* r = asInner(right);
+            l->keys[ln].store(parent->keys[j].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            blinkCopy(r->keys, r->keys + rn, l->keys + ln + 1);
+            for (unsigned c = 0; c <= rn; ++c)
+                l->children[ln + 1 + c].store(r->children[c].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            left->count.store(ln + 1 + rn, std::memory_order_relaxed);
+        }
+        left->hasHigh.store(right->hasHigh.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        left->high.store(right->high.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        left->next.store(right->next.load(std::memory_order_relaxed), std::memory_order_release);
+        right->merged.store(true, std::memory_order_relaxed);
+        right->next.store(left, std::memory_order_release);
+        blinkCopy(parent->keys + j + 1, parent->keys + n, parent->keys + j);
+        for (unsigned c = j + 1; c < n; ++c)
+            parent->children[c].store(parent->children[c + 1].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        parent->count.store(n - 1, std::memory_order_relaxed);
+        unlock(right);
+        unlock(left);
+        unlock(parent);
+        epoch.retire(right);
+        if (n - 1 >= Inner::Capacity / 4)
+            return;
+        level = parentLevel;
+    }
+}
+
+// the node's version once no writer holds it
+template <typename K, typename V, typename Compare, typename Alloc>
+std::uint64_t BLinkTreeMap<K, V, Compare, Alloc>::stableVersion(NodePtr node)
+{
+    int spins = 0;
+    while (true)
+    {
+        std::uint64_t version = node->version.load(std::memory_order_acquire);
+        if ((version & 1) == 0)
+            return version;
+        if (++spins == BLinkSpinCount)
+        {
+            spins = 0;
+            std::this_thread::yield();
+        }
+    }
+}
+
+// was what was read of node since stableVersion returned version all from
+// the same moment?
+template <typename K, typename V, typename Compare, typename Alloc>
+bool BLinkTreeMap<K, V, Compare, Alloc>::validate(NodePtr node, std::uint64_t version)
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return node->version.load(std::memory_order_relaxed) == version;
+}
+
+// the fence keeps the writes that follow from being seen before the version
+// turns odd
+template <typename K, typename V, typename Compare, typename Alloc>
+void BLinkTreeMap<K, V, Compare, Alloc>::lock(NodePtr node)
+{
+    while (true)
+    {
+        std::uint64_t version = stableVersion(node);
+        if (node->version.compare_exchange_weak(version, version + 1, std::memory_order_acquire, std::memory_order_relaxed))
+            break;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+void BLinkTreeMap<K, V, Compare, Alloc>::unlock(NodePtr node)
+{
+    node->version.store(node->version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+typename BLinkTreeMap<K, V, Compare, Alloc>::Leaf* BLinkTreeMap<K, V, Compare, Alloc>::newLeaf()
+{
+    return ::new (nodePool.allocate()) Leaf();
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+typename BLinkTreeMap<K, V, Compare, Alloc>::Inner* BLinkTreeMap<K, V, Compare, Alloc>::newInner(unsigned level)
+{
+    return ::new (nodePool.allocate()) Inner(level);
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+void BLinkTreeMap<K, V, Compare, Alloc>::deleteNode(void* context, void* p)
+{
+    BLinkTreeMap* map = static_cast<BLinkTreeMap*>(context);
+    map->nodePool.deallocate(p);
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+void* BLinkTreeMap<K, V, Compare, Alloc>::allocateRegion(void* context, std::size_t bytes)
+{
+    BLinkTreeMap* map = static_cast<BLinkTreeMap*>(context);
+    return RegionAllocTraits::allocate(map->regionAlloc, bytes);
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+void BLinkTreeMap<K, V, Compare, Alloc>::deallocateRegion(void* context, void* p, std::size_t bytes)
+{
+    BLinkTreeMap* map = static_cast<BLinkTreeMap*>(context);
+    RegionAllocTraits::deallocate(map->regionAlloc, static_cast<char*>(p), bytes);
+}
+
+// the int/int map is compiled once, in blinktree.cpp
+extern template class BLinkTreeMap<int, int>;
+
+#endif
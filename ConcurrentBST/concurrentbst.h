@@ -2,91 +2,2671 @@
 #define CONCURRENTBST_H
 
 #include <memory>
+#include <optional>
 #include <utility>
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <type_traits>
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <iterator>
+#include <cassert>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <cstring>
+#include "epoch.h"
+#include "gate.h"
+#include "image.h"
+#include "slab.h"
+#include "stats.h"
 
-typedef int K;
-typedef int V;
+// version layout: a node that is rotated up "grows" (its key range widens),
+// a node that is rotated down "shrinks"; only shrinking invalidates a
+// traversal that already went through the node. the node's lock is a bit in
+// the same word, and taking it doesn't invalidate anything either. a frozen
+// node is shared with a snapshot and never changes again; readers don't
+// care about that, writers copy it first
+const long Unlinked = 0x1L;
+const long Growing = 0x2L;
+const long Shrinking = 0x4L;
+const long Locked = 0x8L;
+const long Frozen = 0x10L;
+const long GrowCountIncr = 0x1L << 5;
+const long GrowCountMask = 0xffL << 5;
+const long ShrinkCountIncr = 0x1L << 13;
+const long IgnoreGrow = ~(Growing | GrowCountMask | Locked | Frozen);
 
-struct Node;
-//typedef struct Node* NodePtr;
-typedef Node* NodePtr;
+inline bool isUnlinked(long version)
+{
+    return (version & Unlinked) != 0;
+}
 
-struct Node
+inline bool isFrozen(long version)
 {
-    std::mutex m;
-    long version;
+    return (version & Frozen) != 0;
+}
+
+// nodeCondition() returns either the height a node should have or one of these
+const int UnlinkRequired = -1;
+const int RebalanceRequired = -2;
+const int NothingRequired = -3;
+
+// how many times a reader polls a shrinking node before blocking on its lock,
+// and how many times a locker spins before it starts yielding
+const int SpinCount = 100;
+
+// a descent that keeps finding the tree changed under it backs off once it
+// has retried more than BackoffAfter times: it pauses for twice as long
+// after every further retry, up to 2^MaxBackoffShift pauses, and yields
+// from then on
+const unsigned BackoffAfter = 2;
+const unsigned MaxBackoffShift = 10;
+
+// one spin of a wait loop; tells the core we're spinning, so it doesn't
+// starve its sibling hyperthread or flush its pipeline when the wait ends
+inline void cpuRelax()
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_ia32_pause();
+#elif defined(__GNUC__) && defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// asks for the cache line at p without waiting for it. only a hint, so p
+// may be null or about to be stale
+inline void prefetch(const void* p)
+{
+#if defined(__GNUC__)
+    __builtin_prefetch(p);
+#else
+    (void)p;
+#endif
+}
+
+inline void backOff(unsigned retries)
+{
+    if (retries <= BackoffAfter)
+        return;
+    unsigned shift = retries - BackoffAfter;
+    if (shift > MaxBackoffShift)
+    {
+        std::this_thread::yield();
+        return;
+    }
+    for (unsigned i = 0; i < (1u << shift); ++i)
+        cpuRelax();
+}
+
+// how many levels of a descent are remembered for retrying from an ancestor
+const unsigned PathCapacity = 64;
+
+// how many nodes an ordered walk visits (or keys a batch operation handles)
+// before it leaves its epoch critical section and picks up again where it
+// was, so that a long scan or batch doesn't hold up reclamation
+const unsigned WalkBatch = 1024;
+
+// most keys a batch put links in with one lock (as one balanced subtree)
+const unsigned MaxBatchRun = 64;
+
+// lookups getAll keeps going at once. each one takes a step and prefetches
+// the node it needs next while the others take theirs, so up to this many
+// cache misses are outstanding instead of one
+const unsigned GetAllWidth = 16;
+
+// times a batch put climbs from a linked run back up to the root looking for
+// damage its repairs left behind; whatever concurrent writers keep bringing
+// back after that is left to the repairs of later operations
+const unsigned RunRepairSweeps = 2;
+
+// most routing nodes one repair sets aside to unlink after it's done; any
+// beyond that wait for the next repair that passes them
+const unsigned StrandedCapacity = 8;
+
+// bulkLoad doesn't hand ranges smaller than this to a thread of their own
+const long BulkLoadGrain = 1 << 14;
+
+// a node's refs can't count more links than this, so this many snapshots
+// less one can be alive at once
+const unsigned MaxSnapshots = 0xfffe;
+
+// every field that is read without holding the node's lock is atomic;
+// rotations rewrite links and heights while readers are passing through.
+// a logically deleted (routing) node keeps its key and has tombstone set.
+// the fields every level of a descent reads (version, links, key) come
+// first, so for int keys they fit in 32 bytes, and the whole int/int node in
+// 48; nodes start on a size-class boundary of the slab they live in.
+// refs is 0 until the node is frozen; from then on it counts the links to
+// it (from parents in the live tree and in snapshots, and from snapshots'
+// roots), and the node is freed when the last one goes. a frozen node's
+// parent is stale and never followed
+template <typename K, typename V>
+struct alignas(SlabSizeClass) Node
+{
+    typedef Node* NodePtr;
+
+    std::atomic<long> version;
+    std::atomic<NodePtr> left;
+    std::atomic<NodePtr> right;
     const K key;
-    V value;
-    NodePtr parent;
-    NodePtr left;
-    NodePtr right;
+    std::atomic<int> height;
+    std::atomic<NodePtr> parent;
+    std::atomic<V> value;
+    std::atomic<bool> tombstone;
+    std::atomic<unsigned short> refs;
 
-    Node(K k = std::numeric_limits<K>::min())
-        : m(), version(0), key(k), value(0), parent(nullptr), left(nullptr), right(nullptr) {}
-    Node(K k, V v, const NodePtr& par, long nodeV, const NodePtr& l, const NodePtr& r)
-        : m(), version(nodeV), key(k), value(v), parent(par), left(l), right(r) {}
-    NodePtr& child(int dir)
+    Node()
+        : version(0), left(nullptr), right(nullptr), key(), height(0), parent(nullptr), value(V()), tombstone(false), refs(0) {}
+    Node(const K& k, const V& v, const NodePtr& par, long nodeV, const NodePtr& l, const NodePtr& r)
+        : version(nodeV), left(l), right(r), key(k), height(1), parent(par), value(v), tombstone(false), refs(0) {}
+    // lockable through std::unique_lock. critical sections are a few stores
+    // long, so a spinning locker gets the lock soon; rotations hold it
+    // longest, and a reader that has to wait for one yields instead
+    void lock()
+    {
+        int spins = 0;
+        long v = version.load(std::memory_order_relaxed);
+        while ((v & Locked) != 0 || !version.compare_exchange_weak(v, v | Locked, std::memory_order_acquire, std::memory_order_relaxed))
+        {
+            if (++spins > SpinCount)
+                std::this_thread::yield();
+            else
+                cpuRelax();
+            v = version.load(std::memory_order_relaxed);
+        }
+    }
+    bool try_lock()
+    {
+        long v = version.load(std::memory_order_relaxed);
+        return (v & Locked) == 0 && version.compare_exchange_strong(v, v | Locked, std::memory_order_acquire, std::memory_order_relaxed);
+    }
+    // nobody else writes version while we hold the lock
+    void unlock()
+    {
+        version.store(version.load(std::memory_order_relaxed) & ~Locked, std::memory_order_release);
+    }
+    NodePtr child(int dir) const
     {
         if (dir == -1)
             return left;
         else
             return right;
     }
+    void setChild(int dir, NodePtr c)
+    {
+        if (dir == -1)
+            left.store(c, std::memory_order_release);
+        else
+            right.store(c, std::memory_order_release);
+    }
     void print(int depth) const
     {
         
-        std::cerr << "(" << key << ", " << value << ") [depth=" << depth << "]\n";
-        if (left) left->print(depth + 1);
-        if (right) right->print(depth + 1);
+        std::cerr << "(" << key << ", " << value.load() << (tombstone ? ", deleted" : "") << ") [depth=" << depth << ", height=" << height << "]\n";
+        NodePtr l = left, r = right;
+        if (l) l->print(depth + 1);
+        if (r) r->print(depth + 1);
     }
 };
 
+// what a descent's action reports. Retry never leaves the map: the public
+// operations turn Success into a value and Null into an empty optional
 enum class Result { Null, Retry, Success };
 
+template <typename T>
+std::optional<T> valueOf(const std::pair<Result,T>& result)
+{
+    if (result.first == Result::Success)
+        return result.second;
+    return std::nullopt;
+}
+
+// an entry as save() writes it to an image (see image.h). the members are
+// named like std::pair's, so bulkLoad takes a mapped image's entries as they are
+template <typename K, typename V>
+struct ImageEntry
+{
+    K first;
+    V second;
+};
+
+// Compare is a strict weak ordering on K, like std::map's. nodes come from a
+// per-thread slab pool; Alloc is rebound to char and only supplies the pool's
+// regions, which may happen on any thread that inserts, so it has to be
+// thread-safe. values are read without locks and must be trivially copyable
+template <typename K, typename V, typename Compare = std::less<K>, typename Alloc = std::allocator<std::pair<const K, V> > >
 class ConcurrentBSTMap
 {
+    static_assert(std::is_trivially_copyable<V>::value, "ConcurrentBSTMap values are read without locks and must be trivially copyable");
+
 public:
-    ConcurrentBSTMap();
+    typedef Node<K, V>* NodePtr;
+    typedef std::unique_lock<Node<K, V> > NodeLock;
+    typedef std::pair<K, V> Entry;
+
+    explicit ConcurrentBSTMap(const Compare& comp = Compare(), const Alloc& alloc = Alloc());
+    // a map holding a sorted range, as if by bulkLoad
+    template <typename RandomIt>
+    ConcurrentBSTMap(RandomIt first, RandomIt last, const Compare& comp = Compare(), const Alloc& alloc = Alloc());
     ~ConcurrentBSTMap();
 
-    std::pair<Result,V> get(K k);
-    std::pair<Result,V> put(K k, V v);
-    std::pair<Result,V> remove(K k);
-    
+    // none of these fail or ask to be retried: a descent that finds the tree
+    // changed under it backs up to the deepest level it can still trust,
+    // and backs off if that keeps happening. put and remove return the
+    // value the key had, if it had one
+    std::optional<V> get(const K& k);
+    std::optional<V> put(const K& k, const V& v);
+    std::optional<V> remove(const K& k);
+    // batches sorted by key (ascending under Compare). the result for each
+    // key is what put/remove would have returned for it; the batch as a whole
+    // isn't atomic. each key's descent starts from the deepest level it
+    // shares with the previous key's, and consecutive keys that all belong
+    // on the same empty link are linked in under a single lock. unsorted
+    // input is still handled correctly, just without the sharing
+    template <typename RandomIt>
+    std::vector<std::optional<V> > putAll(RandomIt first, RandomIt last);
+    template <typename RandomIt>
+    std::vector<std::optional<V> > removeAll(RandomIt first, RandomIt last);
+    // gets for a batch of keys in any order, with the results in the same
+    // order; as with putAll, the batch as a whole isn't atomic. the descents
+    // of up to GetAllWidth keys advance a level at a time in turn, so a
+    // cache miss on one key's path is already on its way while the others
+    // step down theirs
+    template <typename RandomIt>
+    std::vector<std::optional<V> > getAll(RandomIt first, RandomIt last);
+    // read-modify-writes in a single descent, each decided and applied under
+    // the lock of the node that holds the key (or that the key would hang
+    // from), so they're atomic with respect to every other write of the key.
+    // putIfAbsent puts v only if k has no value and returns the value k
+    // already had, if any. replace stores desired only if k's value is
+    // expected. compute calls fn(current), with current empty if k has no
+    // value, exactly once; if fn returns a value it is stored, and if it
+    // returns nothing k is left as it was (compute never removes). it returns
+    // the value k has afterwards. fn runs under a node lock, so it must be
+    // short and must not use the map. fetchAdd adds delta to k's value (an
+    // absent key counts as 0) and returns the value from before
+    std::optional<V> putIfAbsent(const K& k, const V& v);
+    bool replace(const K& k, const V& expected, const V& desired);
+    template <typename Fn>
+    std::optional<V> compute(const K& k, Fn fn);
+    V fetchAdd(const K& k, const V& delta);
+    // fills an empty map from a range of (key, value) pairs in strictly
+    // ascending key order (asserted in debug builds), as one perfectly
+    // balanced tree built by up to threads threads, a subtree each. the tree
+    // is linked in with a single store, so other threads see all of it or
+    // none of it. returns false, and leaves the map as it was, if the map
+    // already had nodes in it; if building the tree throws, the nodes built
+    // so far are freed and the map is left as it was too
+    template <typename RandomIt>
+    bool bulkLoad(RandomIt first, RandomIt last, unsigned threads = std::thread::hardware_concurrency());
+    // height of the tree (0 when empty); exact once rebalancing has quiesced
+    int height() const;
+    // call from a thread that is between operations (e.g. between batches, or
+    // before going idle) to free the nodes it has unlinked as soon as possible
+    void quiescent();
+    // removes everything and gives all node memory back at once; no other
+    // thread may be using the map
+    void clear();
+    // what the map has been doing since it was created or last reset; all
+    // zeros unless built with CONCURRENTBST_STATS (see stats.h)
+    MapStats stats();
+    void resetStats();
+    // the share of the tree's nodes that are routing nodes. a routing node
+    // is unlinked as soon as it has fewer than two children, by whichever
+    // operation repairs it next, so once repairs settle every routing node
+    // has two children and this stays below 1/2
+    double routingRatio();
+    // the number of keys in the map, as of one instant between the writes
+    // around it: it holds writers off (as snapshot() does) while it adds up
+    // the per-thread counts, so it costs them a pause that grows with the
+    // number of threads. readers aren't affected
+    std::size_t size();
+    bool empty() { return size() == 0; }
+    // the same sum without holding anyone off; it can be off by the writes
+    // in progress while it runs. cheap enough to poll
+    std::size_t approximateSize();
+
+    // ordered queries. none of these take more than the usual node locks, so
+    // none of them is an atomic snapshot: every entry reported was in the map
+    // at some point during the call, keys come in strictly increasing order
+    // (decreasing for floor/last), and a key that stays in the map for the
+    // whole call is never skipped. keys put or removed during the call may or
+    // may not show up
+
+    // calls callback(key, value) for every key in [lo, hi), in order
+    template <typename Callback>
+    void scan(const K& lo, const K& hi, Callback callback);
+    // the greatest key <= k, the smallest key >= k, the smallest key > k
+    std::optional<Entry> floor(const K& k);
+    std::optional<Entry> ceiling(const K& k);
+    std::optional<Entry> successor(const K& k);
+    std::optional<Entry> first();
+    std::optional<Entry> last();
+
+    // a read-only view of the whole map as it was at one instant. taking one
+    // costs O(1): it only waits for the writes in progress to finish, and the
+    // tree is then shared until writers copy the nodes they change, one path
+    // at a time. a snapshot never changes, so reading it takes no locks and
+    // no retries. dropping it frees whatever the map no longer shares with
+    // it. every snapshot has to be dropped before the map is cleared or
+    // destroyed
+    class Snapshot
+    {
+    public:
+        Snapshot(Snapshot&& rhs);
+        ~Snapshot();
+
+        std::optional<V> get(const K& k) const;
+        template <typename Callback>
+        void scan(const K& lo, const K& hi, Callback callback) const;
+        std::optional<Entry> floor(const K& k) const;
+        std::optional<Entry> ceiling(const K& k) const;
+        std::optional<Entry> successor(const K& k) const;
+        std::optional<Entry> first() const;
+        std::optional<Entry> last() const;
+        // writes the snapshot to path as an image, front to back
+        void save(const std::string& path) const;
+
+    private:
+        friend class ConcurrentBSTMap;
+        Snapshot(ConcurrentBSTMap* map, NodePtr root);
+        Snapshot(const Snapshot& rhs);
+        Snapshot& operator=(const Snapshot& rhs);
+
+        template <typename Visitor>
+        void walk(const K* from, bool inclusive, int dir, Visitor& visit) const;
+        std::pair<Result,Entry> nearest(const K* from, bool inclusive, int dir) const;
+
+        ConcurrentBSTMap* map;
+        NodePtr root;
+    };
+    // throws std::length_error if MaxSnapshots are alive already
+    Snapshot snapshot();
+
+    // a thread's finger into the map: get/put/remove that start from where
+    // the finger's last operation went down, at the deepest level that still
+    // lies on the new key's way, instead of from rootHolder. keys that come
+    // (nearly) in order share all but the last few levels of their paths. a
+    // level is trusted as long as its node's version says it wasn't rotated
+    // down or unlinked, as on any descent's retry; the whole path is dropped
+    // once a snapshot has been taken, as its nodes may be shared with the
+    // snapshot then. to keep the nodes on its path from being freed, a
+    // finger stays in an epoch critical section for WalkBatch operations at
+    // a time (or until release()), which holds up reclamation, so release()
+    // it before going idle. a finger is used only by the thread that made
+    // it, and is dropped before the map is cleared or destroyed
+    class Finger;
+    Finger finger();
+
+    // images: the entries of a snapshot in key order, written out while the
+    // map stays live, and mapped back in without being read (see image.h).
+    // keys have to be trivially copyable too. both throw std::runtime_error
+    // when the file can't be written or isn't an image of this K and V
+    void save(const std::string& path);
+    // makes the map answer get() and size() straight from a read-only mapping
+    // of the image at path; whatever else comes first (a write, a scan, a
+    // snapshot) loads the image into nodes, as bulkLoad would, and from then
+    // on the map works as usual. returns false, and leaves the map as it
+    // was, if the map already had nodes in it. no other thread may be using
+    // the map; the mapping stays until the map is cleared or destroyed
+    bool load(const std::string& path);
+
 private:
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<char> RegionAlloc;
+    typedef std::allocator_traits<RegionAlloc> RegionAllocTraits;
+
     bool canUnlink(NodePtr& n);
-    int compare(K a, K b);
+    int compare(const K& a, const K& b) const;
     bool isRoutingNode(NodePtr& node);
-    void deleteTree(NodePtr& node);
+    template <typename... Args>
+    NodePtr newNode(Args&&... args);
+    void destroyNode(NodePtr node);
+    void deleteTree(NodePtr node);
+    void destroyTree();
+    static void deleteNode(void* context, void* p);
+    static void* allocateRegion(void* context, std::size_t bytes);
+    static void deallocateRegion(void* context, void* p, std::size_t bytes);
     ConcurrentBSTMap(const ConcurrentBSTMap& rhs);
     ConcurrentBSTMap& operator=(const ConcurrentBSTMap& rhs);
     void print();
+    // the calling thread's counters, or nullptr when stats are compiled out
+    StatsRecord* localStats();
+    // copy-on-write; see Snapshot
+    void freeze(NodePtr node);
+    void release(NodePtr node);
+    NodePtr unshareLocked(NodePtr par, int dir);
+    void countNodes(long long nodes, long long routing);
+    template <typename RandomIt>
+    bool bulkLoadNodes(RandomIt first, RandomIt last, unsigned threads);
+    // bulkLoadNodes' last step: links root in if the map is still empty and
+    // linkOthers() says so too, which runs with rootHolder locked. that lets
+    // ShardedBSTMap link every shard's tree or none
+    template <typename LinkOthers>
+    bool linkRoot(NodePtr root, long long nodes, LinkOthers linkOthers);
+    template <typename K2, typename V2, typename Compare2, typename Alloc2>
+    friend class ShardedBSTMap;
+    // everything but get() and size() calls this before it looks at nodes
+    void ensureNodes()
+    {
+        if (mapped.load(std::memory_order_acquire) != nullptr)
+            loadMapped();
+    }
+    void loadMapped();
+    std::pair<Result,V> getMapped(const ImageFile& file, const K& k);
+    // nodes that aren't routing nodes, summed over every thread's counts
+    long long countKeys();
+    NodeLock lockNode(NodePtr node);
+
+    // one level of a descent: the node we're standing on, the version it had
+    // when we got there, and which way we're headed
+    struct PathFrame
+    {
+        NodePtr node;
+        long version;
+        int dir;
+    };
+    // the deepest PathCapacity levels of a descent, as a ring; oldest is the
+    // shallowest level still remembered
+    struct Path
+    {
+        PathFrame frames[PathCapacity];
+        unsigned depth;
+        unsigned oldest;
+    };
+    // what get/put/remove do once the descent stops, either on the node with
+    // the key (found) or on the empty link where it would be (missing);
+    // returning RetryPair makes the descent try again from the same level.
+    // Stat says which operation's counters the descent goes to; the descent
+    // of an action that Writes copies every frozen node it steps on, so the
+    // action only ever sees nodes of the live tree's own
+    struct GetAction;
+    struct PutAction;
+    struct RemoveAction;
+    template <typename RandomIt>
+    struct PutRunAction;
+    template <typename Fn>
+    struct ComputeAction;
+    template <typename Fn>
+    std::optional<V> readModifyWrite(const K& k, Fn& fn);
+    template <typename Action>
+    std::pair<Result,V> descend(const K& k, Action& action);
+    template <typename Action>
+    std::pair<Result,V> descend(Path& path, const K& k, Action& action);
+    void resetPath(Path& path);
+    void resumePath(Path& path, const K& k);
+    bool pathCovers(const Path& path, const K& k);
+    // one of getAll's descents: the level it's on, like a frame of a Path,
+    // and where its key and result are
+    struct GetLane
+    {
+        std::size_t index;
+        NodePtr node;
+        long nodeV;
+        int dir;
+    };
+    void startLane(GetLane& lane, std::size_t index);
+    bool stepLane(GetLane& lane, const K& k, std::optional<V>& result);
+    // is the range in strictly ascending key order? for asserts
+    template <typename RandomIt>
+    bool ascending(RandomIt first, RandomIt last) const;
+    template <typename RandomIt>
+    NodePtr buildSubtree(NodePtr parent, RandomIt first, RandomIt last);
+    template <typename RandomIt>
+    NodePtr buildSubtreeParallel(NodePtr parent, RandomIt first, RandomIt last, unsigned threads);
+    // in-order walk in direction dir (1 ascending, -1 descending), starting
+    // at from (or at the very end when from is null); visit(key, value)
+    // returns false to stop
+    template <typename Visitor>
+    void walk(const K* from, bool inclusive, int dir, Visitor& visit);
+    bool readChild(NodePtr node, long nodeV, int dir, NodePtr& child, long& childV);
+    std::pair<Result,Entry> nearest(const K* from, bool inclusive, int dir);
 
-    // non-blocking methods
-    std::pair<Result,V> attemptGet(K k, NodePtr& node, int dir, long nodeV);
-    std::pair<Result,V> attemptPut(K k, V v, NodePtr& node, int dir, long nodeV);
-    std::pair<Result,V> attemptInsert(K k, V v, NodePtr& node, int dir, long nodeV);
-    std::pair<Result,V> attemptUpdate(NodePtr& node, V v);
-    std::pair<Result,V> attemptRemove(K k, NodePtr& node, int dir, long nodeV);
+    // non-blocking methods. the Computed versions ask fn, once the node is
+    // locked and checked, what value to store (see compute); the others store v
+    std::pair<Result,V> attemptInsert(const K& k, const V& v, NodePtr& node, int dir, long nodeV);
+    template <typename Fn>
+    std::pair<Result,V> attemptInsertComputed(const K& k, Fn& fn, NodePtr& node, int dir, long nodeV);
+    template <typename RandomIt>
+    std::pair<Result,V> attemptInsertRun(RandomIt first, RandomIt last, NodePtr& node, int dir, long nodeV);
+    std::pair<Result,V> attemptUpdate(NodePtr& node, const V& v);
+    template <typename Fn>
+    std::pair<Result,V> attemptUpdateComputed(NodePtr& node, Fn& fn);
     std::pair<Result,V> attemptRmNode(NodePtr& par, NodePtr& n);
+    void unlinkLocked(NodePtr par, NodePtr n);
+    void waitUntilShrinkCompleted(NodePtr& node, long nodeV);
     void enableDebugOutput(bool enable);
 
+    // relaxed AVL balancing (Bronson et al.); *Locked methods expect the
+    // caller to hold the locks of every node passed in, and return the next
+    // damaged node the caller is responsible for (or nullptr)
+    static int height(NodePtr node);
+    int nodeCondition(NodePtr node);
+    void fixHeightAndRebalance(NodePtr node);
+    void repairUpwards(NodePtr node, NodePtr* stranded, unsigned& numStranded);
+    NodePtr fixHeightLocked(NodePtr node);
+    NodePtr rebalanceLocked(NodePtr par, NodePtr n);
+    NodePtr rebalanceToRightLocked(NodePtr par, NodePtr n, NodePtr nL, int hR0);
+    NodePtr rebalanceToLeftLocked(NodePtr par, NodePtr n, NodePtr nR, int hL0);
+    NodePtr rotateRightLocked(NodePtr par, NodePtr n, NodePtr nL, int hR, int hLL, NodePtr nLR, int hLR);
+    NodePtr rotateLeftLocked(NodePtr par, NodePtr n, NodePtr nR, int hL, int hRR, NodePtr nRL, int hRL);
+    NodePtr rotateRightOverLeftLocked(NodePtr par, NodePtr n, NodePtr nL, int hR, int hLL, NodePtr nLR, int hLRL);
+    NodePtr rotateLeftOverRightLocked(NodePtr par, NodePtr n, NodePtr nR, int hL, int hRR, NodePtr nRL, int hRLR);
+
 private:
-    std::mutex unlinkMutex;
+    Compare comp;
+    RegionAlloc regionAlloc;
+    SlabPool nodePool;
     NodePtr rootHolder;
     bool debug;
-    std::vector<NodePtr> unlinkedNodes;
-    const std::pair<Result,V> RetryPair = std::make_pair(Result::Retry, 0);
-    const std::pair<Result,V> NullPair = std::make_pair(Result::Null, 0);
+    // unlinked nodes wait here until no reader can still be on them
+    EpochManager epoch;
+    StatsCollector statsCollector;
+    // nodes in the tree and how many of them are routing nodes, as per-thread
+    // deltas; only the owning thread writes its slot
+    struct NodeCounts
+    {
+        NodeCounts() : nodes(0), routing(0) {}
+        std::atomic<long long> nodes;
+        std::atomic<long long> routing;
+    };
+    PerThread<NodeCounts> nodeCounts;
+    // every write goes through here, so that a snapshot can wait them out
+    WriterGate writers;
+    std::atomic<unsigned> liveSnapshots;
+    // how many snapshots were ever taken; a finger's path is only good
+    // while this stays the same
+    std::atomic<unsigned long> snapshotsTaken;
+    // the image load() mapped; mapped is cleared once its entries are in the
+    // tree, but the mapping stays until clear(), since readers may still be
+    // on it
+    std::unique_ptr<ImageFile> image;
+    std::atomic<ImageFile*> mapped;
+    std::mutex loadingMapped;
+    const std::pair<Result,V> RetryPair = std::make_pair(Result::Retry, V());
+    const std::pair<Result,V> NullPair = std::make_pair(Result::Null, V());
 };
 
-const long Unlinked = 0x1L;
-const long Growing = 0x2L;
-const long GrowCountMask = 0xffL << 3;
-const long IgnoreGrow = ~(Growing | GrowCountMask);
+template <typename K, typename V, typename Compare, typename Alloc>
+class ConcurrentBSTMap<K, V, Compare, Alloc>::Finger
+{
+public:
+    Finger(Finger&& rhs);
+    ~Finger();
+
+    std::optional<V> get(const K& k);
+    std::optional<V> put(const K& k, const V& v);
+    std::optional<V> remove(const K& k);
+    // forgets the path and leaves the epoch critical section; the next
+    // operation starts from rootHolder again
+    void release();
+
+private:
+    friend class ConcurrentBSTMap;
+    explicit Finger(ConcurrentBSTMap* map);
+    Finger(const Finger& rhs);
+    Finger& operator=(const Finger& rhs);
+
+    // gets the path ready for k's descent, entering the epoch if need be
+    void resume(const K& k, bool writing);
+    void done();
+
+    ConcurrentBSTMap* map;
+    Path path;
+    // snapshotsTaken when the path was started
+    unsigned long generation;
+    // operations since the finger entered the epoch; 0 while it's outside
+    unsigned ops;
+};
+
+template <typename K, typename V, typename Compare, typename Alloc>
+ConcurrentBSTMap<K, V, Compare, Alloc>::ConcurrentBSTMap(const Compare& comp, const Alloc& alloc)
+    : comp(comp), regionAlloc(alloc), nodePool(sizeof(Node<K, V>), allocateRegion, deallocateRegion, this),
+      rootHolder(newNode()), debug(false), epoch(deleteNode, this), liveSnapshots(0), snapshotsTaken(0), image(), mapped(nullptr), loadingMapped()
+{}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename RandomIt>
+ConcurrentBSTMap<K, V, Compare, Alloc>::ConcurrentBSTMap(RandomIt first, RandomIt last, const Compare& comp, const Alloc& alloc)
+    : ConcurrentBSTMap(comp, alloc)
+{
+    bulkLoad(first, last);
+}
+
+// retired nodes are freed by epoch's destructor, and the node memory goes
+// back in bulk when nodePool is destroyed after it
+template <typename K, typename V, typename Compare, typename Alloc>
+ConcurrentBSTMap<K, V, Compare, Alloc>::~ConcurrentBSTMap()
+{
+    destroyTree();
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+struct ConcurrentBSTMap<K, V, Compare, Alloc>::GetAction
+{
+    static const StatOp Stat = StatGet;
+    static const bool Writes = false;
+    ConcurrentBSTMap& map;
+    std::pair<Result,V> found(NodePtr& par, NodePtr& n)
+    {
+        (void)par;
+        if (map.isRoutingNode(n))
+            return map.NullPair;
+        return std::make_pair(Result::Success, n->value.load(std::memory_order_acquire));
+    }
+    std::pair<Result,V> missing(NodePtr& node, int dir, long nodeV)
+    {
+        (void)node; (void)dir; (void)nodeV;
+        return map.NullPair;
+    }
+};
+
+template <typename K, typename V, typename Compare, typename Alloc>
+struct ConcurrentBSTMap<K, V, Compare, Alloc>::PutAction
+{
+    static const StatOp Stat = StatPut;
+    static const bool Writes = true;
+    ConcurrentBSTMap& map;
+    const K& k;
+    const V& v;
+    std::pair<Result,V> found(NodePtr& par, NodePtr& n)
+    {
+        (void)par;
+        return map.attemptUpdate(n, v);
+    }
+    std::pair<Result,V> missing(NodePtr& node, int dir, long nodeV)
+    {
+        return map.attemptInsert(k, v, node, dir, nodeV);
+    }
+};
+
+template <typename K, typename V, typename Compare, typename Alloc>
+struct ConcurrentBSTMap<K, V, Compare, Alloc>::RemoveAction
+{
+    static const StatOp Stat = StatRemove;
+    static const bool Writes = true;
+    ConcurrentBSTMap& map;
+    std::pair<Result,V> found(NodePtr& par, NodePtr& n)
+    {
+        return map.attemptRmNode(par, n);
+    }
+    std::pair<Result,V> missing(NodePtr& node, int dir, long nodeV)
+    {
+        (void)node; (void)dir; (void)nodeV;
+        return map.NullPair;
+    }
+};
+
+// a put whose key may be the first of a sorted run: the keys after it that
+// land on the same empty link go in along with it (count says how many)
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename RandomIt>
+struct ConcurrentBSTMap<K, V, Compare, Alloc>::PutRunAction
+{
+    static const StatOp Stat = StatPut;
+    static const bool Writes = true;
+    ConcurrentBSTMap& map;
+    const Path& path;
+    RandomIt first;
+    RandomIt last;
+    std::size_t count;
+    std::pair<Result,V> found(NodePtr& par, NodePtr& n)
+    {
+        (void)par;
+        count = 1;
+        return map.attemptUpdate(n, first->second);
+    }
+    std::pair<Result,V> missing(NodePtr& node, int dir, long nodeV)
+    {
+        RandomIt end = first + 1;
+        while (end != last && static_cast<std::size_t>(end - first) < MaxBatchRun
+               && map.compare((end - 1)->first, end->first) < 0 && map.pathCovers(path, end->first))
+            ++end;
+        count = end - first;
+        if (count == 1)
+            return map.attemptInsert(first->first, first->second, node, dir, nodeV);
+        return map.attemptInsertRun(first, end, node, dir, nodeV);
+    }
+};
+
+// a read-modify-write: fn(current) says what to store, if anything
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename Fn>
+struct ConcurrentBSTMap<K, V, Compare, Alloc>::ComputeAction
+{
+    static const StatOp Stat = StatPut;
+    static const bool Writes = true;
+    ConcurrentBSTMap& map;
+    const K& k;
+    Fn& fn;
+    std::pair<Result,V> found(NodePtr& par, NodePtr& n)
+    {
+        (void)par;
+        return map.attemptUpdateComputed(n, fn);
+    }
+    std::pair<Result,V> missing(NodePtr& node, int dir, long nodeV)
+    {
+        return map.attemptInsertComputed(k, fn, node, dir, nodeV);
+    }
+};
+
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<V> ConcurrentBSTMap<K, V, Compare, Alloc>::get(const K& k)
+{
+    LatencySample sample(localStats(), StatGet);
+    if (ImageFile* file = mapped.load(std::memory_order_acquire))
+        return valueOf(getMapped(*file, k));
+    EpochManager::Guard guard(epoch);
+    GetAction action = { *this };
+    return valueOf(descend(k, action));
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<V> ConcurrentBSTMap<K, V, Compare, Alloc>::put(const K& k, const V& v)
+{
+    ensureNodes();
+    LatencySample sample(localStats(), StatPut);
+    WriterGate::Guard writing(writers);
+    EpochManager::Guard guard(epoch);
+    PutAction action = { *this, k, v };
+    return valueOf(descend(k, action));
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<V> ConcurrentBSTMap<K, V, Compare, Alloc>::remove(const K& k)
+{
+    ensureNodes();
+    LatencySample sample(localStats(), StatRemove);
+    WriterGate::Guard writing(writers);
+    EpochManager::Guard guard(epoch);
+    RemoveAction action = { *this };
+    return valueOf(descend(k, action));
+}
+// returns the value k had before, like put
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename Fn>
+std::optional<V> ConcurrentBSTMap<K, V, Compare, Alloc>::readModifyWrite(const K& k, Fn& fn)
+{
+    ensureNodes();
+    LatencySample sample(localStats(), StatPut);
+    WriterGate::Guard writing(writers);
+    EpochManager::Guard guard(epoch);
+    ComputeAction<Fn> action = { *this, k, fn };
+    return valueOf(descend(k, action));
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<V> ConcurrentBSTMap<K, V, Compare, Alloc>::putIfAbsent(const K& k, const V& v)
+{
+    auto fn = [&v](const std::optional<V>& current) -> std::optional<V>
+    {
+        if (current)
+            return std::nullopt;
+        return v;
+    };
+    return readModifyWrite(k, fn);
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+bool ConcurrentBSTMap<K, V, Compare, Alloc>::replace(const K& k, const V& expected, const V& desired)
+{
+    bool replaced = false;
+    auto fn = [&](const std::optional<V>& current) -> std::optional<V>
+    {
+        if (!current || !(*current == expected))
+            return std::nullopt;
+        replaced = true;
+        return desired;
+    };
+    readModifyWrite(k, fn);
+    return replaced;
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename Fn>
+std::optional<V> ConcurrentBSTMap<K, V, Compare, Alloc>::compute(const K& k, Fn fn)
+{
+    std::optional<V> after;
+    auto apply = [&](const std::optional<V>& current) -> std::optional<V>
+    {
+        std::optional<V> next = fn(current);
+        after = next ? next : current;
+        return next;
+    };
+    readModifyWrite(k, apply);
+    return after;
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+V ConcurrentBSTMap<K, V, Compare, Alloc>::fetchAdd(const K& k, const V& delta)
+{
+    static_assert(std::is_arithmetic<V>::value, "fetchAdd needs arithmetic values");
+    auto fn = [&delta](const std::optional<V>& current) -> std::optional<V>
+    {
+        return static_cast<V>(current.value_or(V()) + delta);
+    };
+    return readModifyWrite(k, fn).value_or(V());
+}
+// nobody can see the new tree until it's linked in, so it's built without
+// locks; the joins make every node visible to the thread that links it, and
+// the link is a release store like any other
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename RandomIt>
+bool ConcurrentBSTMap<K, V, Compare, Alloc>::bulkLoad(RandomIt first, RandomIt last, unsigned threads)
+{
+    assert(ascending(first, last) && "bulkLoad needs keys in strictly ascending order");
+    ensureNodes();
+    return bulkLoadNodes(first, last, threads);
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename RandomIt>
+bool ConcurrentBSTMap<K, V, Compare, Alloc>::bulkLoadNodes(RandomIt first, RandomIt last, unsigned threads)
+{
+    if (rootHolder->right != nullptr)
+        return false;
+    NodePtr root = buildSubtreeParallel(rootHolder, first, last, threads);
+    if (!linkRoot(root, last - first, []() { return true; }))
+    {
+        deleteTree(root);
+        return false;
+    }
+    return true;
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename LinkOthers>
+bool ConcurrentBSTMap<K, V, Compare, Alloc>::linkRoot(NodePtr root, long long nodes, LinkOthers linkOthers)
+{
+    WriterGate::Guard writing(writers);
+    NodeLock rootLock(lockNode(rootHolder));
+    // a put may have got there first
+    if (rootHolder->right != nullptr || !linkOthers())
+        return false;
+    rootHolder->right.store(root, std::memory_order_release);
+    fixHeightLocked(rootHolder);
+    countNodes(nodes, 0);
+    return true;
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename RandomIt>
+std::vector<std::optional<V> > ConcurrentBSTMap<K, V, Compare, Alloc>::putAll(RandomIt first, RandomIt last)
+{
+    ensureNodes();
+    std::vector<std::optional<V> > results;
+    results.reserve(last - first);
+    if (StatsEnabled)
+        StatsRecord::bump(localStats()->ops[StatPut], last - first);
+    while (first != last)
+    {
+        // the path is only good until a snapshot freezes it
+        WriterGate::Guard writing(writers);
+        EpochManager::Guard guard(epoch);
+        Path path;
+        resetPath(path);
+        for (unsigned n = 0; n < WalkBatch && first != last; ++n)
+        {
+            resumePath(path, first->first);
+            PutRunAction<RandomIt> action = { *this, path, first, last, 1 };
+            results.push_back(valueOf(descend(path, first->first, action)));
+            // every key of a run was missing
+            results.insert(results.end(), action.count - 1, std::nullopt);
+            first += action.count;
+        }
+    }
+    return results;
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename RandomIt>
+std::vector<std::optional<V> > ConcurrentBSTMap<K, V, Compare, Alloc>::removeAll(RandomIt first, RandomIt last)
+{
+    ensureNodes();
+    std::vector<std::optional<V> > results;
+    results.reserve(last - first);
+    if (StatsEnabled)
+        StatsRecord::bump(localStats()->ops[StatRemove], last - first);
+    while (first != last)
+    {
+        WriterGate::Guard writing(writers);
+        EpochManager::Guard guard(epoch);
+        Path path;
+        resetPath(path);
+        for (unsigned n = 0; n < WalkBatch && first != last; ++n, ++first)
+        {
+            resumePath(path, *first);
+            RemoveAction action = { *this };
+            results.push_back(valueOf(descend(path, *first, action)));
+        }
+    }
+    return results;
+}
+// the lanes go round until every key of a WalkBatch is done; a finished
+// lane takes the next key right away, so the number of descents in flight
+// stays at GetAllWidth until the keys run out
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename RandomIt>
+std::vector<std::optional<V> > ConcurrentBSTMap<K, V, Compare, Alloc>::getAll(RandomIt first, RandomIt last)
+{
+    std::size_t n = last - first;
+    std::vector<std::optional<V> > results(n);
+    if (StatsEnabled)
+        StatsRecord::bump(localStats()->ops[StatGet], n);
+    if (ImageFile* file = mapped.load(std::memory_order_acquire))
+    {
+        for (std::size_t i = 0; i < n; ++i)
+            results[i] = valueOf(getMapped(*file, first[i]));
+        return results;
+    }
+    for (std::size_t batch = 0; batch < n; batch += WalkBatch)
+    {
+        EpochManager::Guard guard(epoch);
+        std::size_t next = batch;
+        std::size_t end = std::min(n, batch + WalkBatch);
+        GetLane lanes[GetAllWidth];
+        unsigned active = 0;
+        while (active < GetAllWidth && next < end)
+            startLane(lanes[active++], next++);
+        while (active > 0)
+            for (unsigned l = 0; l < active; )
+            {
+                GetLane& lane = lanes[l];
+                if (!stepLane(lane, first[lane.index], results[lane.index]))
+                    ++l;
+                else if (next < end)
+                    startLane(lanes[l++], next++);
+                else
+                    lane = lanes[--active];
+            }
+    }
+    return results;
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+int ConcurrentBSTMap<K, V, Compare, Alloc>::height() const
+{
+    return height(rootHolder->right);
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::quiescent()
+{
+    epoch.quiescent();
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename Callback>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::scan(const K& lo, const K& hi, Callback callback)
+{
+    auto visit = [this, &hi, &callback](const K& k, const V& v) -> bool
+    {
+        if (compare(k, hi) >= 0)
+            return false;
+        callback(k, v);
+        return true;
+    };
+    ensureNodes();
+    LatencySample sample(localStats(), StatScan);
+    walk(&lo, true, 1, visit);
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<typename ConcurrentBSTMap<K, V, Compare, Alloc>::Entry> ConcurrentBSTMap<K, V, Compare, Alloc>::floor(const K& k)
+{
+    return valueOf(nearest(&k, true, -1));
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<typename ConcurrentBSTMap<K, V, Compare, Alloc>::Entry> ConcurrentBSTMap<K, V, Compare, Alloc>::ceiling(const K& k)
+{
+    return valueOf(nearest(&k, true, 1));
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<typename ConcurrentBSTMap<K, V, Compare, Alloc>::Entry> ConcurrentBSTMap<K, V, Compare, Alloc>::successor(const K& k)
+{
+    return valueOf(nearest(&k, false, 1));
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<typename ConcurrentBSTMap<K, V, Compare, Alloc>::Entry> ConcurrentBSTMap<K, V, Compare, Alloc>::first()
+{
+    return valueOf(nearest(nullptr, true, 1));
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<typename ConcurrentBSTMap<K, V, Compare, Alloc>::Entry> ConcurrentBSTMap<K, V, Compare, Alloc>::last()
+{
+    return valueOf(nearest(nullptr, true, -1));
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::clear()
+{
+    epoch.reclaimAll();
+    destroyTree();
+    nodePool.release();
+    rootHolder = newNode();
+    mapped.store(nullptr, std::memory_order_relaxed);
+    image.reset();
+    nodeCounts.forEach([](NodeCounts& counts)
+    {
+        counts.nodes.store(0, std::memory_order_relaxed);
+        counts.routing.store(0, std::memory_order_relaxed);
+    });
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+MapStats ConcurrentBSTMap<K, V, Compare, Alloc>::stats()
+{
+    return statsCollector.snapshot();
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::resetStats()
+{
+    statsCollector.reset();
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+double ConcurrentBSTMap<K, V, Compare, Alloc>::routingRatio()
+{
+    long long nodes = 0;
+    long long routing = 0;
+    nodeCounts.forEach([&nodes, &routing](NodeCounts& counts)
+    {
+        nodes += counts.nodes.load(std::memory_order_relaxed);
+        routing += counts.routing.load(std::memory_order_relaxed);
+    });
+    return nodes <= 0 ? 0 : static_cast<double>(routing) / nodes;
+}
+// every write changes the counts inside its pass through the gate, so with
+// the gate closed the sum is exactly the keys in the tree
+template <typename K, typename V, typename Compare, typename Alloc>
+std::size_t ConcurrentBSTMap<K, V, Compare, Alloc>::size()
+{
+    if (ImageFile* file = mapped.load(std::memory_order_acquire))
+        return static_cast<std::size_t>(file->count());
+    writers.close();
+    long long keys = countKeys();
+    writers.open();
+    return static_cast<std::size_t>(keys);
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+std::size_t ConcurrentBSTMap<K, V, Compare, Alloc>::approximateSize()
+{
+    if (ImageFile* file = mapped.load(std::memory_order_acquire))
+        return static_cast<std::size_t>(file->count());
+    long long keys = countKeys();
+    return keys < 0 ? 0 : static_cast<std::size_t>(keys);
+}
+// with the writers held off, the whole tree is as it should be; freezing the
+// root freezes all of it
+template <typename K, typename V, typename Compare, typename Alloc>
+typename ConcurrentBSTMap<K, V, Compare, Alloc>::Snapshot ConcurrentBSTMap<K, V, Compare, Alloc>::snapshot()
+{
+    ensureNodes();
+    writers.close();
+    if (liveSnapshots.load(std::memory_order_relaxed) == MaxSnapshots)
+    {
+        writers.open();
+        throw std::length_error("ConcurrentBSTMap: too many snapshots");
+    }
+    ++liveSnapshots;
+    NodePtr root = rootHolder->right;
+    freeze(root);
+    // before any writer gets in and copies what was frozen
+    ++snapshotsTaken;
+    writers.open();
+    return Snapshot(this, root);
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+typename ConcurrentBSTMap<K, V, Compare, Alloc>::Finger ConcurrentBSTMap<K, V, Compare, Alloc>::finger()
+{
+    return Finger(this);
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::save(const std::string& path)
+{
+    snapshot().save(path);
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+bool ConcurrentBSTMap<K, V, Compare, Alloc>::load(const std::string& path)
+{
+    static_assert(std::is_trivially_copyable<K>::value, "only maps with trivially copyable keys can be loaded from an image");
+    if (rootHolder->right != nullptr || mapped.load(std::memory_order_relaxed) != nullptr)
+        return false;
+    image.reset(new ImageFile(path, sizeof(K), sizeof(V), sizeof(ImageEntry<K, V>)));
+    mapped.store(image.get(), std::memory_order_release);
+    return true;
+}
+// the entries were in the map all along, so readers may keep using the
+// mapping until they see it's gone, and by then the tree has everything
+template <typename K, typename V, typename Compare, typename Alloc>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::loadMapped()
+{
+    std::lock_guard<std::mutex> loading(loadingMapped);
+    ImageFile* file = mapped.load(std::memory_order_relaxed);
+    if (file == nullptr)
+        return;
+    const ImageEntry<K, V>* entries = static_cast<const ImageEntry<K, V>*>(file->entries());
+    bulkLoadNodes(entries, entries + file->count(), std::thread::hardware_concurrency());
+    mapped.store(nullptr, std::memory_order_release);
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+std::pair<Result,V> ConcurrentBSTMap<K, V, Compare, Alloc>::getMapped(const ImageFile& file, const K& k)
+{
+    const ImageEntry<K, V>* first = static_cast<const ImageEntry<K, V>*>(file.entries());
+    const ImageEntry<K, V>* last = first + file.count();
+    const ImageEntry<K, V>* found = std::lower_bound(first, last, k, [this](const ImageEntry<K, V>& entry, const K& key)
+    {
+        return compare(entry.first, key) < 0;
+    });
+    if (found == last || compare(found->first, k) != 0)
+        return NullPair;
+    return std::make_pair(Result::Success, found->second);
+}
+// the hand-over-hand descent shared by all operations, as a loop over an
+// explicit path instead of one stack frame per level. a Retry from a level
+// pops back to the parent, which rereads its link with the version it
+// validated on the way down, exactly like returning from a recursive call.
+// the path is a fixed ring of the deepest PathCapacity levels, so stack use
+// doesn't depend on the tree's depth; popping past the oldest level we
+// still remember just restarts from rootHolder
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename Action>
+std::pair<Result,V> ConcurrentBSTMap<K, V, Compare, Alloc>::descend(const K& k, Action& action)
+{
+    Path path;
+    resetPath(path);
+    return descend(path, k, action);
+}
+// same, but starting from the deepest level of path, which has to lie on
+// k's way down (see resumePath); path is left at the level the action ran on
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename Action>
+std::pair<Result,V> ConcurrentBSTMap<K, V, Compare, Alloc>::descend(Path& path, const K& k, Action& action)
+{
+    // kept in path as we go; an action may look at the path it was reached by
+    unsigned& depth = path.depth;
+    unsigned& oldest = path.oldest;
+    const PathFrame& top = path.frames[depth % PathCapacity];
+    NodePtr node = top.node;
+    long nodeV = top.version;
+    int dir = top.dir;
+    unsigned retries = 0;
+    unsigned steps = 0;
+    while (true)
+    {
+        NodePtr child = node->child(dir);
+        // a writer makes the link its own before going any further, then
+        // reads it again (unless node changed, which the check below sees)
+        if (Action::Writes && child != nullptr && isFrozen(child->version))
+        {
+            bool valid;
+            {
+                NodeLock nodeLock(lockNode(node));
+                valid = ((node->version ^ nodeV) & IgnoreGrow) == 0;
+                if (valid && node->child(dir) == child)
+                    unshareLocked(node, dir);
+            }
+            if (valid)
+                continue;
+        }
+        // validate inbound link
+        bool retryParent = ((node->version ^ nodeV) & IgnoreGrow) != 0;
+        if (!retryParent)
+        {
+            std::pair<Result,V> p = RetryPair;
+            bool acted = true;
+            // basic null check; the action decides what an empty link means
+            if (child == nullptr)
+                p = action.missing(node, dir, nodeV);
+            else
+            {
+                // condition to stop
+                int nextD = compare(k, child->key);
+                if (nextD == 0)
+                    p = action.found(node, child);
+                else
+                {
+                    acted = false;
+                    // if didn't stop at this level, validate outbound link (child)
+                    long chV = child->version;
+                    // child is being rotated down or was unlinked; wait it
+                    // out and reread the outbound link
+                    if ((chV & (Shrinking | Unlinked)) != 0)
+                        waitUntilShrinkCompleted(child, chV);
+                    else if (child == node->child(dir))
+                    {
+                        // revalidate inbound link, then step down
+                        retryParent = ((node->version ^ nodeV) & IgnoreGrow) != 0;
+                        if (!retryParent)
+                        {
+                            ++depth;
+                            if (depth - oldest == PathCapacity)
+                                ++oldest;
+                            PathFrame frame = { child, chV, nextD };
+                            path.frames[depth % PathCapacity] = frame;
+                            node = child;
+                            nodeV = chV;
+                            dir = nextD;
+                            ++steps;
+                        }
+                    }
+                }
+            }
+            if (p.first != Result::Retry)
+            {
+                if (StatsEnabled)
+                {
+                    StatsRecord* stats = localStats();
+                    if (retries != 0)
+                        StatsRecord::bump(stats->retries[Action::Stat], retries);
+                    if (stats->sampling)
+                    {
+                        StatsRecord::bump(stats->depthSum, depth + 1);
+                        StatsRecord::bump(stats->stepsSum, steps + 1);
+                        StatsRecord::bump(stats->depthSamples);
+                    }
+                }
+                return p;
+            }
+            // the action found the tree changed under it
+            if (acted)
+                backOff(++retries);
+        }
+        if (retryParent)
+        {
+            backOff(++retries);
+            if (depth == oldest)
+                resetPath(path);
+            else
+                --depth;
+            const PathFrame& frame = path.frames[depth % PathCapacity];
+            node = frame.node;
+            nodeV = frame.version;
+            dir = frame.dir;
+        }
+    }
+}
+
+// rootHolder never changes version, so its frame is never popped
+template <typename K, typename V, typename Compare, typename Alloc>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::resetPath(Path& path)
+{
+    PathFrame rootFrame = { rootHolder, 0, 1 };
+    path.frames[0] = rootFrame;
+    path.depth = 0;
+    path.oldest = 0;
+}
+
+// cuts path back to the deepest level k's own descent would also go
+// through: the first level where k turns the other way than the path did
+// (or the level above, if k is that node's key). the versions in the
+// frames are still checked as usual once the descent moves on
+template <typename K, typename V, typename Compare, typename Alloc>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::resumePath(Path& path, const K& k)
+{
+    // the levels that were forgotten might be where k turns away
+    if (path.oldest != 0)
+    {
+        resetPath(path);
+        return;
+    }
+    for (unsigned i = 1; i <= path.depth; ++i)
+    {
+        PathFrame& frame = path.frames[i];
+        int c = compare(k, frame.node->key);
+        if (c != frame.dir)
+        {
+            if (c == 0)
+                path.depth = i - 1;
+            else
+            {
+                path.depth = i;
+                frame.dir = c;
+            }
+            return;
+        }
+    }
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::startLane(GetLane& lane, std::size_t index)
+{
+    GetLane start = { index, rootHolder, 0, 1 };
+    lane = start;
+}
+
+// one level of a getAll descent: a turn of descend's loop for a GetAction.
+// anything out of the ordinary (a parent that changed, a child being rotated
+// down) hands the key to a descend of its own, which knows how to back up
+// and wait. true once result is in
+template <typename K, typename V, typename Compare, typename Alloc>
+bool ConcurrentBSTMap<K, V, Compare, Alloc>::stepLane(GetLane& lane, const K& k, std::optional<V>& result)
+{
+    NodePtr node = lane.node;
+    NodePtr child = node->child(lane.dir);
+    if (((node->version ^ lane.nodeV) & IgnoreGrow) == 0)
+    {
+        if (child == nullptr)
+        {
+            result = std::nullopt;
+            return true;
+        }
+        int nextD = compare(k, child->key);
+        if (nextD == 0)
+        {
+            GetAction action = { *this };
+            result = valueOf(action.found(node, child));
+            return true;
+        }
+        long chV = child->version;
+        if ((chV & (Shrinking | Unlinked)) == 0)
+        {
+            // the link changed between the two reads; read it again next turn
+            if (child != node->child(lane.dir))
+                return false;
+            if (((node->version ^ lane.nodeV) & IgnoreGrow) == 0)
+            {
+                lane.node = child;
+                lane.nodeV = chV;
+                lane.dir = nextD;
+                prefetch(child->child(nextD));
+                return false;
+            }
+        }
+    }
+    GetAction action = { *this };
+    result = valueOf(descend(k, action));
+    return true;
+}
+
+// would k's descent end on the same link as the one path ends on?
+template <typename K, typename V, typename Compare, typename Alloc>
+bool ConcurrentBSTMap<K, V, Compare, Alloc>::pathCovers(const Path& path, const K& k)
+{
+    if (path.oldest != 0)
+        return false;
+    for (unsigned i = 1; i <= path.depth; ++i)
+        if (compare(k, path.frames[i].node->key) != path.frames[i].dir)
+            return false;
+    return true;
+}
+
+// reads node's child with the same hand-over-hand validation as descend;
+// false means node itself changed and the caller has to start over
+template <typename K, typename V, typename Compare, typename Alloc>
+bool ConcurrentBSTMap<K, V, Compare, Alloc>::readChild(NodePtr node, long nodeV, int dir, NodePtr& child, long& childV)
+{
+    while (true)
+    {
+        child = node->child(dir);
+        if (((node->version ^ nodeV) & IgnoreGrow) != 0)
+            return false;
+        if (child == nullptr)
+            return true;
+        childV = child->version;
+        if ((childV & (Shrinking | Unlinked)) != 0)
+            waitUntilShrinkCompleted(child, childV);
+        else if (child == node->child(dir))
+            return ((node->version ^ nodeV) & IgnoreGrow) == 0;
+    }
+}
+
+// the walk keeps a stack of the nodes still ahead of it: the ancestors it
+// passed on their near side, each with the version it had then. a node is
+// only visited after checking that version again, which means it hasn't
+// been rotated down or unlinked, so the part of the tree still ahead of the
+// walk is where the stack says it is. when a check fails (or every
+// WalkBatch nodes) the walk starts over from the last key it passed, which
+// never reports a key twice and never skips one that stayed put
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename Visitor>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::walk(const K* from, bool inclusive, int dir, Visitor& visit)
+{
+    K lastKey = K();
+    while (true)
+    {
+        EpochManager::Guard guard(epoch);
+        PathFrame ahead[PathCapacity];
+        unsigned top = 0;
+        unsigned bottom = 0;
+        bool restart = false;
+
+        // go down towards from, stacking every node that comes after it
+        NodePtr node = rootHolder;
+        long nodeV = 0;
+        int nextDir = 1;
+        while (true)
+        {
+            NodePtr child;
+            long childV;
+            if (!readChild(node, nodeV, nextDir, child, childV))
+            {
+                restart = true;
+                break;
+            }
+            if (child == nullptr)
+                break;
+            int c = from == nullptr ? -1 : compare(*from, child->key) * dir;
+            if (c < 0 || (c == 0 && inclusive))
+            {
+                if (top - bottom == PathCapacity)
+                    ++bottom;
+                PathFrame frame = { child, childV, -dir };
+                ahead[top++ % PathCapacity] = frame;
+                if (c == 0)
+                    break;
+            }
+            node = child;
+            nodeV = childV;
+            nextDir = c < 0 ? -dir : dir;
+        }
+
+        // visit the top of the stack, then stack the near edge of its far
+        // subtree
+        unsigned visited = 0;
+        while (!restart)
+        {
+            if (top == bottom)
+            {
+                // the stack overflowed and forgot ancestors that are still ahead
+                if (bottom != 0)
+                    restart = true;
+                break;
+            }
+            PathFrame frame = ahead[--top % PathCapacity];
+            if (((frame.node->version ^ frame.version) & IgnoreGrow) != 0)
+            {
+                restart = true;
+                break;
+            }
+            lastKey = frame.node->key;
+            from = &lastKey;
+            inclusive = false;
+            if (!isRoutingNode(frame.node) && !visit(frame.node->key, frame.node->value.load(std::memory_order_acquire)))
+                return;
+            if (++visited == WalkBatch)
+            {
+                restart = true;
+                break;
+            }
+            node = frame.node;
+            nodeV = frame.version;
+            nextDir = dir;
+            while (true)
+            {
+                NodePtr child;
+                long childV;
+                if (!readChild(node, nodeV, nextDir, child, childV))
+                {
+                    restart = true;
+                    break;
+                }
+                if (child == nullptr)
+                    break;
+                if (top - bottom == PathCapacity)
+                    ++bottom;
+                PathFrame next = { child, childV, -dir };
+                ahead[top++ % PathCapacity] = next;
+                node = child;
+                nodeV = childV;
+                nextDir = -dir;
+            }
+        }
+        if (!restart)
+            return;
+        if (StatsEnabled && visited != WalkBatch)
+            StatsRecord::bump(localStats()->retries[StatScan]);
+    }
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+std::pair<Result,typename ConcurrentBSTMap<K, V, Compare, Alloc>::Entry> ConcurrentBSTMap<K, V, Compare, Alloc>::nearest(const K* from, bool inclusive, int dir)
+{
+    std::pair<Result,Entry> result(Result::Null, Entry());
+    auto take = [&result](const K& k, const V& v) -> bool
+    {
+        result = std::make_pair(Result::Success, Entry(k, v));
+        return false;
+    };
+    ensureNodes();
+    LatencySample sample(localStats(), StatScan);
+    walk(from, inclusive, dir, take);
+    return result;
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+ConcurrentBSTMap<K, V, Compare, Alloc>::Snapshot::Snapshot(ConcurrentBSTMap* map, NodePtr root)
+    : map(map), root(root)
+{}
+template <typename K, typename V, typename Compare, typename Alloc>
+ConcurrentBSTMap<K, V, Compare, Alloc>::Snapshot::Snapshot(Snapshot&& rhs)
+    : map(rhs.map), root(rhs.root)
+{
+    rhs.map = nullptr;
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+ConcurrentBSTMap<K, V, Compare, Alloc>::Snapshot::~Snapshot()
+{
+    if (map == nullptr)
+        return;
+    map->release(root);
+    --map->liveSnapshots;
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<V> ConcurrentBSTMap<K, V, Compare, Alloc>::Snapshot::get(const K& k) const
+{
+    NodePtr node = root;
+    while (node != nullptr)
+    {
+        int c = map->compare(k, node->key);
+        if (c == 0)
+        {
+            if (node->tombstone)
+                return std::nullopt;
+            return node->value.load(std::memory_order_relaxed);
+        }
+        node = node->child(c);
+    }
+    return std::nullopt;
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename Callback>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::Snapshot::scan(const K& lo, const K& hi, Callback callback) const
+{
+    auto visit = [this, &hi, &callback](const K& k, const V& v) -> bool
+    {
+        if (map->compare(k, hi) >= 0)
+            return false;
+        callback(k, v);
+        return true;
+    };
+    walk(&lo, true, 1, visit);
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::Snapshot::save(const std::string& path) const
+{
+    static_assert(std::is_trivially_copyable<K>::value, "only maps with trivially copyable keys can be saved as an image");
+    ImageWriter out(path, sizeof(K), sizeof(V), sizeof(ImageEntry<K, V>));
+    auto append = [&out](const K& k, const V& v) -> bool
+    {
+        ImageEntry<K, V> entry;
+        // padding goes to disk too
+        std::memset(&entry, 0, sizeof(entry));
+        entry.first = k;
+        entry.second = v;
+        out.append(&entry);
+        return true;
+    };
+    walk(nullptr, true, 1, append);
+    out.commit();
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<typename ConcurrentBSTMap<K, V, Compare, Alloc>::Entry> ConcurrentBSTMap<K, V, Compare, Alloc>::Snapshot::floor(const K& k) const
+{
+    return valueOf(nearest(&k, true, -1));
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<typename ConcurrentBSTMap<K, V, Compare, Alloc>::Entry> ConcurrentBSTMap<K, V, Compare, Alloc>::Snapshot::ceiling(const K& k) const
+{
+    return valueOf(nearest(&k, true, 1));
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<typename ConcurrentBSTMap<K, V, Compare, Alloc>::Entry> ConcurrentBSTMap<K, V, Compare, Alloc>::Snapshot::successor(const K& k) const
+{
+    return valueOf(nearest(&k, false, 1));
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<typename ConcurrentBSTMap<K, V, Compare, Alloc>::Entry> ConcurrentBSTMap<K, V, Compare, Alloc>::Snapshot::first() const
+{
+    return valueOf(nearest(nullptr, true, 1));
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<typename ConcurrentBSTMap<K, V, Compare, Alloc>::Entry> ConcurrentBSTMap<K, V, Compare, Alloc>::Snapshot::last() const
+{
+    return valueOf(nearest(nullptr, true, -1));
+}
+
+// the same in-order walk as the map's, minus the version checks and restarts
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename Visitor>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::Snapshot::walk(const K* from, bool inclusive, int dir, Visitor& visit) const
+{
+    std::vector<NodePtr> ahead;
+    NodePtr node = root;
+    while (node != nullptr)
+    {
+        int c = from == nullptr ? -1 : map->compare(*from, node->key) * dir;
+        if (c < 0 || (c == 0 && inclusive))
+        {
+            ahead.push_back(node);
+            if (c == 0)
+                break;
+        }
+        node = node->child(c < 0 ? -dir : dir);
+    }
+    while (!ahead.empty())
+    {
+        NodePtr n = ahead.back();
+        ahead.pop_back();
+        if (!n->tombstone && !visit(n->key, n->value.load(std::memory_order_relaxed)))
+            return;
+        for (node = n->child(dir); node != nullptr; node = node->child(-dir))
+            ahead.push_back(node);
+    }
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+std::pair<Result,typename ConcurrentBSTMap<K, V, Compare, Alloc>::Entry> ConcurrentBSTMap<K, V, Compare, Alloc>::Snapshot::nearest(const K* from, bool inclusive, int dir) const
+{
+    std::pair<Result,Entry> result(Result::Null, Entry());
+    auto take = [&result](const K& k, const V& v) -> bool
+    {
+        result = std::make_pair(Result::Success, Entry(k, v));
+        return false;
+    };
+    walk(from, inclusive, dir, take);
+    return result;
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+ConcurrentBSTMap<K, V, Compare, Alloc>::Finger::Finger(ConcurrentBSTMap* map)
+    : map(map), generation(0), ops(0)
+{}
+template <typename K, typename V, typename Compare, typename Alloc>
+ConcurrentBSTMap<K, V, Compare, Alloc>::Finger::Finger(Finger&& rhs)
+    : map(rhs.map), path(rhs.path), generation(rhs.generation), ops(rhs.ops)
+{
+    rhs.map = nullptr;
+    rhs.ops = 0;
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+ConcurrentBSTMap<K, V, Compare, Alloc>::Finger::~Finger()
+{
+    if (map != nullptr)
+        release();
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<V> ConcurrentBSTMap<K, V, Compare, Alloc>::Finger::get(const K& k)
+{
+    LatencySample sample(map->localStats(), StatGet);
+    if (ImageFile* file = map->mapped.load(std::memory_order_acquire))
+        return valueOf(map->getMapped(*file, k));
+    resume(k, false);
+    GetAction action = { *map };
+    std::optional<V> result = valueOf(map->descend(path, k, action));
+    done();
+    return result;
+}
+// the gate is taken before the path is looked at, so no snapshot can freeze
+// it until the write is done
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<V> ConcurrentBSTMap<K, V, Compare, Alloc>::Finger::put(const K& k, const V& v)
+{
+    map->ensureNodes();
+    LatencySample sample(map->localStats(), StatPut);
+    WriterGate::Guard writing(map->writers);
+    resume(k, true);
+    PutAction action = { *map, k, v };
+    std::optional<V> result = valueOf(map->descend(path, k, action));
+    done();
+    return result;
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<V> ConcurrentBSTMap<K, V, Compare, Alloc>::Finger::remove(const K& k)
+{
+    map->ensureNodes();
+    LatencySample sample(map->localStats(), StatRemove);
+    WriterGate::Guard writing(map->writers);
+    resume(k, true);
+    RemoveAction action = { *map };
+    std::optional<V> result = valueOf(map->descend(path, k, action));
+    done();
+    return result;
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::Finger::release()
+{
+    if (ops == 0)
+        return;
+    map->epoch.exit();
+    ops = 0;
+}
+// the path's nodes can't have been freed as long as the finger has stayed in
+// the epoch since it went down to them. a get doesn't copy the frozen nodes
+// it passes, and neither does anybody for snapshots that are gone, so a
+// writer only resumes above the first frozen level: everything below it is
+// still shared, marked or not
+template <typename K, typename V, typename Compare, typename Alloc>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::Finger::resume(const K& k, bool writing)
+{
+    unsigned long taken = map->snapshotsTaken.load();
+    if (ops == 0)
+        map->epoch.enter();
+    if (ops == 0 || taken != generation)
+    {
+        map->resetPath(path);
+        generation = taken;
+    }
+    else
+        map->resumePath(path, k);
+    if (writing)
+        for (unsigned i = 1; i <= path.depth; ++i)
+            if (isFrozen(path.frames[i].node->version))
+            {
+                path.depth = i - 1;
+                break;
+            }
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::Finger::done()
+{
+    if (++ops == WalkBatch)
+        release();
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+std::pair<Result,V> ConcurrentBSTMap<K, V, Compare, Alloc>::attemptInsert(const K& k, const V& v, NodePtr& node, int dir, long nodeV)
+{
+    auto fn = [&v](const std::optional<V>&) -> std::optional<V> { return v; };
+    return attemptInsertComputed(k, fn, node, dir, nodeV);
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename Fn>
+std::pair<Result,V> ConcurrentBSTMap<K, V, Compare, Alloc>::attemptInsertComputed(const K& k, Fn& fn, NodePtr& node, int dir, long nodeV)
+{
+    NodePtr damaged = nullptr;
+    {
+        NodeLock nodeLock(lockNode(node));
+        // validate inbound link
+        if (((node->version ^ nodeV) & IgnoreGrow) != 0 || node->child(dir) != nullptr)
+            return RetryPair;
+        std::optional<V> v = fn(std::optional<V>());
+        if (!v)
+            return NullPair;
+        node->setChild(dir, newNode(k, *v, node, 0, nullptr, nullptr));
+        // the new leaf may have made node taller; fix it while we hold the lock
+        damaged = fixHeightLocked(node);
+    }
+    countNodes(1, 0);
+    fixHeightAndRebalance(damaged);
+    return NullPair;
+}
+// inserts a sorted run of keys that all belong on node's empty link as one
+// balanced subtree. the keys between the path's bounds can only ever go on
+// this link while node is neither rotated down nor unlinked, which is what
+// the version check establishes, same as for a single key
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename RandomIt>
+std::pair<Result,V> ConcurrentBSTMap<K, V, Compare, Alloc>::attemptInsertRun(RandomIt first, RandomIt last, NodePtr& node, int dir, long nodeV)
+{
+    NodePtr damaged = nullptr;
+    NodePtr leaf = nullptr;
+    {
+        NodeLock nodeLock(lockNode(node));
+        if (((node->version ^ nodeV) & IgnoreGrow) != 0 || node->child(dir) != nullptr)
+            return RetryPair;
+        // the subtree is published in one store, fully built
+        leaf = buildSubtree(node, first, last);
+        node->setChild(dir, leaf);
+        damaged = fixHeightLocked(node);
+        while (leaf->left != nullptr)
+            leaf = leaf->left;
+    }
+    countNodes(last - first, 0);
+    fixHeightAndRebalance(damaged);
+    // a whole subtree can unbalance node by more than a single insert can,
+    // and one pass of rotations may leave damage that isn't on the path it
+    // walked; sweep the ancestors of the run, repairing as we go. a repair
+    // leaves x under whatever rotated up in its place, so the climb carries on
+    // from x's parent and sees that too
+    bool repaired = true;
+    for (unsigned sweep = 0; sweep < RunRepairSweeps && repaired; ++sweep)
+    {
+        repaired = false;
+        for (NodePtr x = leaf; x != nullptr && x->parent != nullptr; x = x->parent)
+            if (!isUnlinked(x->version) && nodeCondition(x) != NothingRequired)
+            {
+                fixHeightAndRebalance(x);
+                repaired = true;
+            }
+    }
+    return NullPair;
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename RandomIt>
+bool ConcurrentBSTMap<K, V, Compare, Alloc>::ascending(RandomIt first, RandomIt last) const
+{
+    typedef typename std::iterator_traits<RandomIt>::value_type Entry;
+    return std::adjacent_find(first, last, [this](const Entry& a, const Entry& b) { return !comp(a.first, b.first); }) == last;
+}
+
+// a half is linked into n as soon as it's built, so that if a later
+// allocation throws, deleteTree(n) frees everything built so far
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename RandomIt>
+typename ConcurrentBSTMap<K, V, Compare, Alloc>::NodePtr ConcurrentBSTMap<K, V, Compare, Alloc>::buildSubtree(NodePtr parent, RandomIt first, RandomIt last)
+{
+    if (first == last)
+        return nullptr;
+    RandomIt mid = first + (last - first) / 2;
+    NodePtr n = newNode(mid->first, mid->second, parent, 0, nullptr, nullptr);
+    try
+    {
+        n->left.store(buildSubtree(n, first, mid), std::memory_order_relaxed);
+        n->right.store(buildSubtree(n, mid + 1, last), std::memory_order_relaxed);
+    }
+    catch (...)
+    {
+        deleteTree(n);
+        throw;
+    }
+    n->height.store(1 + std::max(height(n->left.load(std::memory_order_relaxed)), height(n->right.load(std::memory_order_relaxed))),
+                    std::memory_order_relaxed);
+    return n;
+}
+
+// buildSubtree, with the two halves of every range of at least
+// 2 * BulkLoadGrain keys built at the same time while there are threads to
+// spare. each thread allocates from its own slab chunks, so the nodes of a
+// subtree end up next to each other. the left half's thread is joined
+// however the right half's build ends, and an exception from either half
+// is rethrown once both are done and n and whatever was built under it are
+// freed
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename RandomIt>
+typename ConcurrentBSTMap<K, V, Compare, Alloc>::NodePtr ConcurrentBSTMap<K, V, Compare, Alloc>::buildSubtreeParallel(NodePtr parent, RandomIt first, RandomIt last,
+                                                                                                                      unsigned threads)
+{
+    if (threads <= 1 || last - first < 2 * BulkLoadGrain)
+        return buildSubtree(parent, first, last);
+    RandomIt mid = first + (last - first) / 2;
+    NodePtr n = newNode(mid->first, mid->second, parent, 0, nullptr, nullptr);
+    NodePtr l = nullptr;
+    NodePtr r = nullptr;
+    std::exception_ptr leftError;
+    std::exception_ptr rightError;
+    try
+    {
+        std::thread left([&]()
+        {
+            try
+            {
+                l = buildSubtreeParallel(n, first, mid, threads / 2);
+            }
+            catch (...)
+            {
+                leftError = std::current_exception();
+            }
+        });
+        struct Joiner
+        {
+            std::thread& thread;
+            ~Joiner() { thread.join(); }
+        } joiner = { left };
+        r = buildSubtreeParallel(n, mid + 1, last, threads - threads / 2);
+    }
+    catch (...)
+    {
+        rightError = std::current_exception();
+    }
+    n->left.store(l, std::memory_order_relaxed);
+    n->right.store(r, std::memory_order_relaxed);
+    if (leftError != nullptr || rightError != nullptr)
+    {
+        deleteTree(n);
+        std::rethrow_exception(rightError != nullptr ? rightError : leftError);
+    }
+    n->height.store(1 + std::max(height(l), height(r)), std::memory_order_relaxed);
+    return n;
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+std::pair<Result,V> ConcurrentBSTMap<K, V, Compare, Alloc>::attemptUpdate(NodePtr& node, const V& v)
+{
+    auto fn = [&v](const std::optional<V>&) -> std::optional<V> { return v; };
+    return attemptUpdateComputed(node, fn);
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename Fn>
+std::pair<Result,V> ConcurrentBSTMap<K, V, Compare, Alloc>::attemptUpdateComputed(NodePtr& node, Fn& fn)
+{
+    NodeLock nodeLock(lockNode(node));
+    // we're not concerned about nodes moving around (grow & shrink),
+    // only check if it's unlinked or not
+    if (isUnlinked(node->version))
+        return RetryPair;
+    std::pair<Result,V> prev = (isRoutingNode(node) ? NullPair : std::make_pair(Result::Success, node->value.load()));
+    std::optional<V> v = fn(valueOf(prev));
+    if (!v)
+        return prev;
+    // value first, so a reader that sees the tombstone cleared sees v
+    node->value.store(*v, std::memory_order_release);
+    node->tombstone.store(false, std::memory_order_release);
+    if (prev.first == Result::Null)
+        countNodes(0, -1);
+    return prev;
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+std::pair<Result,V> ConcurrentBSTMap<K, V, Compare, Alloc>::attemptRmNode(NodePtr& par, NodePtr& n)
+{
+    // this is a routing node (physically present but logically deleted); NOOP
+    if (isRoutingNode(n)) return NullPair;
+    std::pair<Result,V> prev = RetryPair;
+    // target has two children; show mercy and spare its life...
+    if (!canUnlink(n))
+    {
+        NodeLock nodeLock(lockNode(n));
+        // validate target
+        if (isUnlinked(n->version) || canUnlink(n))
+            return RetryPair;
+        prev = (isRoutingNode(n) ? NullPair : std::make_pair(Result::Success, n->value.load()));
+        n->tombstone.store(true, std::memory_order_release);
+        if (prev.first == Result::Success)
+            countNodes(0, 1);
+        if (StatsEnabled && prev.first == Result::Success)
+            StatsRecord::bump(localStats()->routed);
+    }
+    // target has 0 or 1 children; kill it (I mean, unlink it)
+    else
+    {
+        NodePtr damaged = nullptr;
+        NodePtr unlinked = nullptr;
+        {
+            NodeLock parentLock(lockNode(par));
+            // validate target AND parent
+            if (isUnlinked(par->version) || n->parent != par || isUnlinked(n->version))
+                return RetryPair;
+            // scope for locking target
+            {
+                NodeLock nodeLock(lockNode(n));
+                prev = (isRoutingNode(n) ? NullPair : std::make_pair(Result::Success, n->value.load()));
+                n->tombstone.store(true, std::memory_order_release);
+                // recheck target state; target might have added more children
+                // when we weren't looking if this part fails, then it's
+                // logically equivalent to the block above for "!canUnlink(n)
+                if (canUnlink(n))
+                {
+                    unlinkLocked(par, n);
+                    unlinked = n;
+                }
+            }
+            // parent lost a subtree; fix its height while we still hold its lock
+            damaged = fixHeightLocked(par);
+        }
+        // readers may still be passing through n; let the epoch decide when
+        // it's safe to free (retire may free older nodes, so no locks held)
+        if (unlinked != nullptr)
+        {
+            epoch.retire(unlinked);
+            // it was a routing node already if prev is Null
+            countNodes(-1, prev.first == Result::Null ? -1 : 0);
+        }
+        else if (prev.first == Result::Success)
+            countNodes(0, 1);
+        if (StatsEnabled && unlinked != nullptr)
+            StatsRecord::bump(localStats()->unlinked);
+        else if (StatsEnabled && prev.first == Result::Success)
+            StatsRecord::bump(localStats()->routed);
+        fixHeightAndRebalance(damaged);
+    }
+    return prev;
+}
+
+// replaces n, which has at most one child, with that child (or null); the
+// caller holds par's and n's locks and retires n once it lets go of them
+template <typename K, typename V, typename Compare, typename Alloc>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::unlinkLocked(NodePtr par, NodePtr n)
+{
+    NodePtr c = (n->left == nullptr ? n->right : n->left);
+    if (par->left == n)
+        par->left.store(c, std::memory_order_release);
+    else
+        par->right.store(c, std::memory_order_release);
+    if (c != nullptr) c->parent.store(par, std::memory_order_release);
+    // keep the lock bit; the caller's lock guard clears it
+    n->version.store(Unlinked | Locked, std::memory_order_release);
+}
+
+// copy-on-write (SnapTree, Bronson et al.). a snapshot freezes the root; a
+// writer that reaches a frozen node replaces it with a copy of its own,
+// which links to the same children, so they're frozen in turn. nodes below
+// a frozen one are frozen too, in effect, even before anybody marks them:
+// the only way to them is through frozen nodes, and every writer copies
+// those on its way down
+
+// one more link to node (if any). freezing takes the lock only to set the
+// bit, since unlock() rewrites the version word
+template <typename K, typename V, typename Compare, typename Alloc>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::freeze(NodePtr node)
+{
+    if (node == nullptr)
+        return;
+    if (isFrozen(node->version))
+    {
+        node->refs.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    NodeLock nodeLock(*node);
+    // the link it had all along, and the new one
+    node->refs.store(2, std::memory_order_relaxed);
+    node->version.store(node->version.load(std::memory_order_relaxed) | Frozen, std::memory_order_release);
+}
+
+// one link fewer to node (if any); a node that loses its last one is retired,
+// and its own links go with it. a node whose refs are still 0 here was
+// only ever linked from a node that has just gone
+template <typename K, typename V, typename Compare, typename Alloc>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::release(NodePtr node)
+{
+    if (node == nullptr || (node->refs.load(std::memory_order_acquire) != 0 && node->refs.fetch_sub(1, std::memory_order_acq_rel) != 1))
+        return;
+    std::vector<NodePtr> garbage(1, node);
+    while (!garbage.empty())
+    {
+        NodePtr n = garbage.back();
+        garbage.pop_back();
+        NodePtr children[] = { n->left, n->right };
+        for (NodePtr c : children)
+            if (c != nullptr && (c->refs.load(std::memory_order_acquire) == 0 || c->refs.fetch_sub(1, std::memory_order_acq_rel) == 1))
+                garbage.push_back(c);
+        epoch.retire(n);
+    }
+}
+
+// par's child on side dir, after replacing it with a copy if it's frozen.
+// the frozen node usually lives on in a snapshot; if that was dropped
+// meanwhile it goes now, but its children don't, since the copy holds them
+template <typename K, typename V, typename Compare, typename Alloc>
+typename ConcurrentBSTMap<K, V, Compare, Alloc>::NodePtr ConcurrentBSTMap<K, V, Compare, Alloc>::unshareLocked(NodePtr par, int dir)
+{
+    NodePtr n = par->child(dir);
+    if (n == nullptr || !isFrozen(n->version))
+        return n;
+    NodePtr l = n->left;
+    NodePtr r = n->right;
+    freeze(l);
+    freeze(r);
+    NodePtr copy = newNode(n->key, n->value.load(std::memory_order_relaxed), par, 0, l, r);
+    copy->height.store(n->height.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    copy->tombstone.store(n->tombstone.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    par->setChild(dir, copy);
+    release(n);
+    if (StatsEnabled)
+        StatsRecord::bump(localStats()->copied);
+    return copy;
+}
+
+// a rotation holds the node's lock for as long as the node is shrinking, so
+// after a short spin we can simply wait for the lock to be released
+template <typename K, typename V, typename Compare, typename Alloc>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::waitUntilShrinkCompleted(NodePtr& node, long nodeV)
+{
+    if ((nodeV & Shrinking) == 0)
+        return;
+    for (int i = 0; i < SpinCount; ++i)
+    {
+        if (node->version != nodeV)
+            return;
+        cpuRelax();
+    }
+    NodeLock nodeLock(*node);
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+int ConcurrentBSTMap<K, V, Compare, Alloc>::height(NodePtr node)
+{
+    return node == nullptr ? 0 : node->height.load();
+}
+
+// returns UnlinkRequired if node is a routing node that no longer routes
+// (it has fewer than two children), the height node should have,
+// RebalanceRequired if its children's heights differ by more than one, or
+// NothingRequired if it's fine as it is
+template <typename K, typename V, typename Compare, typename Alloc>
+int ConcurrentBSTMap<K, V, Compare, Alloc>::nodeCondition(NodePtr node)
+{
+    NodePtr nL = node->left;
+    NodePtr nR = node->right;
+    if ((nL == nullptr || nR == nullptr) && isRoutingNode(node))
+        return UnlinkRequired;
+    int hN = node->height;
+    int hL = height(nL);
+    int hR = height(nR);
+    int hNRepl = 1 + std::max(hL, hR);
+    int bal = hL - hR;
+    if (bal < -1 || bal > 1)
+        return RebalanceRequired;
+    return hN != hNRepl ? hNRepl : NothingRequired;
+}
+
+// walks up from a damaged node, fixing heights, rotating and unlinking
+// routing nodes that stopped routing as needed; heights are only hints to
+// readers, so each repair needs at most the locks of the node and its parent
+// (plus the children involved in a rotation)
+//
+// a rotation can leave a routing node it moves with a single child. that
+// node isn't on the way up, so it's set aside and repaired once the walk
+// is done
+template <typename K, typename V, typename Compare, typename Alloc>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::fixHeightAndRebalance(NodePtr node)
+{
+    NodePtr stranded[StrandedCapacity];
+    unsigned numStranded = 0;
+    while (true)
+    {
+        repairUpwards(node, stranded, numStranded);
+        if (numStranded == 0)
+            return;
+        node = stranded[--numStranded];
+    }
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::repairUpwards(NodePtr node, NodePtr* stranded, unsigned& numStranded)
+{
+    // rootHolder is the only node without a parent; it's never rebalanced
+    while (node != nullptr && node->parent != nullptr)
+    {
+        int condition = nodeCondition(node);
+        if (condition == NothingRequired || isUnlinked(node->version))
+            return;
+        if (condition != RebalanceRequired && condition != UnlinkRequired)
+        {
+            NodeLock nodeLock(lockNode(node));
+            node = fixHeightLocked(node);
+        }
+        else
+        {
+            NodePtr par = node->parent;
+            NodePtr unlinked = nullptr;
+            {
+                NodeLock parentLock(lockNode(par));
+                // if node moved in the meantime, just look at it again; an
+                // unlinked node still points at its old parent, and unlinking
+                // needs par's lock, so this check can't go stale
+                if (!isUnlinked(par->version) && node->parent == par && !isUnlinked(node->version))
+                {
+                    NodeLock nodeLock(lockNode(node));
+                    // a put may have brought it back to life meanwhile
+                    if (isRoutingNode(node) && canUnlink(node))
+                    {
+                        unlinkLocked(par, node);
+                        unlinked = node;
+                        node = fixHeightLocked(par);
+                    }
+                    else
+                    {
+                        // the nodes a rotation may move down
+                        NodePtr moved[] = { node, node->left, node->right };
+                        node = rebalanceLocked(par, node);
+                        for (NodePtr m : moved)
+                            if (m != nullptr && numStranded < StrandedCapacity && !isFrozen(m->version) && isRoutingNode(m) && canUnlink(m))
+                                stranded[numStranded++] = m;
+                    }
+                }
+            }
+            if (unlinked != nullptr)
+            {
+                epoch.retire(unlinked);
+                countNodes(-1, -1);
+                if (StatsEnabled)
+                    StatsRecord::bump(localStats()->compacted);
+            }
+        }
+    }
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+typename ConcurrentBSTMap<K, V, Compare, Alloc>::NodePtr ConcurrentBSTMap<K, V, Compare, Alloc>::fixHeightLocked(NodePtr node)
+{
+    int c = nodeCondition(node);
+    switch (c)
+    {
+        // can't repair with only this node's lock
+        case UnlinkRequired:
+        case RebalanceRequired:
+            return node;
+        // any future damage to this node is not our responsibility
+        case NothingRequired:
+            return nullptr;
+        // we've damaged our parent, but we can't fix it now
+        default:
+            node->height.store(c, std::memory_order_release);
+            return node->parent;
+    }
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+typename ConcurrentBSTMap<K, V, Compare, Alloc>::NodePtr ConcurrentBSTMap<K, V, Compare, Alloc>::rebalanceLocked(NodePtr par, NodePtr n)
+{
+    NodePtr nL = n->left;
+    NodePtr nR = n->right;
+    int hN = n->height;
+    int hL0 = height(nL);
+    int hR0 = height(nR);
+    int hNRepl = 1 + std::max(hL0, hR0);
+    int bal = hL0 - hR0;
+
+    // the child that rotates up changes, so it can't be a frozen one
+    if (bal > 1)
+        return rebalanceToRightLocked(par, n, unshareLocked(n, -1), hR0);
+    if (bal < -1)
+        return rebalanceToLeftLocked(par, n, unshareLocked(n, 1), hL0);
+    if (hNRepl != hN)
+    {
+        // we've got more than enough locks to fix the height,
+        // and par is already locked so try to fix it too
+        n->height.store(hNRepl, std::memory_order_release);
+        return fixHeightLocked(par);
+    }
+    return nullptr;
+}
+
+// n's left subtree is too tall; rotate right, preceded by a left rotation of
+// nL if nL's right side is the taller one
+template <typename K, typename V, typename Compare, typename Alloc>
+typename ConcurrentBSTMap<K, V, Compare, Alloc>::NodePtr ConcurrentBSTMap<K, V, Compare, Alloc>::rebalanceToRightLocked(NodePtr par, NodePtr n, NodePtr nL, int hR0)
+{
+    NodeLock leftLock(lockNode(nL));
+    int hL = nL->height;
+    // somebody fixed it before we got the lock; have the caller look again
+    if (hL - hR0 <= 1)
+        return n;
+    NodePtr nLR = nL->right;
+    int hLL0 = height(nL->left);
+    int hLR0 = height(nLR);
+    if (hLL0 >= hLR0)
+        return rotateRightLocked(par, n, nL, hR0, hLL0, nLR, hLR0);
+    {
+        nLR = unshareLocked(nL, 1);
+        NodeLock leftRightLock(lockNode(nLR));
+        // our snapshot of hLR might be stale, in which case a single
+        // right rotation of n is all we need
+        int hLR = nLR->height;
+        if (hLL0 >= hLR)
+            return rotateRightLocked(par, n, nL, hR0, hLL0, nLR, hLR);
+        // only do the double rotation if it leaves nL balanced; otherwise
+        // fix nL on its own first so we never create damaged nodes that
+        // aren't ancestors of each other
+        int hLRL = height(nLR->left);
+        int b = hLL0 - hLRL;
+        if (b >= -1 && b <= 1)
+            return rotateRightOverLeftLocked(par, n, nL, hR0, hLL0, nLR, hLRL);
+    }
+    // n will be balanced later if necessary
+    return rebalanceToLeftLocked(n, nL, nLR, hLL0);
+}
+
+// mirror image of rebalanceToRightLocked
+template <typename K, typename V, typename Compare, typename Alloc>
+typename ConcurrentBSTMap<K, V, Compare, Alloc>::NodePtr ConcurrentBSTMap<K, V, Compare, Alloc>::rebalanceToLeftLocked(NodePtr par, NodePtr n, NodePtr nR, int hL0)
+{
+    NodeLock rightLock(lockNode(nR));
+    int hR = nR->height;
+    if (hL0 - hR >= -1)
+        return n;
+    NodePtr nRL = nR->left;
+    int hRL0 = height(nRL);
+    int hRR0 = height(nR->right);
+    if (hRR0 >= hRL0)
+        return rotateLeftLocked(par, n, nR, hL0, hRR0, nRL, hRL0);
+    {
+        nRL = unshareLocked(nR, -1);
+        NodeLock rightLeftLock(lockNode(nRL));
+        int hRL = nRL->height;
+        if (hRR0 >= hRL)
+            return rotateLeftLocked(par, n, nR, hL0, hRR0, nRL, hRL);
+        int hRLR = height(nRL->right);
+        int b = hRR0 - hRLR;
+        if (b >= -1 && b <= 1)
+            return rotateLeftOverRightLocked(par, n, nR, hL0, hRR0, nRL, hRLR);
+    }
+    return rebalanceToRightLocked(n, nR, nRL, hRR0);
+}
+
+/*        par                par
+ *         |                  |
+ *         n                  nL
+ *        / \                /  \
+ *      nL   nR    =>      nLL   n
+ *     /  \                     / \
+ *   nLL  nLR                 nLR  nR
+ */
+template <typename K, typename V, typename Compare, typename Alloc>
+typename ConcurrentBSTMap<K, V, Compare, Alloc>::NodePtr ConcurrentBSTMap<K, V, Compare, Alloc>::rotateRightLocked(NodePtr par, NodePtr n, NodePtr nL, int hR, int hLL, NodePtr nLR, int hLR)
+{
+    long nodeV = n->version;
+    long leftV = nL->version;
+    NodePtr parL = par->left;
+
+    n->version.store(nodeV | Shrinking, std::memory_order_release);
+    nL->version.store(leftV | Growing, std::memory_order_release);
+
+    // links out of the shrinking node change first and the link into it
+    // changes last, so a reader can't get past n without noticing
+    n->setChild(-1, nLR);
+    nL->setChild(1, n);
+    if (parL == n)
+        par->setChild(-1, nL);
+    else
+        par->setChild(1, nL);
+
+    nL->parent.store(par, std::memory_order_release);
+    n->parent.store(nL, std::memory_order_release);
+    if (nLR != nullptr)
+        nLR->parent.store(n, std::memory_order_release);
+
+    int hNRepl = 1 + std::max(hLR, hR);
+    n->height.store(hNRepl, std::memory_order_release);
+    nL->height.store(1 + std::max(hLL, hNRepl), std::memory_order_release);
+
+    nL->version.store(leftV + GrowCountIncr, std::memory_order_release);
+    n->version.store(nodeV + ShrinkCountIncr, std::memory_order_release);
+
+    // par, nL and n are all damaged now and n is the deepest of them;
+    // fix what we can with the locks we've got
+    int balN = hLR - hR;
+    if (balN < -1 || balN > 1)
+        return n;
+    int balL = hLL - hNRepl;
+    if (balL < -1 || balL > 1)
+        return nL;
+    return fixHeightLocked(par);
+}
+
+// mirror image of rotateRightLocked
+template <typename K, typename V, typename Compare, typename Alloc>
+typename ConcurrentBSTMap<K, V, Compare, Alloc>::NodePtr ConcurrentBSTMap<K, V, Compare, Alloc>::rotateLeftLocked(NodePtr par, NodePtr n, NodePtr nR, int hL, int hRR, NodePtr nRL, int hRL)
+{
+    long nodeV = n->version;
+    long rightV = nR->version;
+    NodePtr parL = par->left;
+
+    n->version.store(nodeV | Shrinking, std::memory_order_release);
+    nR->version.store(rightV | Growing, std::memory_order_release);
+
+    n->setChild(1, nRL);
+    nR->setChild(-1, n);
+    if (parL == n)
+        par->setChild(-1, nR);
+    else
+        par->setChild(1, nR);
+
+    nR->parent.store(par, std::memory_order_release);
+    n->parent.store(nR, std::memory_order_release);
+    if (nRL != nullptr)
+        nRL->parent.store(n, std::memory_order_release);
+
+    int hNRepl = 1 + std::max(hL, hRL);
+    n->height.store(hNRepl, std::memory_order_release);
+    nR->height.store(1 + std::max(hNRepl, hRR), std::memory_order_release);
+
+    nR->version.store(rightV + GrowCountIncr, std::memory_order_release);
+    n->version.store(nodeV + ShrinkCountIncr, std::memory_order_release);
+
+    int balN = hRL - hL;
+    if (balN < -1 || balN > 1)
+        return n;
+    int balR = hRR - hNRepl;
+    if (balR < -1 || balR > 1)
+        return nR;
+    return fixHeightLocked(par);
+}
+
+/*        par                    par
+ *         |                      |
+ *         n                     nLR
+ *        / \                   /   \
+ *      nL   nR     =>        nL     n
+ *     /  \                  /  \   / \
+ *   nLL  nLR              nLL nLRL nLRR nR
+ *        /  \
+ *     nLRL  nLRR
+ */
+template <typename K, typename V, typename Compare, typename Alloc>
+typename ConcurrentBSTMap<K, V, Compare, Alloc>::NodePtr ConcurrentBSTMap<K, V, Compare, Alloc>::rotateRightOverLeftLocked(NodePtr par, NodePtr n, NodePtr nL, int hR, int hLL, NodePtr nLR, int hLRL)
+{
+    long nodeV = n->version;
+    long leftV = nL->version;
+    long leftRightV = nLR->version;
+    NodePtr parL = par->left;
+    NodePtr nLRL = nLR->left;
+    NodePtr nLRR = nLR->right;
+    int hLRR = height(nLRR);
+
+    n->version.store(nodeV | Shrinking, std::memory_order_release);
+    nL->version.store(leftV | Shrinking, std::memory_order_release);
+    nLR->version.store(leftRightV | Growing, std::memory_order_release);
+
+    n->setChild(-1, nLRR);
+    nL->setChild(1, nLRL);
+    nLR->setChild(-1, nL);
+    nLR->setChild(1, n);
+    if (parL == n)
+        par->setChild(-1, nLR);
+    else
+        par->setChild(1, nLR);
+
+    nLR->parent.store(par, std::memory_order_release);
+    nL->parent.store(nLR, std::memory_order_release);
+    n->parent.store(nLR, std::memory_order_release);
+    if (nLRR != nullptr)
+        nLRR->parent.store(n, std::memory_order_release);
+    if (nLRL != nullptr)
+        nLRL->parent.store(nL, std::memory_order_release);
+
+    int hNRepl = 1 + std::max(hLRR, hR);
+    n->height.store(hNRepl, std::memory_order_release);
+    int hLRepl = 1 + std::max(hLL, hLRL);
+    nL->height.store(hLRepl, std::memory_order_release);
+    nLR->height.store(1 + std::max(hLRepl, hNRepl), std::memory_order_release);
+
+    nLR->version.store(leftRightV + GrowCountIncr, std::memory_order_release);
+    nL->version.store(leftV + ShrinkCountIncr, std::memory_order_release);
+    n->version.store(nodeV + ShrinkCountIncr, std::memory_order_release);
+
+    // the caller made sure nL is balanced, so n is the deepest damaged node
+    int balN = hLRR - hR;
+    if (balN < -1 || balN > 1)
+        return n;
+    int balLR = hLRepl - hNRepl;
+    if (balLR < -1 || balLR > 1)
+        return nLR;
+    return fixHeightLocked(par);
+}
+
+// mirror image of rotateRightOverLeftLocked
+template <typename K, typename V, typename Compare, typename Alloc>
+typename ConcurrentBSTMap<K, V, Compare, Alloc>::NodePtr ConcurrentBSTMap<K, V, Compare, Alloc>::rotateLeftOverRightLocked(NodePtr par, NodePtr n, NodePtr nR, int hL, int hRR, NodePtr nRL, int hRLR)
+{
+    long nodeV = n->version;
+    long rightV = nR->version;
+    long rightLeftV = nRL->version;
+    NodePtr parL = par->left;
+    NodePtr nRLL = nRL->left;
+    NodePtr nRLR = nRL->right;
+    int hRLL = height(nRLL);
+
+    n->version.store(nodeV | Shrinking, std::memory_order_release);
+    nR->version.store(rightV | Shrinking, std::memory_order_release);
+    nRL->version.store(rightLeftV | Growing, std::memory_order_release);
+
+    n->setChild(1, nRLL);
+    nR->setChild(-1, nRLR);
+    nRL->setChild(1, nR);
+    nRL->setChild(-1, n);
+    if (parL == n)
+        par->setChild(-1, nRL);
+    else
+        par->setChild(1, nRL);
+
+    nRL->parent.store(par, std::memory_order_release);
+    nR->parent.store(nRL, std::memory_order_release);
+    n->parent.store(nRL, std::memory_order_release);
+    if (nRLL != nullptr)
+        nRLL->parent.store(n, std::memory_order_release);
+    if (nRLR != nullptr)
+        nRLR->parent.store(nR, std::memory_order_release);
+
+    int hNRepl = 1 + std::max(hL, hRLL);
+    n->height.store(hNRepl, std::memory_order_release);
+    int hRRepl = 1 + std::max(hRLR, hRR);
+    nR->height.store(hRRepl, std::memory_order_release);
+    nRL->height.store(1 + std::max(hNRepl, hRRepl), std::memory_order_release);
+
+    nRL->version.store(rightLeftV + GrowCountIncr, std::memory_order_release);
+    nR->version.store(rightV + ShrinkCountIncr, std::memory_order_release);
+    n->version.store(nodeV + ShrinkCountIncr, std::memory_order_release);
+
+    int balN = hRLL - hL;
+    if (balN < -1 || balN > 1)
+        return n;
+    int balRL = hRRepl - hNRepl;
+    if (balRL < -1 || balRL > 1)
+        return nRL;
+    return fixHeightLocked(par);
+}
+
+// has fewer than 2 children?
+template <typename K, typename V, typename Compare, typename Alloc>
+bool ConcurrentBSTMap<K, V, Compare, Alloc>::canUnlink(NodePtr& n)
+{
+    return !n->left || !n->right;
+}
+
+// -1 means a < b
+// 0 means  a == b
+// 1 means  a > b
+template <typename K, typename V, typename Compare, typename Alloc>
+inline int ConcurrentBSTMap<K, V, Compare, Alloc>::compare(const K& a, const K& b) const
+{
+    if (comp(a, b)) return -1;
+    if (comp(b, a)) return 1;
+    return 0;
+}
+
+// is the node logically deleted?
+template <typename K, typename V, typename Compare, typename Alloc>
+bool ConcurrentBSTMap<K, V, Compare, Alloc>::isRoutingNode(NodePtr& node)
+{
+    return node->tombstone.load(std::memory_order_acquire);
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename... Args>
+typename ConcurrentBSTMap<K, V, Compare, Alloc>::NodePtr ConcurrentBSTMap<K, V, Compare, Alloc>::newNode(Args&&... args)
+{
+    return ::new (nodePool.allocate()) Node<K, V>(std::forward<Args>(args)...);
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::destroyNode(NodePtr node)
+{
+    node->~Node();
+    nodePool.deallocate(node);
+}
+
+// tree deletion without recursion or a stack: rotate left children up until
+// the current node has none, then delete it and move on to its right child
+template <typename K, typename V, typename Compare, typename Alloc>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::deleteTree(NodePtr node)
+{
+    while (node != nullptr)
+    {
+        NodePtr l = node->left;
+        if (l != nullptr)
+        {
+            node->left.store(l->right, std::memory_order_relaxed);
+            l->right.store(node, std::memory_order_relaxed);
+            node = l;
+        }
+        else
+        {
+            NodePtr r = node->right;
+            destroyNode(node);
+            node = r;
+        }
+    }
+}
+
+// runs the destructors of the nodes still in the tree; their memory is left
+// for the pool to release in bulk. nodes with nothing to destroy (int keys,
+// for one) aren't even visited
+template <typename K, typename V, typename Compare, typename Alloc>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::destroyTree()
+{
+    if (!std::is_trivially_destructible<Node<K, V> >::value)
+        deleteTree(rootHolder);
+    rootHolder = nullptr;
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::deleteNode(void* context, void* p)
+{
+    static_cast<ConcurrentBSTMap*>(context)->destroyNode(static_cast<NodePtr>(p));
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+void* ConcurrentBSTMap<K, V, Compare, Alloc>::allocateRegion(void* context, std::size_t bytes)
+{
+    ConcurrentBSTMap* map = static_cast<ConcurrentBSTMap*>(context);
+    return RegionAllocTraits::allocate(map->regionAlloc, bytes);
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::deallocateRegion(void* context, void* p, std::size_t bytes)
+{
+    ConcurrentBSTMap* map = static_cast<ConcurrentBSTMap*>(context);
+    RegionAllocTraits::deallocate(map->regionAlloc, static_cast<char*>(p), bytes);
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::countNodes(long long nodes, long long routing)
+{
+    NodeCounts& counts = nodeCounts.local();
+    if (nodes != 0)
+        counts.nodes.store(counts.nodes.load(std::memory_order_relaxed) + nodes, std::memory_order_relaxed);
+    if (routing != 0)
+        counts.routing.store(counts.routing.load(std::memory_order_relaxed) + routing, std::memory_order_relaxed);
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+long long ConcurrentBSTMap<K, V, Compare, Alloc>::countKeys()
+{
+    long long keys = 0;
+    nodeCounts.forEach([&keys](NodeCounts& counts)
+    {
+        keys += counts.nodes.load(std::memory_order_relaxed) - counts.routing.load(std::memory_order_relaxed);
+    });
+    return keys;
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+StatsRecord* ConcurrentBSTMap<K, V, Compare, Alloc>::localStats()
+{
+    return StatsEnabled ? &statsCollector.local() : nullptr;
+}
+
+// every lock the map takes to change the tree goes through here
+template <typename K, typename V, typename Compare, typename Alloc>
+typename ConcurrentBSTMap<K, V, Compare, Alloc>::NodeLock ConcurrentBSTMap<K, V, Compare, Alloc>::lockNode(NodePtr node)
+{
+    if (!StatsEnabled)
+        return NodeLock(*node);
+    StatsRecord* stats = localStats();
+    StatsRecord::bump(stats->lockAcquisitions);
+    if (!node->try_lock())
+    {
+        StatsRecord::bump(stats->contendedLocks);
+        node->lock();
+    }
+    return NodeLock(*node, std::adopt_lock);
+}
+
+// prints all nodes recursively
+template <typename K, typename V, typename Compare, typename Alloc>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::print()
+{
+    rootHolder->print(-1);
+    std::cout << std::endl;
+}
+
+// deprecated; you can't use this technique for concurrent code
+// because of Heisenbug or whatever
+template <typename K, typename V, typename Compare, typename Alloc>
+void ConcurrentBSTMap<K, V, Compare, Alloc>::enableDebugOutput(bool enable)
+{
+    debug = enable;
+}
 
+// the int/int map is compiled once, in concurrentbst.cpp
+extern template class ConcurrentBSTMap<int, int>;
 
-#endif
\ No newline at end of file
+#endif
@@ -2,6 +2,7 @@
 #define DRIVER_HELPER_H
 
 #include <map>
+#include <optional>
 #include <mutex>
 #include <iostream>
 #include <string>
@@ -9,6 +10,14 @@
 
 std::mutex coutMutex;
 
+// the driver tests the int/int map
+typedef int K;
+typedef int V;
+typedef ConcurrentBSTMap<K,V> IntBSTMap;
+typedef ShardedBSTMap<K,V> IntShardedMap;
+typedef LockFreeBSTMap<K,V> IntLockFreeMap;
+typedef BLinkTreeMap<K,V> IntBLinkMap;
+
 
 enum class TestMode { None, Errors, Verbose };
 // using const ints for denoting the operations because I don't want to use static_cast to turn
@@ -53,36 +62,26 @@ std::vector<Operation> generateRandomOps(unsigned n, float ratioPut, float ratio
     return result;
 }
 
-bool get(ConcurrentBSTMap& bst, K k, V& v)
+// the same interface for IntBSTMap, IntShardedMap, IntLockFreeMap and
+// IntBLinkMap as for std::map below
+template <typename Map>
+bool get(Map& bst, K k, V& v)
 {
-    std::pair<Result,V> res(Result::Null, 0);
-    do
-    {
-        res = bst.get(k);
-    }
-    while (res.first == Result::Retry);
-    if (res.first == Result::Success) v = res.second;
-    return res.first == Result::Success;
+    std::optional<V> res = bst.get(k);
+    if (res) v = *res;
+    return res.has_value();
 }
 
-void put(ConcurrentBSTMap& bst, K k, V v)
+template <typename Map>
+void put(Map& bst, K k, V v)
 {
-    std::pair<Result,V> res(Result::Null, 0);
-    do
-    {
-        res = bst.put(k, v);
-    }
-    while (res.first == Result::Retry);
+    bst.put(k, v);
 }
 
-void remove(ConcurrentBSTMap& bst, K k)
+template <typename Map>
+void remove(Map& bst, K k)
 {
-    std::pair<Result,V> res(Result::Null, 0);
-    do
-    {
-        res = bst.remove(k);
-    }
-    while (res.first == Result::Retry);
+    bst.remove(k);
 }
 
 /*****************  overloaded for std::map  *****************/
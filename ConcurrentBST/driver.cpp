@@ -7,11 +7,26 @@
 #include <chrono>
 #include <sstream>
 #include <iomanip>
+#include <cmath>
+#include <fstream>
+#include <cstdio>
+#include <unistd.h>
 
 #include "concurrentbst.h"
+#include "shardedbst.h"
+#include "lockfreebst.h"
+#include "blinktree.h"
 #include "driver-helper.h"
+#include "workload.h"
+#include "topology.h"
+#include "perfcounters.h"
+#include "benchmark.h"
 
 const int numCores = (std::thread::hardware_concurrency() > 0 ? static_cast<int>(std::thread::hardware_concurrency()) : 4);
+// whatever came after the test number on the command line
+std::vector<std::string> testArgs;
+// set by a "perf" argument: the benchmarks count hardware events per thread
+bool perfCounters = false;
 
 // test0 (small): put 6-4-7-3-1-2-5-8-9-0, check 0-9 are all in it
 void test0()
@@ -31,7 +46,7 @@ void test0()
         {Put, std::make_pair(0, 0)}
     };
 
-    ConcurrentBSTMap bst;
+    IntBSTMap bst;
     run(bst, operations, TestMode::Verbose, false);
 }
 
@@ -63,7 +78,7 @@ void test1()
         {Put, std::make_pair(0, 0)}
     };
 
-    ConcurrentBSTMap bst;
+    IntBSTMap bst;
     run(bst, operations, TestMode::Verbose, false);
 }
 
@@ -90,7 +105,7 @@ void test2()
         {Remove, std::make_pair(0, 0)}
     };
 
-    ConcurrentBSTMap bst;
+    IntBSTMap bst;
     run(bst, operations, TestMode::Verbose, false);
 }
 
@@ -106,7 +121,7 @@ void test3()
         {Remove, std::make_pair(5, 0)}
     };
 
-    ConcurrentBSTMap bst;
+    IntBSTMap bst;
     run(bst, operations, TestMode::Verbose, false);
 }
 
@@ -149,20 +164,20 @@ void test4()
         {Remove, std::make_pair(0, 0)}
     };
 
-    ConcurrentBSTMap bst;
+    IntBSTMap bst;
     run(bst, operations, TestMode::Verbose, false);
 }
 
-void test5()
+// test5's phases, on any of the maps
+template <typename Map>
+void correctnessTest()
 {
-    std::cout << "-------------- TEST5 --------------\n";
-
     const int numThreads = numCores;
     const int numPutsPerThread = 100; 
     const int numRemovesPerThread = 50;
     const int numGetsPerThread = 100;
 
-    ConcurrentBSTMap bst;
+    Map bst;
 
     // the threads will move through the three phases of testing in lockstep
     std::vector<Operation> puts = generateRandomOps(numPutsPerThread * numThreads, 1, 0, 0);
@@ -187,7 +202,7 @@ void test5()
     run(tracker, puts, TestMode::None, false);
     std::vector<std::thread> threads;
     for (const std::vector<Operation>& ops : distPuts)
-        threads.push_back( std::thread(run<ConcurrentBSTMap>, std::ref(bst), ops, TestMode::None, true) );
+        threads.push_back( std::thread(run<Map>, std::ref(bst), ops, TestMode::None, true) );
     for (std::thread& th : threads)
         th.join();
     threads.clear();
@@ -204,13 +219,13 @@ void test5()
     std::map<K,V> removed(tracker);
     run(tracker, removes, TestMode::None, false);
     for (const std::vector<Operation>& ops : distRemoves)
-        threads.push_back( std::thread(run<ConcurrentBSTMap>, std::ref(bst), ops, TestMode::None, true) );
+        threads.push_back( std::thread(run<Map>, std::ref(bst), ops, TestMode::None, true) );
     for (std::thread& th : threads)
         th.join();
     threads.clear();
 
     // phase 2 part 2: check that all concurrent remove operations succeeded
-    for (const std::pair<K,V>& remaining : tracker)
+    for (const std::pair<const K,V>& remaining : tracker)
         removed.erase(remaining.first);
     bool res2 = checkElemsInBST(bst, tracker);
     bool res3 = checkElemsNotInBST(bst, removed);
@@ -224,7 +239,7 @@ void test5()
     // phase 3: concurrent get operations (no modification)
     std::cout << numThreads << " threads * " << numGetsPerThread << " gets/thread = " << (numThreads * numGetsPerThread) << " gets...\n";
     for (const std::vector<Operation>& ops : distGets)
-        threads.push_back( std::thread(run<ConcurrentBSTMap>, std::ref(bst), ops, TestMode::None, true) );
+        threads.push_back( std::thread(run<Map>, std::ref(bst), ops, TestMode::None, true) );
     for (std::thread& th : threads)
         th.join();
     threads.clear();
@@ -233,10 +248,16 @@ void test5()
         std::cout << "\nAll good\n";
 }
 
-void test6()
+void test5()
 {
-    std::cout << "-------------- TEST6 --------------\n";
+    std::cout << "-------------- TEST5 --------------\n";
+    correctnessTest<IntBSTMap>();
+}
 
+// test6's threads, on any of the maps
+template <typename Map>
+void stressTest()
+{
     const int numThreads = numCores;
     const int numOpsPerThread = 1000;
     const float ratioPut = 0.333;
@@ -246,7 +267,7 @@ void test6()
     const int numRemovesPerThread = static_cast<int>(numOpsPerThread * ratioRemove);
     const int numGetsPerThread = numOpsPerThread - numPutsPerThread - numRemovesPerThread;
 
-    ConcurrentBSTMap bst;
+    Map bst;
 
     std::cout << numThreads << " threads * " << numPutsPerThread << " puts/thread = " << (numThreads * numPutsPerThread) << " puts...\n";
     std::cout << numThreads << " threads * " << numRemovesPerThread << " removes/thread = " << (numThreads * numRemovesPerThread) << " removes...\n";
@@ -259,7 +280,7 @@ void test6()
 
     std::vector<std::thread> threads;
     for (const std::vector<Operation>& ops : concurrentOps)
-        threads.push_back( std::thread(run<ConcurrentBSTMap>, std::ref(bst), ops, TestMode::None, true) );
+        threads.push_back( std::thread(run<Map>, std::ref(bst), ops, TestMode::None, true) );
     for (std::thread& th : threads)
         th.join();
     threads.clear();
@@ -267,37 +288,110 @@ void test6()
     std::cout << "\nAll good\n";
 }
 
-void timeTest(int numOpsPerThread, int numThreads, float ratioPut, float ratioRemove, float ratioGet)
+void test6()
+{
+    std::cout << "-------------- TEST6 --------------\n";
+    stressTest<IntBSTMap>();
+}
+
+// every thread generates its own stream of operations as it runs them, a
+// chunk at a time, so long runs need no memory for their operations; the
+// single-threaded std::map then replays the streams one after another, and
+// every map pays the same for generating them. the key range is as many
+// keys as there are operations of the most frequent type. sharded, lockFree
+// and blink time the same streams on those maps as well
+void timeTest(int numOpsPerThread, int numThreads, float ratioPut, float ratioRemove, float ratioGet, KeyDist dist = KeyDist::Uniform,
+              bool sharded = false, bool lockFree = false, bool blink = false)
 {
     std::cout << (numThreads * numOpsPerThread) << " operations with (put, remove, get) frequencies of ("
-              << std::setprecision(4) << ratioPut << ", " << ratioRemove << ", " << ratioGet << ")\n";
+              << std::setprecision(4) << ratioPut << ", " << ratioRemove << ", " << ratioGet << "), " << distName(dist) << " keys\n";
 
-    std::vector<Operation> allOps = generateRandomOps(numOpsPerThread * numThreads, ratioPut, ratioRemove, ratioGet);
-    std::vector<std::vector<Operation> > distOps;
-    for (int i = 0; i < numThreads; ++i)
-        distOps.emplace_back(allOps.begin() + i*numOpsPerThread, allOps.begin() + (i+1)*numOpsPerThread);
+    float ratioTotal = ratioPut + ratioRemove + ratioGet;
+    K keyRange = static_cast<K>(std::max(1.0, static_cast<double>(numOpsPerThread) * numThreads * std::max(std::max(ratioPut, ratioRemove), ratioGet) / ratioTotal));
+    Workload w = workload(dist, keyRange, ratioPut, ratioRemove, ratioGet);
+    unsigned seed = std::random_device()();
 
     auto start1 = std::chrono::high_resolution_clock::now();
-    ConcurrentBSTMap bst;
+    IntBSTMap bst;
     std::vector<std::thread> threads;
-    for (const std::vector<Operation> ops : distOps)
-        threads.push_back( std::thread(run<ConcurrentBSTMap>, std::ref(bst), ops, TestMode::None, true) );
+    for (int t = 0; t < numThreads; ++t)
+        threads.push_back( std::thread(runStream<IntBSTMap>, std::ref(bst), OpGenerator(w, t, numThreads, seed), numOpsPerThread, true) );
     for (std::thread& th : threads)
         th.join();
     auto stop1 = std::chrono::high_resolution_clock::now();
 
+    // the same streams on a map sharded over the key range
+    auto start3 = std::chrono::high_resolution_clock::now();
+    if (sharded)
+    {
+        IntShardedMap shards(IntShardedMap::evenSplits(1, keyRange + 1, IntShardedMap::shardsFor(numThreads)));
+        threads.clear();
+        for (int t = 0; t < numThreads; ++t)
+            threads.push_back( std::thread(runStream<IntShardedMap>, std::ref(shards), OpGenerator(w, t, numThreads, seed), numOpsPerThread, true) );
+        for (std::thread& th : threads)
+            th.join();
+    }
+    auto stop3 = std::chrono::high_resolution_clock::now();
+
+    auto start4 = std::chrono::high_resolution_clock::now();
+    if (lockFree)
+    {
+        IntLockFreeMap lockFreeMap;
+        threads.clear();
+        for (int t = 0; t < numThreads; ++t)
+            threads.push_back( std::thread(runStream<IntLockFreeMap>, std::ref(lockFreeMap), OpGenerator(w, t, numThreads, seed), numOpsPerThread, true) );
+        for (std::thread& th : threads)
+            th.join();
+    }
+    auto stop4 = std::chrono::high_resolution_clock::now();
+
+    auto start5 = std::chrono::high_resolution_clock::now();
+    if (blink)
+    {
+        IntBLinkMap blinkMap;
+        threads.clear();
+        for (int t = 0; t < numThreads; ++t)
+            threads.push_back( std::thread(runStream<IntBLinkMap>, std::ref(blinkMap), OpGenerator(w, t, numThreads, seed), numOpsPerThread, true) );
+        for (std::thread& th : threads)
+            th.join();
+    }
+    auto stop5 = std::chrono::high_resolution_clock::now();
+
     auto start2 = std::chrono::high_resolution_clock::now();
     std::map<K,V> comparison;
-    run(comparison, allOps, TestMode::None, false);
+    for (int t = 0; t < numThreads; ++t)
+        runStream(comparison, OpGenerator(w, t, numThreads, seed), numOpsPerThread, false);
     auto stop2 = std::chrono::high_resolution_clock::now();
 
     auto duration1 = std::chrono::duration_cast<std::chrono::microseconds>(stop1 - start1);
     auto duration2 = std::chrono::duration_cast<std::chrono::microseconds>(stop2 - start2);
+    auto duration3 = std::chrono::duration_cast<std::chrono::microseconds>(stop3 - start3);
+    auto duration4 = std::chrono::duration_cast<std::chrono::microseconds>(stop4 - start4);
+    auto duration5 = std::chrono::duration_cast<std::chrono::microseconds>(stop5 - start5);
 
     std::stringstream threaded;
     threaded << numThreads << "-threaded ConcurrentBSTMap = ";
     std::cout << std::setw(33) << threaded.str()
-              << std::setw(7) << duration1.count() << " microseconds\n"
+              << std::setw(7) << duration1.count() << " microseconds\n";
+    if (sharded)
+    {
+        std::stringstream shardedName;
+        shardedName << numThreads << "-threaded, " << IntShardedMap::shardsFor(numThreads) << " shards = ";
+        std::cout << std::setw(33) << shardedName.str() << std::setw(7) << duration3.count() << " microseconds\n";
+    }
+    if (lockFree)
+    {
+        std::stringstream lockFreeName;
+        lockFreeName << numThreads << "-threaded LockFreeBSTMap = ";
+        std::cout << std::setw(33) << lockFreeName.str() << std::setw(7) << duration4.count() << " microseconds\n";
+    }
+    if (blink)
+    {
+        std::stringstream blinkName;
+        blinkName << numThreads << "-threaded BLinkTreeMap = ";
+        std::cout << std::setw(33) << blinkName.str() << std::setw(7) << duration5.count() << " microseconds\n";
+    }
+    std::cout
               << std::setw(33) << "Single-threaded std::map = "
               << std::setw(7) << duration2.count() << " microseconds\n\n"
               << "Performance improvement = " << std::setprecision(4) << ( duration2.count() / static_cast<double>(duration1.count()) ) << std::endl;
@@ -306,44 +400,1799 @@ void timeTest(int numOpsPerThread, int numThreads, float ratioPut, float ratioRe
 void test7()
 {
     std::cout << "-------------- TEST7 --------------\n";
-    timeTest(50000, numCores, 0.333, 0.333, 0.334);
+    timeTest(50000, numCores, 0.333, 0.333, 0.334, KeyDist::Uniform, false, false, true);
 }
 
 void test8()
 {
     std::cout << "-------------- TEST8 --------------\n";
-    timeTest(50000, numCores, 0.8, 0.1, 0.1);
+    timeTest(50000, numCores, 0.8, 0.1, 0.1, KeyDist::Uniform, false, false, true);
 }
 
 void test9()
 {
     std::cout << "-------------- TEST9 --------------\n";
-    timeTest(50000, numCores, 0.1, 0.8, 0.1);
+    timeTest(50000, numCores, 0.1, 0.8, 0.1, KeyDist::Uniform, false, false, true);
 }
 
 void test10()
 {
     std::cout << "-------------- TEST10 -------------\n";
-    timeTest(50000, numCores, 0.1, 0.1, 0.8);
+    timeTest(50000, numCores, 0.1, 0.1, 0.8, KeyDist::Uniform, false, false, true);
 }
 
 void test11()
 {
     std::cout << "-------------- TEST11 -------------\n";
-    timeTest(10000000, numCores / 2, 0.333, 0.333, 0.334);
+    timeTest(10000000, numCores / 2, 0.333, 0.333, 0.334, KeyDist::Uniform, true, true, true);
     std::cout << "\n";
-    timeTest(10000000 / 2, numCores, 0.333, 0.333, 0.334);
+    timeTest(10000000 / 2, numCores, 0.333, 0.333, 0.334, KeyDist::Uniform, true, true, true);
+    std::cout << "\n";
+    timeTest(10000000 / 4, numCores * 2, 0.333, 0.333, 0.334, KeyDist::Uniform, true, true, true);
+    std::cout << "\n";
+    timeTest(10000000 / 8, numCores * 4, 0.333, 0.333, 0.334, KeyDist::Uniform, true, true, true);
+    std::cout << "\n";
+    timeTest(10000000 / 16, numCores * 8, 0.333, 0.333, 0.334, KeyDist::Uniform, true, true, true);
+    std::cout << "\n";
+}
+
+// test12: keys arrive in ascending order (each thread inserts its own
+// ascending stride), then random gets; the tree has to stay O(log n) tall
+void test12()
+{
+    std::cout << "-------------- TEST12 -------------\n";
+
+    const int numThreads = numCores;
+    const int numKeys = 1000000;
+
+    std::vector<std::vector<Operation> > distPuts(numThreads);
+    for (int i = 0; i < numKeys; ++i)
+        distPuts[i % numThreads].push_back( {Put, std::make_pair(i, i)} );
+    std::vector<Operation> gets = generateRandomOps(numKeys, 0, 0, 1);
+    std::vector<std::vector<Operation> > distGets;
+    for (int i = 0; i < numThreads; ++i)
+        distGets.emplace_back(gets.begin() + i*numKeys/numThreads, gets.begin() + (i+1)*numKeys/numThreads);
+
+    std::cout << numThreads << " threads put " << numKeys << " keys in ascending order, then get them in random order\n";
+
+    IntBSTMap bst;
+    std::vector<std::thread> threads;
+    auto start1 = std::chrono::high_resolution_clock::now();
+    for (const std::vector<Operation>& ops : distPuts)
+        threads.push_back( std::thread(run<IntBSTMap>, std::ref(bst), std::cref(ops), TestMode::None, true) );
+    for (std::thread& th : threads)
+        th.join();
+    threads.clear();
+    auto stop1 = std::chrono::high_resolution_clock::now();
+
+    auto start2 = std::chrono::high_resolution_clock::now();
+    for (const std::vector<Operation>& ops : distGets)
+        threads.push_back( std::thread(run<IntBSTMap>, std::ref(bst), std::cref(ops), TestMode::None, true) );
+    for (std::thread& th : threads)
+        th.join();
+    threads.clear();
+    auto stop2 = std::chrono::high_resolution_clock::now();
+
+    std::map<K,V> tracker;
+    run(tracker, gets, TestMode::None, false);
+    for (const std::vector<Operation>& ops : distPuts)
+        run(tracker, ops, TestMode::None, false);
+    bool res = checkElemsInBST(bst, tracker);
+
+    // a perfectly balanced tree is ceil(log2(n+1)) tall, AVL allows ~1.44x that
+    int optimal = static_cast<int>(std::ceil(std::log2(numKeys + 1.0)));
+    auto duration1 = std::chrono::duration_cast<std::chrono::microseconds>(stop1 - start1);
+    auto duration2 = std::chrono::duration_cast<std::chrono::microseconds>(stop2 - start2);
+    std::cout << std::setw(33) << "Ascending puts = " << std::setw(7) << duration1.count() << " microseconds\n"
+              << std::setw(33) << "Random gets = " << std::setw(7) << duration2.count() << " microseconds\n"
+              << std::setw(33) << "Tree height = " << std::setw(7) << bst.height() << " (optimal " << optimal << ")\n";
+    if (!res)
+        std::cout << "Couldn't find some elements that should be in the BST\n";
+    else if (bst.height() > optimal * 3 / 2)
+        std::cout << "The tree is not balanced\n";
+    else
+        std::cout << "\nAll good\n";
+}
+
+// resident set size in KB, or 0 where /proc isn't available
+long residentKB()
+{
+    std::ifstream statm("/proc/self/statm");
+    long size = 0, resident = 0;
+    if (!(statm >> size >> resident))
+        return 0;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// test13: remove/put churn over a fixed key range; unlinked nodes must be
+// freed while the map is alive, so memory should stop growing after warm-up
+void test13()
+{
+    std::cout << "-------------- TEST13 -------------\n";
+
+    const int numThreads = numCores;
+    const int numRounds = 10;
+    const int numOpsPerRound = 400000;
+    const int keyRange = 100000;
+
+    IntBSTMap bst;
+    std::vector<long> rss;
+    std::cout << numThreads << " threads * " << numRounds << " rounds of " << numOpsPerRound / numThreads
+              << " remove/put pairs/thread over " << keyRange << " keys\n";
+    for (int round = 0; round < numRounds; ++round)
+    {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < numThreads; ++t)
+            threads.push_back( std::thread([&bst, round, t, numThreads]()
+            {
+                std::mt19937 gen(round * numThreads + t);
+                std::uniform_int_distribution<K> dist(1, keyRange);
+                for (int i = 0; i < numOpsPerRound / numThreads; ++i)
+                {
+                    remove(bst, dist(gen));
+                    K k = dist(gen);
+                    put(bst, k, k);
+                }
+                bst.quiescent();
+            }) );
+        for (std::thread& th : threads)
+            th.join();
+        rss.push_back(residentKB());
+        std::cout << "Round " << std::setw(2) << round << ": resident = " << std::setw(7) << rss.back() << " KB\n";
+    }
+
+    // the first rounds grow the tree to its steady-state size
+    if (rss.back() == 0)
+        std::cout << "\nCouldn't read resident set size\n";
+    else if (rss.back() > rss[numRounds / 2] + rss[numRounds / 2] / 10)
+        std::cout << "\nMemory keeps growing\n";
+    else
+        std::cout << "\nAll good\n";
+}
+
+// a small, thread-safe allocator that counts live elements (bytes, for the
+// map, which only uses it for its node slabs), and throws std::bad_alloc
+// rather than have more than limit of them live
+template <typename T>
+struct CountingAllocator
+{
+    typedef T value_type;
+    std::shared_ptr<std::atomic<long> > live;
+    std::shared_ptr<std::atomic<long> > limit;
+
+    CountingAllocator()
+        : live(std::make_shared<std::atomic<long> >(0)), limit(std::make_shared<std::atomic<long> >(std::numeric_limits<long>::max())) {}
+    template <typename U>
+    CountingAllocator(const CountingAllocator<U>& other) : live(other.live), limit(other.limit) {}
+    T* allocate(std::size_t n)
+    {
+        if (*live + static_cast<long>(n) > *limit)
+            throw std::bad_alloc();
+        *live += n;
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+    void deallocate(T* p, std::size_t n)
+    {
+        *live -= n;
+        ::operator delete(p);
+    }
+};
+template <typename T, typename U>
+bool operator==(const CountingAllocator<T>& a, const CountingAllocator<U>& b) { return a.live == b.live; }
+template <typename T, typename U>
+bool operator!=(const CountingAllocator<T>& a, const CountingAllocator<U>& b) { return a.live != b.live; }
+
+// test14 (small): a map with 64-bit keys, struct values, a reversed comparator
+// and a counting allocator; INT_MIN is an ordinary value now
+void test14()
+{
+    std::cout << "-------------- TEST14 -------------\n";
+    struct Point { int x; int y; };
+    typedef unsigned long long Id;
+    CountingAllocator<std::pair<const Id, Point> > alloc;
+    bool ok = true;
+    {
+        ConcurrentBSTMap<Id, Point, std::greater<Id>, CountingAllocator<std::pair<const Id, Point> > > pointMap(std::greater<Id>(), alloc);
+        const Id base = 1ULL << 40;
+        for (Id i = 0; i < 100; ++i)
+            pointMap.put(base + i, Point{ static_cast<int>(i), -static_cast<int>(i) });
+        for (Id i = 0; i < 100; i += 2)
+            pointMap.remove(base + i);
+        for (Id i = 0; i < 100; ++i)
+        {
+            std::optional<Point> res = pointMap.get(base + i);
+            if ((i % 2 == 0) != !res || (res && res->y != -static_cast<int>(i)))
+                ok = false;
+        }
+        std::cout << "put 100 points with 64-bit ids, removed the even ones: " << (ok ? "ok" : "wrong") << "\n";
+
+        IntBSTMap intMap;
+        std::optional<V> before = intMap.put(7, std::numeric_limits<V>::min());
+        std::optional<V> after = intMap.get(7);
+        bool minOk = !before && after == std::numeric_limits<V>::min();
+        std::cout << "put(7, INT_MIN) then get(7): " << (minOk ? "ok" : "wrong") << "\n";
+        ok = ok && minOk;
+    }
+    std::cout << "bytes still allocated after destruction: " << *alloc.live << "\n";
+    if (ok && *alloc.live == 0)
+        std::cout << "\nAll good\n";
+}
+
+// test15 (memory): nodes are carved out of per-thread slabs; check how much
+// the map takes from its allocator per entry, and that clear() and the
+// destructor give it all back in bulk
+void test15()
+{
+    std::cout << "-------------- TEST15 -------------\n";
+
+    typedef CountingAllocator<std::pair<const K, V> > ByteCounter;
+    typedef ConcurrentBSTMap<K, V, std::less<K>, ByteCounter> CountedBSTMap;
+    const int numThreads = numCores;
+    const int numKeys = 1000000;
+
+    std::vector<Operation> puts = generateRandomOps(numKeys, 1, 0, 0);
+    std::cout << numThreads << " threads put " << numKeys << " keys in random order\n";
+
+    ByteCounter alloc;
+    bool ok = true;
+    long afterClear = 0;
+    std::chrono::microseconds clearTime(0);
+    {
+        CountedBSTMap bst(std::less<K>(), alloc);
+        auto fill = [&bst, &puts, numThreads](int t)
+        {
+            for (std::size_t i = t; i < puts.size(); i += numThreads)
+                bst.put(puts[i].elem.first, puts[i].elem.second);
+        };
+        std::vector<std::thread> threads;
+        auto start1 = std::chrono::high_resolution_clock::now();
+        for (int t = 0; t < numThreads; ++t)
+            threads.push_back( std::thread(fill, t) );
+        for (std::thread& th : threads)
+            th.join();
+        auto stop1 = std::chrono::high_resolution_clock::now();
+
+        double perEntry = static_cast<double>(*alloc.live) / numKeys;
+        std::cout << std::setw(33) << "Puts = " << std::setw(7) << std::chrono::duration_cast<std::chrono::microseconds>(stop1 - start1).count() << " microseconds\n"
+                  << std::setw(33) << "Bytes per entry = " << std::setw(7) << perEntry << " (sizeof(Node) = " << sizeof(Node<K, V>) << ")\n";
+        // chunk headers, region slack and half-used chunks, nothing per node
+        ok = perEntry < sizeof(Node<K, V>) * 1.25;
+
+        auto start2 = std::chrono::high_resolution_clock::now();
+        bst.clear();
+        auto stop2 = std::chrono::high_resolution_clock::now();
+        clearTime = std::chrono::duration_cast<std::chrono::microseconds>(stop2 - start2);
+        afterClear = *alloc.live;
+        for (int i = 1; i <= 1000; ++i)
+            bst.put(i, -i);
+        for (int i = 1; i <= numKeys; i += 997)
+        {
+            std::optional<V> res = bst.get(i);
+            if ((i <= 1000) != res.has_value() || (i <= 1000 && *res != -i))
+                ok = false;
+        }
+    }
+    std::cout << std::setw(33) << "clear() = " << std::setw(7) << clearTime.count() << " microseconds, "
+              << afterClear << " bytes left for the new root\n"
+              << std::setw(33) << "Bytes left after destruction = " << std::setw(7) << *alloc.live << "\n";
+    if (!ok)
+        std::cout << "Wrong contents or too much memory per entry\n";
+    else if (*alloc.live != 0)
+        std::cout << "Memory was leaked\n";
+    else
+        std::cout << "\nAll good\n";
+}
+
+// test16 (correctness): ordered queries; first against std::map on a quiet
+// map with routing nodes in it, then scans racing with writers that churn
+// the odd keys while the even ones stay put
+void test16()
+{
+    std::cout << "-------------- TEST16 -------------\n";
+
+    bool ok = true;
+    {
+        IntBSTMap bst;
+        std::map<K,V> tracker;
+        for (K k = 1; k < 1000; k += 3)
+        {
+            put(bst, k, 2 * k);
+            tracker[k] = 2 * k;
+        }
+        // leaves routing nodes behind wherever the removed node had two children
+        for (K k = 1; k < 1000; k += 15)
+        {
+            remove(bst, k);
+            tracker.erase(k);
+        }
+        for (K q = -2; q < 1003; ++q)
+        {
+            std::map<K,V>::iterator ge = tracker.lower_bound(q);
+            std::map<K,V>::iterator gt = tracker.upper_bound(q);
+            std::optional<IntBSTMap::Entry> c = bst.ceiling(q);
+            std::optional<IntBSTMap::Entry> s = bst.successor(q);
+            std::optional<IntBSTMap::Entry> f = bst.floor(q);
+            if ((ge == tracker.end()) != !c || (ge != tracker.end() && *c != IntBSTMap::Entry(*ge)))
+                ok = false;
+            if ((gt == tracker.end()) != !s || (gt != tracker.end() && *s != IntBSTMap::Entry(*gt)))
+                ok = false;
+            if ((gt == tracker.begin()) != !f || (gt != tracker.begin() && *f != IntBSTMap::Entry(*std::prev(gt))))
+                ok = false;
+        }
+        ok = ok && bst.first() == IntBSTMap::Entry(*tracker.begin()) && bst.last() == IntBSTMap::Entry(*tracker.rbegin());
+        std::vector<IntBSTMap::Entry> scanned;
+        bst.scan(100, 600, [&scanned](K k, V v) { scanned.push_back(std::make_pair(k, v)); });
+        std::vector<IntBSTMap::Entry> expected(tracker.lower_bound(100), tracker.lower_bound(600));
+        ok = ok && scanned == expected;
+        IntBSTMap empty;
+        ok = ok && !empty.first() && !empty.floor(5);
+        std::cout << "floor/ceiling/successor/first/last/scan against std::map: " << (ok ? "ok" : "wrong") << "\n";
+    }
+
+    const int numWriters = numCores;
+    const int numScans = 200;
+    const K keyRange = 20000;
+    IntBSTMap bst;
+    for (K k = 0; k < keyRange; k += 2)
+        put(bst, k, k);
+    std::atomic<bool> done(false);
+    std::vector<std::thread> writers;
+    for (int t = 0; t < numWriters; ++t)
+        writers.push_back( std::thread([&bst, &done, t]()
+        {
+            std::mt19937 gen(t);
+            std::uniform_int_distribution<K> dist(0, keyRange / 2 - 1);
+            while (!done)
+            {
+                K k = 2 * dist(gen) + 1;
+                if (gen() % 2)
+                    put(bst, k, k);
+                else
+                    remove(bst, k);
+            }
+        }) );
+
+    std::mt19937 gen(numWriters);
+    std::uniform_int_distribution<K> dist(0, keyRange);
+    int bad = 0;
+    for (int i = 0; i < numScans; ++i)
+    {
+        K lo = dist(gen), hi = dist(gen);
+        if (lo > hi)
+            std::swap(lo, hi);
+        K expected = lo + (lo % 2);
+        K prev = lo - 1;
+        bool sorted = true;
+        bst.scan(lo, hi, [&](K k, V v)
+        {
+            if (k <= prev || k >= hi || v != k)
+                sorted = false;
+            // every even key in range has to show up, in order
+            if (k % 2 == 0)
+            {
+                if (k != expected)
+                    sorted = false;
+                expected = k + 2;
+            }
+            prev = k;
+        });
+        if (!sorted || expected < hi)
+            ++bad;
+    }
+    done = true;
+    for (std::thread& th : writers)
+        th.join();
+    std::cout << numScans << " scans racing with " << numWriters << " writers: " << bad << " out of order or missing stable keys\n";
+    if (ok && bad == 0)
+        std::cout << "\nAll good\n";
+}
+
+// times numThreads threads handing batches to fn (batch i goes to thread
+// i % numThreads), in microseconds
+template <typename Batch, typename Fn>
+long long timeBatches(const std::vector<Batch>& batches, int numThreads, Fn fn)
+{
+    std::vector<std::thread> threads;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int t = 0; t < numThreads; ++t)
+        threads.push_back( std::thread([&batches, &fn, numThreads, t]()
+        {
+            for (std::size_t i = t; i < batches.size(); i += numThreads)
+                fn(batches[i]);
+        }) );
+    for (std::thread& th : threads)
+        th.join();
+    auto stop = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+}
+
+// test17 (performance): sorted batches through putAll/removeAll against the
+// same keys one at a time through run(); once with random keys, once with
+// batches of consecutive keys appended in order
+void test17()
+{
+    std::cout << "-------------- TEST17 -------------\n";
+
+    typedef std::vector<std::pair<K,V> > Batch;
+    const int numThreads = numCores;
+    const int numKeys = 1000000;
+    const int batchSize = 4096;
+
+    std::vector<K> keys(numKeys);
+    std::iota(keys.begin(), keys.end(), 1);
+    std::vector<Batch> appends;
+    for (int i = 0; i < numKeys; i += batchSize)
+        appends.push_back( Batch() );
+    for (int i = 0; i < numKeys; ++i)
+        appends[i / batchSize].push_back( std::make_pair(keys[i], keys[i]) );
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(numKeys));
+    std::vector<Batch> randoms(appends.size());
+    for (int i = 0; i < numKeys; ++i)
+        randoms[i / batchSize].push_back( std::make_pair(keys[i], keys[i]) );
+    for (Batch& batch : randoms)
+        std::sort(batch.begin(), batch.end());
+
+    std::cout << numThreads << " threads put " << numKeys << " keys in sorted batches of " << batchSize << ", then remove them\n";
+    bool ok = true;
+    std::map<K,V> tracker(appends.front().begin(), appends.front().end());
+    for (const Batch& batch : appends)
+        tracker.insert(batch.begin(), batch.end());
+    const char* names[] = { "random keys", "appended keys" };
+    const std::vector<Batch>* workloads[] = { &randoms, &appends };
+    for (int w = 0; w < 2; ++w)
+    {
+        const std::vector<Batch>& batches = *workloads[w];
+        std::vector<std::vector<Operation> > putOps, removeOps;
+        for (const Batch& batch : batches)
+        {
+            putOps.push_back( std::vector<Operation>() );
+            removeOps.push_back( std::vector<Operation>() );
+            for (const std::pair<K,V>& elem : batch)
+            {
+                putOps.back().push_back( {Put, elem} );
+                removeOps.back().push_back( {Remove, elem} );
+            }
+        }
+        IntBSTMap perKey, batched;
+        long long perKeyPut = timeBatches(putOps, numThreads, [&perKey](const std::vector<Operation>& ops) { run(perKey, ops, TestMode::None, true); });
+        long long batchPut = timeBatches(batches, numThreads, [&batched, &ok](const Batch& batch)
+        {
+            for (const std::optional<V>& res : batched.putAll(batch.begin(), batch.end()))
+                if (res)
+                    ok = false;
+        });
+        ok = ok && checkElemsInBST(batched, tracker);
+        long long perKeyRemove = timeBatches(removeOps, numThreads, [&perKey](const std::vector<Operation>& ops) { run(perKey, ops, TestMode::None, true); });
+        long long batchRemove = timeBatches(batches, numThreads, [&batched, &ok](const Batch& batch)
+        {
+            std::vector<K> batchKeys;
+            for (const std::pair<K,V>& elem : batch)
+                batchKeys.push_back(elem.first);
+            for (const std::optional<V>& res : batched.removeAll(batchKeys.begin(), batchKeys.end()))
+                if (!res)
+                    ok = false;
+        });
+        ok = ok && !batched.first();
+        std::cout << names[w] << ":\n"
+                  << std::setw(33) << "per-key puts = " << std::setw(7) << perKeyPut << " microseconds\n"
+                  << std::setw(33) << "putAll = " << std::setw(7) << batchPut << " microseconds\n"
+                  << std::setw(33) << "per-key removes = " << std::setw(7) << perKeyRemove << " microseconds\n"
+                  << std::setw(33) << "removeAll = " << std::setw(7) << batchRemove << " microseconds\n";
+    }
+    if (!ok)
+        std::cout << "Wrong results or contents after the batches\n";
+    else
+        std::cout << "\nAll good\n";
+}
+
+// runs every config on all four maps; a summary goes to stderr and the results to stdout
+void runBenchmarks(std::vector<BenchConfig> configs, const std::string& format)
+{
+    std::vector<BenchResult> results;
+    for (BenchConfig& config : configs)
+    {
+        config.counters = perfCounters;
+        results.push_back(runBenchmark<IntBSTMap>("ConcurrentBSTMap", config));
+        results.push_back(runBenchmark<IntLockFreeMap>("LockFreeBSTMap", config));
+        results.push_back(runBenchmark<IntBLinkMap>("BLinkTreeMap", config));
+        results.push_back(runBenchmark<LockedMap>("mutex+std::map", config));
+        std::cerr << std::setw(16) << config.name << ": " << std::setw(10) << static_cast<unsigned long long>(results[results.size() - 4].totalOps() / results[results.size() - 4].seconds)
+                  << " (lock-free " << std::setw(10) << static_cast<unsigned long long>(results[results.size() - 3].totalOps() / results[results.size() - 3].seconds)
+                  << ", B-link " << std::setw(10) << static_cast<unsigned long long>(results[results.size() - 2].totalOps() / results[results.size() - 2].seconds)
+                  << ") vs " << std::setw(10) << static_cast<unsigned long long>(results.back().totalOps() / results.back().seconds) << " ops/sec\n";
+        if (perfCounters)
+            for (std::size_t i = results.size() - 4; i < results.size(); ++i)
+            {
+                std::cerr << std::setw(18) << results[i].map << ": ";
+                printPerOp(std::cerr, results[i].totalCounters(), results[i].totalOps());
+                std::cerr << "\n";
+            }
+    }
+    if (format == "json")
+        printJSON(std::cout, results);
+    else
+        printCSV(std::cout, results);
+}
+
+// test18 (benchmark): fixed-duration throughput of the timeTest mixes on a
+// prefilled map, against std::map behind a mutex. takes optional arguments
+// [csv|json] [seconds per run] [prefill] [threads]; the results go to
+// stdout and everything else to stderr, so the output can be saved and
+// compared between builds. a "perf" argument anywhere (for any benchmark)
+// adds cycles, instructions, cache and branch misses and context switches
+// per operation
+void test18()
+{
+    std::cerr << "-------------- TEST18 -------------\n";
+
+    std::string format = testArgs.size() > 0 ? testArgs[0] : "csv";
+    double seconds = testArgs.size() > 1 ? std::atof(testArgs[1].c_str()) : 1.0;
+    unsigned prefill = testArgs.size() > 2 ? static_cast<unsigned>(std::atoi(testArgs[2].c_str())) : 100000;
+    int threads = testArgs.size() > 3 ? std::atoi(testArgs[3].c_str()) : numCores;
+
+    std::vector<BenchConfig> mixes
+    {
+        benchConfig("mixed", threads, seconds, prefill, 1, 1, 1),
+        benchConfig("put-heavy", threads, seconds, prefill, 8, 1, 1),
+        benchConfig("remove-heavy", threads, seconds, prefill, 1, 8, 1),
+        benchConfig("get-heavy", threads, seconds, prefill, 1, 1, 8)
+    };
+    runBenchmarks(mixes, format);
+}
+
+// test19 (stats): a mixed workload on a prefilled map, then the map's
+// counters. only counts anything in a CONCURRENTBST_STATS build (make
+// gcc0stats); checks that the counters add up with what the threads did
+void test19()
+{
+    std::cout << "-------------- TEST19 -------------\n";
+    if (!StatsEnabled)
+    {
+        std::cout << "Built without CONCURRENTBST_STATS; run \"make gcc0stats\" first\n";
+        return;
+    }
+    BenchConfig config = benchConfig("mixed", numCores, 0, 100000, 1, 1, 1);
+    config.opsPerThread = 200000;
+    IntBSTMap bst;
+    for (K k = 1; k <= config.workload.keyRange; k += 2)
+        bst.put(k, k);
+    bst.resetStats();
+    MapStats zero = bst.stats();
+
+    std::vector<unsigned long long> removed(numCores, 0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numCores; ++t)
+        threads.push_back( std::thread([&, t]()
+        {
+            OpGenerator gen(config.workload, t, numCores, 1);
+            for (unsigned i = 0; i < config.opsPerThread; ++i)
+            {
+                Operation op = gen.next();
+                switch (op.op)
+                {
+                    case Put: bst.put(op.elem.first, op.elem.second); break;
+                    case Remove: removed[t] += bst.remove(op.elem.first).has_value(); break;
+                    case Get: bst.get(op.elem.first); break;
+                }
+            }
+        }) );
+    for (std::thread& th : threads)
+        th.join();
+    MapStats stats = bst.stats();
+    std::cout << stats;
+
+    unsigned long long ops = stats.ops[StatGet] + stats.ops[StatPut] + stats.ops[StatRemove];
+    unsigned long long removes = std::accumulate(removed.begin(), removed.end(), 0ULL);
+    unsigned long long sampled = stats.latencySamples(StatGet) + stats.latencySamples(StatPut) + stats.latencySamples(StatRemove);
+    bool good = zero.ops[StatPut] == 0 && zero.lockAcquisitions == 0
+             && ops == static_cast<unsigned long long>(numCores) * config.opsPerThread
+             && stats.contendedLocks <= stats.lockAcquisitions
+             && stats.unlinked + stats.routed == removes
+             && sampled == ops / LatencySampleRate
+             && stats.depthSamples == sampled;
+    bst.resetStats();
+    good = good && bst.stats().ops[StatGet] == 0;
+    if (good)
+        std::cout << "\nAll good\n";
+    else
+        std::cout << "\nCounters don't add up\n";
+}
+// test20 (benchmark): test18's mixed workload under each key distribution,
+// same optional arguments. first shows how skewed each distribution is: the
+// share of a sample's operations that hit its most popular 1% of keys
+void test20()
+{
+    std::cerr << "-------------- TEST20 -------------\n";
+
+    std::string format = testArgs.size() > 0 ? testArgs[0] : "csv";
+    double seconds = testArgs.size() > 1 ? std::atof(testArgs[1].c_str()) : 1.0;
+    unsigned prefill = testArgs.size() > 2 ? static_cast<unsigned>(std::atoi(testArgs[2].c_str())) : 100000;
+    int threads = testArgs.size() > 3 ? std::atoi(testArgs[3].c_str()) : numCores;
+
+    const KeyDist dists[] = { KeyDist::Uniform, KeyDist::Zipf, KeyDist::HotSet, KeyDist::Sequential, KeyDist::ShiftingHotspot };
+    std::vector<BenchConfig> configs;
+    for (KeyDist dist : dists)
+    {
+        configs.push_back(benchConfig(distName(dist), threads, seconds, prefill, 1, 1, 1, dist));
+        const Workload& w = configs.back().workload;
+        std::vector<unsigned> hits(w.keyRange + 1, 0);
+        OpGenerator gen(w, 0, 1, 1);
+        const unsigned samples = 1000000;
+        for (unsigned i = 0; i < samples; ++i)
+            ++hits[gen.next().elem.first];
+        std::sort(hits.begin(), hits.end(), std::greater<unsigned>());
+        unsigned long long top = std::accumulate(hits.begin(), hits.begin() + std::max<K>(1, w.keyRange / 100), 0ULL);
+        std::cerr << std::setw(16) << distName(dist) << ": hottest 1% of keys get " << std::setprecision(3) << (100.0 * top / samples) << "% of operations\n";
+    }
+    runBenchmarks(configs, format);
+}
+
+// test21 (compaction): churn that removes mostly keys with two children
+// leaves routing nodes behind; they must be unlinked again once they're down
+// to one child, so they never make up half the tree
+void test21()
+{
+    std::cout << "-------------- TEST21 -------------\n";
+
+    const int numThreads = numCores;
+    const int numRounds = 6;
+    const int keyRange = 200000;
+
+    IntBSTMap bst;
+    bool ok = true;
+    for (int round = 0; round < numRounds; ++round)
+    {
+        // even rounds fill the map, odd rounds remove three keys in four
+        std::vector<std::thread> threads;
+        for (int t = 0; t < numThreads; ++t)
+            threads.push_back( std::thread([&bst, round, t, numThreads]()
+            {
+                std::mt19937 gen(round * numThreads + t);
+                std::uniform_int_distribution<K> dist(1, keyRange);
+                for (int i = 0; i < keyRange / numThreads; ++i)
+                {
+                    K k = dist(gen);
+                    if (round % 2 == 0)
+                        put(bst, k, k);
+                    else if (k % 4 != 0)
+                        remove(bst, k);
+                }
+            }) );
+        for (std::thread& th : threads)
+            th.join();
+        double ratio = bst.routingRatio();
+        std::cout << "Round " << round << (round % 2 == 0 ? " (put):    " : " (remove): ") << "routing nodes = "
+                  << std::fixed << std::setprecision(3) << ratio << " of the tree, height = " << bst.height() << "\n";
+        ok = ok && ratio <= 0.5;
+    }
+    std::cout << (ok ? "\nAll good\n" : "\nToo many routing nodes\n");
+}
+
+// test22 (bulk load): a map built from 10M sorted keys by bulkLoad, with
+// one thread and with all of them, against putting the same keys with
+// putAll; the bulk-loaded tree has to be perfectly balanced. then loads that
+// run out of memory partway have to pass the bad_alloc on and leave the map
+// empty, without leaking the nodes they had built
+void test22()
+{
+    std::cout << "-------------- TEST22 -------------\n";
+
+    typedef std::vector<std::pair<K,V> > Batch;
+    const int numThreads = numCores;
+    const int numKeys = 10000000;
+    const int batchSize = 4096;
+
+    Batch sorted;
+    sorted.reserve(numKeys);
+    for (int i = 1; i <= numKeys; ++i)
+        sorted.push_back( std::make_pair(i, -i) );
+    std::vector<Batch> batches;
+    for (int i = 0; i < numKeys; i += batchSize)
+        batches.push_back( Batch(sorted.begin() + i, sorted.begin() + std::min(numKeys, i + batchSize)) );
+    int optimal = static_cast<int>(std::ceil(std::log2(numKeys + 1.0)));
+
+    std::cout << numKeys << " sorted keys into an empty map\n";
+    bool ok = true;
+    long long loadTimes[2];
+    const unsigned loadThreads[] = { 1, static_cast<unsigned>(numThreads) };
+    for (int i = 0; i < 2; ++i)
+    {
+        IntBSTMap bst;
+        auto start = std::chrono::steady_clock::now();
+        ok = bst.bulkLoad(sorted.begin(), sorted.end(), loadThreads[i]) && ok;
+        loadTimes[i] = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        ok = ok && bst.height() == optimal && !bst.bulkLoad(sorted.begin(), sorted.begin() + 1);
+        if (i == 0)
+            continue;
+        // every key, in order, with its own value
+        K expected = 1;
+        bst.scan(std::numeric_limits<K>::min(), std::numeric_limits<K>::max(), [&](const K& k, const V& v)
+        {
+            ok = ok && k == expected && v == -k;
+            ++expected;
+        });
+        ok = ok && expected == numKeys + 1;
+    }
+
+    // the single-threaded load frees its nodes to this thread's slabs, so
+    // loading again once memory is back takes no more than a fresh map does
+    typedef CountingAllocator<std::pair<const K, V> > ByteCounter;
+    typedef ConcurrentBSTMap<K, V, std::less<K>, ByteCounter> CountedBSTMap;
+    const int failKeys = 200000;
+    const long failAfterBytes = 1 << 20;
+    long freshBytes = 0;
+    {
+        ByteCounter alloc;
+        CountedBSTMap fresh(std::less<K>(), alloc);
+        fresh.bulkLoad(sorted.begin(), sorted.begin() + failKeys, 1);
+        freshBytes = *alloc.live;
+    }
+    bool failedCleanly = true;
+    for (unsigned threads : { 1u, std::max(4u, static_cast<unsigned>(numThreads)) })
+    {
+        ByteCounter alloc;
+        CountedBSTMap bst(std::less<K>(), alloc);
+        *alloc.limit = *alloc.live + failAfterBytes;
+        bool threw = false;
+        try
+        {
+            bst.bulkLoad(sorted.begin(), sorted.begin() + failKeys, threads);
+        }
+        catch (const std::bad_alloc&)
+        {
+            threw = true;
+        }
+        *alloc.limit = std::numeric_limits<long>::max();
+        failedCleanly = failedCleanly && threw && bst.height() == 0 && bst.bulkLoad(sorted.begin(), sorted.begin() + failKeys, threads)
+                        && bst.size() == static_cast<std::size_t>(failKeys) && (threads > 1 || *alloc.live == freshBytes);
+    }
+    std::cout << failKeys << " keys loaded with " << failAfterBytes << " bytes to spare, then again with enough: "
+              << (failedCleanly ? "ok" : "wrong") << "\n";
+    ok = ok && failedCleanly;
+
+    IntBSTMap batched;
+    long long batchTime = timeBatches(batches, numThreads, [&batched](const Batch& batch) { batched.putAll(batch.begin(), batch.end()); });
+    std::cout << std::setw(33) << "1-threaded bulkLoad = " << std::setw(7) << loadTimes[0] << " microseconds\n"
+              << std::setw(33) << (std::to_string(numThreads) + "-threaded bulkLoad = ") << std::setw(7) << loadTimes[1] << " microseconds\n"
+              << std::setw(33) << (std::to_string(numThreads) + "-threaded putAll = ") << std::setw(7) << batchTime << " microseconds\n"
+              << std::setw(33) << "Tree height = " << std::setw(7) << optimal << " (perfectly balanced)\n";
+    if (!ok)
+        std::cout << "Wrong tree or contents after bulkLoad\n";
+    else
+        std::cout << "\nAll good\n";
+}
+
+// test23 (snapshots): a snapshot taken before numCores writers churn the
+// map has to keep showing exactly what was there, and snapshots taken while
+// they run have to agree with themselves (a scan and a get per key see the
+// same keys)
+void test23()
+{
+    std::cout << "-------------- TEST23 -------------\n";
+
+    const int numThreads = numCores;
+    const int keyRange = 200000;
+    const int numOps = 1000000;
+    const int numSnapshots = 100;
+
+    IntBSTMap bst;
+    std::map<K,V> tracker;
+    std::mt19937 gen(23);
+    for (int i = 0; i < keyRange / 2; ++i)
+    {
+        K k = 1 + gen() % keyRange;
+        put(bst, k, i);
+        tracker[k] = i;
+    }
+    bool ok = true;
+    auto start = std::chrono::steady_clock::now();
+    IntBSTMap::Snapshot before = bst.snapshot();
+    long long firstTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+    std::atomic<int> running(numThreads);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; ++t)
+        threads.push_back( std::thread([&bst, &running, t, numThreads]()
+        {
+            std::mt19937 gen(t);
+            for (int i = 0; i < numOps / numThreads; ++i)
+            {
+                K k = 1 + gen() % keyRange;
+                if (gen() % 2 == 0)
+                    put(bst, k, -k);
+                else
+                    remove(bst, k);
+            }
+            --running;
+        }) );
+    long long maxTime = 0;
+    int taken = 0;
+    while (running.load() > 0 && taken < numSnapshots)
+    {
+        start = std::chrono::steady_clock::now();
+        IntBSTMap::Snapshot during = bst.snapshot();
+        maxTime = std::max<long long>(maxTime, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+        ++taken;
+        std::size_t scanned = 0;
+        K prev = 0;
+        during.scan(1, keyRange + 1, [&](const K& k, const V& v)
+        {
+            (void)v;
+            ok = ok && k > prev;
+            prev = k;
+            ++scanned;
+        });
+        std::size_t found = 0;
+        for (K k = 1; k <= keyRange; k += 97)
+            found += during.get(k).has_value();
+        std::size_t expected = 0;
+        for (K k = 1; k <= keyRange; k += 97)
+        {
+            std::optional<IntBSTMap::Entry> c = during.ceiling(k);
+            expected += c && c->first == k;
+        }
+        ok = ok && found == expected && scanned >= found;
+    }
+    for (std::thread& th : threads)
+        th.join();
+
+    std::size_t scanned = 0;
+    before.scan(1, keyRange + 1, [&](const K& k, const V& v)
+    {
+        std::map<K,V>::const_iterator it = tracker.find(k);
+        ok = ok && it != tracker.end() && it->second == v;
+        ++scanned;
+    });
+    ok = ok && scanned == tracker.size();
+    for (const std::pair<const K,V>& elem : tracker)
+        ok = ok && before.get(elem.first) == elem.second;
+    std::cout << numThreads << " threads * " << numOps / numThreads << " put/remove over " << keyRange << " keys\n"
+              << std::setw(33) << "first snapshot = " << std::setw(7) << firstTime << " microseconds (" << tracker.size() << " keys)\n"
+              << std::setw(33) << "slowest of the rest = " << std::setw(7) << maxTime << " microseconds (" << taken << " snapshots)\n";
+    if (!ok)
+        std::cout << "A snapshot changed or disagreed with itself\n";
+    else
+        std::cout << "\nAll good\n";
+}
+
+// test24 (size): numCores threads fill, then empty, their own key ranges while
+// the main thread asks for the size. an exact size() has to fall between the
+// puts (then removes) that had finished before it started and the ones that
+// had started by the time it returned
+void test24()
+{
+    std::cout << "-------------- TEST24 -------------\n";
+
+    const int numThreads = numCores;
+    const int keysPerThread = 200000;
+
+    IntBSTMap bst;
+    std::vector<std::atomic<int> > started(numThreads);
+    std::vector<std::atomic<int> > finished(numThreads);
+    bool ok = bst.empty() && bst.approximateSize() == 0;
+    long long exactTime = 0;
+    long long approximateTime = 0;
+    int queries = 0;
+    for (int phase = 0; phase < 2; ++phase)
+    {
+        for (int t = 0; t < numThreads; ++t)
+        {
+            started[t].store(0);
+            finished[t].store(0);
+        }
+        std::atomic<int> running(numThreads);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < numThreads; ++t)
+            threads.push_back( std::thread([&bst, &started, &finished, &running, t, phase]()
+            {
+                for (int i = 0; i < keysPerThread; ++i)
+                {
+                    K k = 1 + t * keysPerThread + (i * 7919) % keysPerThread;
+                    started[t].store(i + 1);
+                    if (phase == 0)
+                        put(bst, k, k);
+                    else
+                        remove(bst, k);
+                    finished[t].store(i + 1);
+                }
+                --running;
+            }) );
+        while (running.load() > 0)
+        {
+            long long before = 0;
+            for (int t = 0; t < numThreads; ++t)
+                before += finished[t].load();
+            auto start = std::chrono::steady_clock::now();
+            long long size = static_cast<long long>(bst.size());
+            exactTime += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            long long after = 0;
+            for (int t = 0; t < numThreads; ++t)
+                after += started[t].load();
+            // removes count down from a full map
+            if (phase == 1)
+            {
+                long long full = static_cast<long long>(numThreads) * keysPerThread;
+                std::swap(before, after);
+                before = full - before;
+                after = full - after;
+            }
+            ok = ok && before <= size && size <= after;
+            start = std::chrono::steady_clock::now();
+            bst.approximateSize();
+            approximateTime += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            ++queries;
+            std::this_thread::yield();
+        }
+        for (std::thread& th : threads)
+            th.join();
+        std::size_t expected = phase == 0 ? static_cast<std::size_t>(numThreads) * keysPerThread : 0;
+        ok = ok && bst.size() == expected && bst.approximateSize() == expected;
+    }
+    ok = ok && bst.empty();
+    std::cout << numThreads << " threads * " << keysPerThread << " puts, then as many removes\n"
+              << std::setw(33) << "size() = " << std::setw(7) << (queries == 0 ? 0 : exactTime / queries) << " ns on average (" << queries << " calls)\n"
+              << std::setw(33) << "approximateSize() = " << std::setw(7) << (queries == 0 ? 0 : approximateTime / queries) << " ns on average\n";
+    if (!ok)
+        std::cout << "A size was out of bounds or wrong at the end\n";
+    else
+        std::cout << "\nAll good\n";
+}
+
+// test25 (image): save a map while numCores threads churn a separate key
+// range, map the file into a new map and read it from there, then write to
+// it, which loads the image into nodes
+void test25()
+{
+    std::cout << "-------------- TEST25 -------------\n";
+
+    const int numThreads = numCores;
+    const int numKeys = 1000000;
+    const char* path = "test25.img";
+
+    // even keys stay put, odd keys come and go
+    std::vector<std::pair<K,V> > sorted;
+    for (int i = 1; i <= numKeys; ++i)
+        sorted.push_back(std::make_pair(2 * i, 3 * i));
+    IntBSTMap bst(sorted.begin(), sorted.end());
+    std::atomic<bool> saving(true);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; ++t)
+        threads.push_back( std::thread([&bst, &saving, t]()
+        {
+            std::mt19937 gen(t);
+            while (saving.load())
+            {
+                K k = 1 + 2 * (gen() % numKeys);
+                if (gen() % 2 == 0)
+                    put(bst, k, k);
+                else
+                    remove(bst, k);
+            }
+        }) );
+    auto start = std::chrono::steady_clock::now();
+    bst.save(path);
+    long long saveTime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    saving = false;
+    for (std::thread& th : threads)
+        th.join();
+
+    IntBSTMap loaded;
+    start = std::chrono::steady_clock::now();
+    bool ok = loaded.load(path) && !loaded.load(path);
+    long long loadTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    // every even key from the image, and the odd keys that were there when
+    // it was saved, which add up to its size
+    std::size_t found = 0;
+    start = std::chrono::steady_clock::now();
+    for (int k = 1; k <= 2 * numKeys; ++k)
+    {
+        std::optional<V> got = loaded.get(k);
+        if (got)
+        {
+            ++found;
+            ok = ok && *got == (k % 2 == 0 ? 3 * k / 2 : k);
+        }
+        else
+            ok = ok && k % 2 == 1;
+    }
+    long long getTime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count() / (2 * numKeys);
+    std::size_t mappedSize = loaded.size();
+    ok = ok && found == mappedSize;
+    start = std::chrono::steady_clock::now();
+    ok = ok && !loaded.put(0, 0);
+    long long firstWriteTime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    ok = ok && loaded.remove(2) && loaded.size() == mappedSize;
+    K prev = -1;
+    std::size_t scanned = 0;
+    loaded.scan(0, 2 * numKeys + 1, [&](const K& k, const V& v)
+    {
+        (void)v;
+        ok = ok && k > prev;
+        prev = k;
+        ++scanned;
+    });
+    ok = ok && scanned == mappedSize && loaded.get(4) == 6;
+
+    // the header has to match the map's types
+    bool rejected = false;
+    try
+    {
+        ConcurrentBSTMap<int, long long> other;
+        other.load(path);
+    }
+    catch (const std::runtime_error&)
+    {
+        rejected = true;
+    }
+    ok = ok && rejected;
+    std::remove(path);
+
+    std::cout << numKeys << " keys kept, " << numThreads << " threads churning " << numKeys << " others\n"
+              << std::setw(33) << "save = " << std::setw(7) << saveTime << " ms (" << mappedSize << " keys)\n"
+              << std::setw(33) << "load = " << std::setw(7) << loadTime << " microseconds\n"
+              << std::setw(33) << "get from the mapping = " << std::setw(7) << getTime << " ns\n"
+              << std::setw(33) << "first write = " << std::setw(7) << firstWriteTime << " ms (loads every key into nodes)\n";
+    if (!ok)
+        std::cout << "The loaded map didn't match what was saved\n";
+    else
+        std::cout << "\nAll good\n";
+}
+
+// test26 (sharded): numCores threads put/remove their own keys in a map cut
+// into shards, then every single-key, batch and ordered operation is
+// checked against std::map, with ranges that cross shard boundaries and
+// shards left empty
+void test26()
+{
+    std::cout << "-------------- TEST26 -------------\n";
+
+    const int numThreads = numCores;
+    const int keyRange = 100000;
+    const int numOps = 400000;
+    const unsigned numShards = 8;
+
+    // shardOf has to agree with a plain search, for any number of splits
+    bool ok = true;
+    for (unsigned n = 1; n <= 9; ++n)
+    {
+        IntShardedMap routed(IntShardedMap::evenSplits(0, 1000, n));
+        std::vector<K> splits = IntShardedMap::evenSplits(0, 1000, n);
+        ok = ok && routed.shardCount() == n;
+        for (K k = -5; k < 1005; ++k)
+            ok = ok && routed.shardOf(k) == static_cast<unsigned>(std::upper_bound(splits.begin(), splits.end(), k) - splits.begin());
+    }
+
+    // the keys above keyRange / 2 go to the upper shards, which stay empty
+    IntShardedMap bst(IntShardedMap::evenSplits(1, 2 * keyRange + 1, numShards));
+    std::vector<std::map<K,V> > trackers(numThreads);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; ++t)
+        threads.push_back( std::thread([&bst, &trackers, t, numThreads]()
+        {
+            std::mt19937 gen(t);
+            for (int i = 0; i < numOps / numThreads; ++i)
+            {
+                K k = 1 + static_cast<K>(gen() % (keyRange / 2 / numThreads)) * numThreads + t;
+                if (gen() % 3 != 0)
+                {
+                    put(bst, k, i);
+                    trackers[t][k] = i;
+                }
+                else
+                {
+                    remove(bst, k);
+                    trackers[t].erase(k);
+                }
+            }
+        }) );
+    for (std::thread& th : threads)
+        th.join();
+    std::map<K,V> tracker;
+    for (const std::map<K,V>& mine : trackers)
+        tracker.insert(mine.begin(), mine.end());
+    ok = ok && checkElemsInBST(bst, tracker) && bst.size() == tracker.size() && bst.approximateSize() == tracker.size();
+
+    // ordered queries, from inside, between and beyond the shards
+    std::mt19937 gen(26);
+    for (int i = 0; i < 2000; ++i)
+    {
+        K k = static_cast<K>(gen() % (2 * keyRange + 10)) - 5;
+        std::map<K,V>::const_iterator ge = tracker.lower_bound(k);
+        std::map<K,V>::const_iterator gt = tracker.upper_bound(k);
+        std::optional<IntShardedMap::Entry> c = bst.ceiling(k), s = bst.successor(k), f = bst.floor(k);
+        ok = ok && (ge == tracker.end() ? !c : c == IntShardedMap::Entry(*ge));
+        ok = ok && (gt == tracker.end() ? !s : s == IntShardedMap::Entry(*gt));
+        ok = ok && (gt == tracker.begin() ? !f : f == IntShardedMap::Entry(*std::prev(gt)));
+        K hi = k + static_cast<K>(gen() % (keyRange / 2));
+        std::vector<K> scanned;
+        bst.scan(k, hi, [&scanned](const K& key, const V& v)
+        {
+            (void)v;
+            scanned.push_back(key);
+        });
+        std::vector<K> expected;
+        for (std::map<K,V>::const_iterator it = ge; it != tracker.end() && it->first < hi; ++it)
+            expected.push_back(it->first);
+        ok = ok && scanned == expected;
+        // a callback that keeps count has to be the same object in every
+        // shard, not a fresh copy of it
+        struct Counter
+        {
+            std::size_t seen;
+            void operator()(const K&, const V&) { ++seen; }
+        } counter = { 0 };
+        bst.scan(k, hi, counter);
+        ok = ok && counter.seen == expected.size();
+    }
+    ok = ok && bst.first() == IntShardedMap::Entry(*tracker.begin()) && bst.last() == IntShardedMap::Entry(*tracker.rbegin());
+
+    // a sorted batch across every shard, then its removal
+    std::vector<std::pair<K,V> > batch;
+    for (K k = 1; k <= 2 * keyRange; k += 7)
+        batch.push_back(std::make_pair(k, -k));
+    std::vector<std::optional<V> > putResults = bst.putAll(batch.begin(), batch.end());
+    for (std::size_t i = 0; i < batch.size(); ++i)
+    {
+        bool had = tracker.count(batch[i].first) != 0;
+        ok = ok && putResults[i].has_value() == had;
+        tracker[batch[i].first] = batch[i].second;
+    }
+    std::vector<K> removals;
+    for (const std::pair<K,V>& elem : batch)
+        removals.push_back(elem.first);
+    std::vector<std::optional<V> > removeResults = bst.removeAll(removals.begin(), removals.end());
+    for (std::size_t i = 0; i < removals.size(); ++i)
+    {
+        ok = ok && removeResults[i] == -removals[i];
+        tracker.erase(removals[i]);
+    }
+    ok = ok && checkElemsInBST(bst, tracker) && bst.size() == tracker.size();
+
+    // bulkLoad splits the range between the shards
+    IntShardedMap loaded(IntShardedMap::evenSplits(1, 2 * keyRange + 1, numShards));
+    ok = ok && loaded.bulkLoad(batch.begin(), batch.end()) && !loaded.bulkLoad(batch.begin(), batch.end());
+    std::size_t perShard = 0;
+    for (unsigned i = 0; i < loaded.shardCount(); ++i)
+        perShard = std::max(perShard, loaded.shardAt(i).size());
+    ok = ok && loaded.size() == batch.size() && perShard <= batch.size() / numShards + 1;
+    for (const std::pair<K,V>& elem : batch)
+        ok = ok && loaded.get(elem.first) == elem.second;
+    // one key in the last shard keeps every shard from being loaded
+    IntShardedMap partly(IntShardedMap::evenSplits(1, 2 * keyRange + 1, numShards));
+    partly.put(2 * keyRange, 0);
+    ok = ok && !partly.bulkLoad(batch.begin(), batch.end()) && partly.size() == 1;
+
+    std::cout << numThreads << " threads * " << numOps / numThreads << " put/remove over " << numShards << " shards, then queries, batches and bulkLoad\n";
+    if (!ok)
+        std::cout << "The sharded map disagreed with std::map\n";
+    else
+        std::cout << "\nAll good\n";
+}
+
+// test27 (benchmark): test18's mixed workload under every thread placement
+// policy (see topology.h), at 1 thread, one per core of a package, one per
+// core, and one per hardware thread. same optional arguments as test18, less
+// the thread count; a table goes to stderr and the results to stdout
+void test27()
+{
+    std::cerr << "-------------- TEST27 -------------\n";
+
+    std::string format = testArgs.size() > 0 ? testArgs[0] : "csv";
+    double seconds = testArgs.size() > 1 ? std::atof(testArgs[1].c_str()) : 1.0;
+    unsigned prefill = testArgs.size() > 2 ? static_cast<unsigned>(std::atoi(testArgs[2].c_str())) : 100000;
+
+    Topology topology = readTopology();
+    int cpus = static_cast<int>(topology.cpus.size());
+    std::cerr << cpus << " CPUs: " << topology.packages << " package(s), " << topology.nodes << " NUMA node(s), "
+              << topology.cores << " core(s), " << std::setprecision(3) << static_cast<double>(cpus) / topology.cores << " thread(s) per core\n";
+
+    std::vector<int> threadCounts = { 1, topology.cores / topology.packages, topology.cores, cpus };
+    std::sort(threadCounts.begin(), threadCounts.end());
+    threadCounts.erase(std::unique(threadCounts.begin(), threadCounts.end()), threadCounts.end());
+    const Placement placements[] = { Placement::Unpinned, Placement::Cores, Placement::Packed, Placement::Spread };
+
+    std::cerr << std::setw(8) << "threads";
+    for (Placement placement : placements)
+        std::cerr << std::setw(14) << placementName(placement);
+    std::cerr << "   (ops/sec)\n";
+    std::vector<BenchResult> results;
+    for (int threads : threadCounts)
+    {
+        std::cerr << std::setw(8) << threads;
+        for (Placement placement : placements)
+        {
+            BenchConfig config = benchConfig("mixed", threads, seconds, prefill, 1, 1, 1);
+            config.placement = placement;
+            config.cpus = placementOrder(topology, placement);
+            config.counters = perfCounters;
+            results.push_back(runBenchmark<IntBSTMap>("ConcurrentBSTMap", config));
+            std::cerr << std::setw(14) << static_cast<unsigned long long>(results.back().totalOps() / results.back().seconds) << std::flush;
+        }
+        std::cerr << "\n";
+    }
+    if (format == "json")
+        printJSON(std::cout, results);
+    else
+        printCSV(std::cout, results);
+}
+
+// test28 (lock-free): test5 and test6 on LockFreeBSTMap, then every thread
+// hammers its own keys out of a tiny shared range, so that removes keep
+// meeting half-finished removes of neighbouring keys and finishing them; each
+// thread checks its keys came out as it left them. then the locking and
+// lock-free trees against each other, with one thread per hardware thread
+// and with 8 times as many, when threads get preempted mid-operation
+void test28()
+{
+    std::cout << "-------------- TEST28 -------------\n";
+    correctnessTest<IntLockFreeMap>();
     std::cout << "\n";
-    timeTest(10000000 / 4, numCores * 2, 0.333, 0.333, 0.334);
+    stressTest<IntLockFreeMap>();
+
+    const int numThreads = numCores * 2;
+    const K keyRange = 256;
+    const int numOpsPerThread = 200000;
+    std::cout << "\n" << numThreads << " threads * " << numOpsPerThread << " ops/thread on their own keys among " << keyRange << "...\n";
+    IntLockFreeMap bst;
+    std::atomic<int> failures(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; ++t)
+        threads.push_back( std::thread([&, t]()
+        {
+            std::mt19937 gen(t);
+            std::vector<K> mine;
+            for (K k = t; k < keyRange; k += numThreads)
+                mine.push_back(k);
+            std::map<K,V> expected;
+            for (int i = 0; i < numOpsPerThread; ++i)
+            {
+                K k = mine[gen() % mine.size()];
+                std::map<K,V>::iterator it = expected.find(k);
+                std::optional<V> was, res;
+                if (it != expected.end())
+                    was = it->second;
+                if (gen() % 2 == 0)
+                {
+                    res = bst.put(k, i);
+                    expected[k] = i;
+                }
+                else
+                {
+                    res = bst.remove(k);
+                    expected.erase(k);
+                }
+                if (res != was)
+                    ++failures;
+            }
+            for (K k : mine)
+            {
+                std::map<K,V>::iterator it = expected.find(k);
+                std::optional<V> res = bst.get(k);
+                if (it == expected.end() ? res.has_value() : res != it->second)
+                    ++failures;
+            }
+        }) );
+    for (std::thread& th : threads)
+        th.join();
+    if (failures == 0)
+        std::cout << "Every put/remove returned what the key had\n";
+    else
+        std::cout << failures << " puts/removes returned the wrong old value\n";
+
     std::cout << "\n";
-    timeTest(10000000 / 8, numCores * 4, 0.333, 0.333, 0.334);
+    timeTest(1000000 / numCores, numCores, 0.333, 0.333, 0.334, KeyDist::Uniform, false, true);
     std::cout << "\n";
-    timeTest(10000000 / 16, numCores * 8, 0.333, 0.333, 0.334);
+    timeTest(1000000 / (numCores * 8), numCores * 8, 0.333, 0.333, 0.334, KeyDist::Uniform, false, true);
+    if (failures == 0)
+        std::cout << "\nAll good\n";
+}
+
+// test29 (read-modify-write): threads racing on the same keys with
+// fetchAdd, putIfAbsent, replace and compute, each checked against what the
+// threads did; none of it would add up with get followed by put. then one
+// thread counting with get + put vs fetchAdd, a descent each instead of two
+void test29()
+{
+    std::cout << "-------------- TEST29 -------------\n";
+
+    const int numThreads = numCores * 2;
+    const K numCounters = 1000;
+    const int rounds = 100;
+    const K firstClaim = 10000, numClaims = 10000;
+    const K firstSlot = 30000, numSlots = 100;
+    const int increments = 1000;
+    const K computed = 40000;
+    IntBSTMap bst;
+    std::vector<std::vector<K> > claimed(numThreads);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; ++t)
+        threads.push_back( std::thread([&, t]()
+        {
+            std::mt19937 gen(t);
+            for (int r = 0; r < rounds; ++r)
+                for (K k = 0; k < numCounters; ++k)
+                    bst.fetchAdd(k, 1);
+            for (K k = firstClaim; k < firstClaim + numClaims; ++k)
+                if (!bst.putIfAbsent(k, t))
+                    claimed[t].push_back(k);
+            for (int i = 0; i < increments; ++i)
+            {
+                K k = firstSlot + static_cast<K>(gen() % numSlots);
+                bst.putIfAbsent(k, 0);
+                V current = 0;
+                do
+                    current = *bst.get(k);
+                while (!bst.replace(k, current, current + 1));
+                bst.compute(computed, [](const std::optional<V>& c) -> std::optional<V> { return c.value_or(0) + 1; });
+            }
+        }) );
+    for (std::thread& th : threads)
+        th.join();
+
+    bool counters = true, claims = true;
+    for (K k = 0; k < numCounters; ++k)
+        counters = counters && bst.get(k) == numThreads * rounds;
+    std::size_t totalClaimed = 0;
+    for (int t = 0; t < numThreads; ++t)
+    {
+        totalClaimed += claimed[t].size();
+        for (K k : claimed[t])
+            claims = claims && bst.get(k) == t;
+    }
+    claims = claims && totalClaimed == static_cast<std::size_t>(numClaims);
+    long long slots = 0;
+    for (K k = firstSlot; k < firstSlot + numSlots; ++k)
+        slots += bst.get(k).value_or(0);
+    bool replaced = slots == static_cast<long long>(numThreads) * increments;
+    bool computes = bst.get(computed) == numThreads * increments
+                 && !bst.compute(-1, [](const std::optional<V>&) -> std::optional<V> { return std::nullopt; }) && !bst.get(-1);
+    std::cout << numThreads << " threads: fetchAdd counters " << (counters ? "add up" : "are off") << ", every putIfAbsent key "
+              << (claims ? "has exactly one winner" : "doesn't have exactly one winner") << ", replace loops " << (replaced ? "add up" : "are off")
+              << ", compute " << (computes ? "adds up" : "is off") << "\n";
+
+    const int numIncrements = 1000000;
+    IntBSTMap getPut, fetched;
+    auto start1 = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < numIncrements; ++i)
+    {
+        K k = i % numCounters;
+        getPut.put(k, getPut.get(k).value_or(0) + 1);
+    }
+    auto stop1 = std::chrono::high_resolution_clock::now();
+    auto start2 = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < numIncrements; ++i)
+        fetched.fetchAdd(i % numCounters, 1);
+    auto stop2 = std::chrono::high_resolution_clock::now();
+    auto duration1 = std::chrono::duration_cast<std::chrono::microseconds>(stop1 - start1);
+    auto duration2 = std::chrono::duration_cast<std::chrono::microseconds>(stop2 - start2);
+    std::cout << "\n" << numIncrements << " increments over " << numCounters << " keys, 1 thread:\n"
+              << std::setw(33) << "get + put = " << std::setw(7) << duration1.count() << " microseconds\n"
+              << std::setw(33) << "fetchAdd = " << std::setw(7) << duration2.count() << " microseconds\n";
+
+    if (counters && claims && replaced && computes && getPut.get(0) == fetched.get(0))
+        std::cout << "\nAll good\n";
+    else
+        std::cout << "\nRead-modify-writes don't add up\n";
+}
+
+// test30 (finger): each thread puts then gets its own keys in ascending
+// order, through the map and through a finger, while snapshots are taken
+// now and then; then a clustered stream of puts/removes/gets near the last
+// key, checked against a std::map per thread. a stats build also shows how
+// many levels the fingers saved
+void test30()
+{
+    std::cout << "-------------- TEST30 -------------\n";
+
+    const K keysPerThread = 200000;
+    const int numSnapshots = 10;
+    auto monotonic = [&](IntBSTMap& bst, bool fingers, std::vector<int>& wrong) -> long long
+    {
+        std::atomic<int> running(numCores);
+        std::vector<std::thread> threads;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int t = 0; t < numCores; ++t)
+            threads.push_back( std::thread([&, t]()
+            {
+                K first = t * keysPerThread;
+                if (fingers)
+                {
+                    IntBSTMap::Finger finger = bst.finger();
+                    for (K k = first; k < first + keysPerThread; ++k)
+                        wrong[t] += finger.put(k, k).has_value();
+                    for (K k = first; k < first + keysPerThread; ++k)
+                        wrong[t] += finger.get(k) != k;
+                }
+                else
+                {
+                    for (K k = first; k < first + keysPerThread; ++k)
+                        wrong[t] += bst.put(k, k).has_value();
+                    for (K k = first; k < first + keysPerThread; ++k)
+                        wrong[t] += bst.get(k) != k;
+                }
+                --running;
+            }) );
+        // a snapshot makes every finger start over from rootHolder
+        for (int i = 0; i < numSnapshots && running > 0; ++i)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            bst.snapshot();
+        }
+        for (std::thread& th : threads)
+            th.join();
+        auto stop = std::chrono::high_resolution_clock::now();
+        return std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+    };
+
+    IntBSTMap plain, fingered;
+    std::vector<int> wrongPlain(numCores, 0), wrongFinger(numCores, 0);
+    plain.resetStats();
+    long long plainTime = monotonic(plain, false, wrongPlain);
+    MapStats plainStats = plain.stats();
+    fingered.resetStats();
+    long long fingerTime = monotonic(fingered, true, wrongFinger);
+    MapStats fingerStats = fingered.stats();
+    std::cout << numCores << " threads put then get " << keysPerThread << " ascending keys each, " << numSnapshots << " snapshots along the way:\n"
+              << std::setw(33) << "map = " << std::setw(7) << plainTime << " microseconds\n"
+              << std::setw(33) << "finger = " << std::setw(7) << fingerTime << " microseconds\n";
+    if (StatsEnabled)
+        std::cout << "mean depth " << plainStats.meanDepth() << ", levels walked " << plainStats.meanSteps() << " through the map, "
+                  << fingerStats.meanSteps() << " through a finger\n";
+
+    // each thread wanders around its own range in small steps
+    const int clusteredOps = 200000;
+    std::vector<std::map<K,V> > trackers(numCores);
+    std::vector<int> wrongClustered(numCores, 0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numCores; ++t)
+        threads.push_back( std::thread([&, t]()
+        {
+            std::mt19937 gen(t);
+            K first = t * keysPerThread;
+            K k = first + keysPerThread / 2;
+            std::map<K,V>& tracker = trackers[t];
+            for (K j = first; j < first + keysPerThread; ++j)
+                tracker[j] = j;
+            IntBSTMap::Finger finger = fingered.finger();
+            for (int i = 0; i < clusteredOps; ++i)
+            {
+                k = std::min(first + keysPerThread - 1, std::max(first, k + static_cast<K>(gen() % 33) - 16));
+                std::map<K,V>::iterator it = tracker.find(k);
+                std::optional<V> expected;
+                if (it != tracker.end())
+                    expected = it->second;
+                std::optional<V> res;
+                switch (gen() % 3)
+                {
+                    case Put: res = finger.put(k, i); tracker[k] = i; break;
+                    case Remove: res = finger.remove(k); tracker.erase(k); break;
+                    case Get: res = finger.get(k); break;
+                }
+                wrongClustered[t] += res != expected;
+                if (i % 10000 == 0)
+                    finger.release();
+            }
+        }) );
+    for (std::thread& th : threads)
+        th.join();
+    int wrong = std::accumulate(wrongPlain.begin(), wrongPlain.end(), 0) + std::accumulate(wrongFinger.begin(), wrongFinger.end(), 0)
+              + std::accumulate(wrongClustered.begin(), wrongClustered.end(), 0);
+    bool same = true;
+    for (int t = 0; t < numCores; ++t)
+        for (K k = t * keysPerThread; k < (t + 1) * keysPerThread; ++k)
+        {
+            std::map<K,V>::iterator it = trackers[t].find(k);
+            same = same && (it == trackers[t].end() ? !fingered.get(k) : fingered.get(k) == it->second);
+        }
+    std::cout << numCores << " threads ran " << clusteredOps << " clustered puts/removes/gets each through a finger\n";
+
+    if (wrong == 0 && same)
+        std::cout << "\nAll good\n";
+    else
+        std::cout << "\n" << wrong << " operations returned the wrong value" << (same ? "" : ", and the map doesn't match") << "\n";
+}
+
+// test31 (B-link): test5 and test6 on BLinkTreeMap, then threads putting
+// interleaved ascending keys, so that every put lands in the last leaf and
+// the splits race each other up the right edge of the tree, and removing
+// every other key again. then a window of keys sliding up, whose emptied
+// leaves must be merged away so that memory stops growing, as in test13.
+// then random gets in 10M keys (or as many as the first argument says) on
+// ConcurrentBSTMap and BLinkTreeMap, with the cache misses per get where
+// perf_event_open can count them
+void test31()
+{
+    std::cout << "-------------- TEST31 -------------\n";
+    correctnessTest<IntBLinkMap>();
     std::cout << "\n";
+    stressTest<IntBLinkMap>();
+
+    const int numThreads = numCores * 2;
+    const K perThread = 200000;
+    std::cout << "\n" << numThreads << " threads put " << perThread << " interleaved ascending keys each, then remove every other one...\n";
+    IntBLinkMap edge;
+    std::atomic<int> failures(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; ++t)
+        threads.push_back( std::thread([&, t]()
+        {
+            for (K i = 0; i < perThread; ++i)
+                if (edge.put(i * numThreads + t, t))
+                    ++failures;
+            for (K i = 0; i < perThread; i += 2)
+                if (edge.remove(i * numThreads + t) != t)
+                    ++failures;
+            for (K i = 0; i < perThread; ++i)
+                if (edge.get(i * numThreads + t) != (i % 2 == 0 ? std::nullopt : std::optional<V>(t)))
+                    ++failures;
+        }) );
+    for (std::thread& th : threads)
+        th.join();
+    threads.clear();
+    std::cout << "B-link tree height = " << edge.height() << ", " << failures << " wrong results\n";
+
+    // a window of keys sliding up: the leaves it leaves behind empty out and
+    // have to be merged away, or memory grows with every round
+    const int numRounds = 10;
+    const K window = 100000 / numThreads;
+    const K perRound = 400000 / numThreads;
+    IntBLinkMap sliding;
+    std::vector<long> rss;
+    std::cout << "\n" << numThreads << " threads * " << numRounds << " rounds of " << perRound << " put/remove pairs/thread, "
+              << window << " keys behind each thread's latest...\n";
+    for (int round = 0; round < numRounds; ++round)
+    {
+        for (int t = 0; t < numThreads; ++t)
+            threads.push_back( std::thread([&, round, t]()
+            {
+                for (K i = round * perRound; i < (round + 1) * perRound; ++i)
+                {
+                    sliding.put(i * numThreads + t, t);
+                    if (i >= window && sliding.remove((i - window) * numThreads + t) != t)
+                        ++failures;
+                }
+                sliding.quiescent();
+            }) );
+        for (std::thread& th : threads)
+            th.join();
+        threads.clear();
+        rss.push_back(residentKB());
+        std::cout << "Round " << std::setw(2) << round << ": resident = " << std::setw(7) << rss.back() << " KB\n";
+    }
+    for (K i = 0; i < numRounds * perRound; i += 997)
+        if (sliding.get(i * numThreads) != (i >= numRounds * perRound - window ? std::optional<V>(0) : std::nullopt))
+            ++failures;
+    bool flat = rss.back() <= rss[numRounds / 2] + rss[numRounds / 2] / 10;
+    std::cout << "B-link tree height = " << sliding.height() << (flat ? "" : ", memory keeps growing") << "\n";
+
+    const K numKeys = testArgs.size() > 0 ? std::atoi(testArgs[0].c_str()) : 10000000;
+    const int getsPerThread = 2000000 / numCores;
+    std::vector<std::pair<K,V> > sorted;
+    sorted.reserve(numKeys);
+    for (K k = 1; k <= numKeys; ++k)
+        sorted.push_back( std::make_pair(k, -k) );
+    std::vector<std::vector<K> > keys(numCores);
+    for (int t = 0; t < numCores; ++t)
+    {
+        std::mt19937 gen(t);
+        std::uniform_int_distribution<K> key(1, numKeys);
+        for (int i = 0; i < getsPerThread; ++i)
+            keys[t].push_back(key(gen));
+    }
+    // every thread counts its own gets
+    auto timeGets = [&](auto& map, PerfCounts& counts) -> long long
+    {
+        std::mutex countsMutex;
+        std::vector<std::thread> getters;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int t = 0; t < numCores; ++t)
+            getters.push_back( std::thread([&, t]()
+            {
+                PerfCounters counters;
+                counters.start();
+                for (K k : keys[t])
+                    if (map.get(k) != -k)
+                        ++failures;
+                counters.stop();
+                std::lock_guard<std::mutex> lock(countsMutex);
+                if (t == 0)
+                    counts = counters.read();
+                else
+                    counts += counters.read();
+            }) );
+        for (std::thread& th : getters)
+            th.join();
+        auto stop = std::chrono::high_resolution_clock::now();
+        return std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+    };
+
+    PerfCounts bstCounts, blinkCounts;
+    long long bstTime = 0, blinkTime = 0;
+    unsigned blinkHeight = 0;
+    {
+        IntBSTMap bst;
+        bst.bulkLoad(sorted.begin(), sorted.end());
+        bstTime = timeGets(bst, bstCounts);
+    }
+    {
+        IntBLinkMap blink;
+        for (int t = 0; t < numCores; ++t)
+            threads.push_back( std::thread([&, t]()
+            {
+                for (K i = static_cast<K>(static_cast<long long>(numKeys) * t / numCores); i < static_cast<K>(static_cast<long long>(numKeys) * (t + 1) / numCores); ++i)
+                    blink.put(sorted[i].first, sorted[i].second);
+            }) );
+        for (std::thread& th : threads)
+            th.join();
+        blinkHeight = blink.height();
+        blinkTime = timeGets(blink, blinkCounts);
+    }
+    // splits leave every node at least half full
+    double leaves = std::max(1.0, static_cast<double>(numKeys) / (IntBLinkMap::Leaf::Capacity / 2));
+    unsigned maxHeight = 2 + static_cast<unsigned>(std::ceil(std::log(leaves) / std::log(IntBLinkMap::Inner::Capacity / 2 + 1.0)));
+    unsigned long long gets = static_cast<unsigned long long>(getsPerThread) * numCores;
+    std::cout << "\n" << gets << " random gets by " << numCores << " threads in " << numKeys << " keys:\n"
+              << std::setw(33) << "ConcurrentBSTMap = " << std::setw(7) << bstTime << " microseconds, ";
+    printPerOp(std::cout, bstCounts, gets);
+    std::cout << "\n" << std::setw(33) << "BLinkTreeMap = " << std::setw(7) << blinkTime << " microseconds, ";
+    printPerOp(std::cout, blinkCounts, gets);
+    std::cout << "\n" << std::setw(33) << "B-link tree height = " << std::setw(7) << blinkHeight << " (" << IntBLinkMap::Leaf::Capacity
+              << " keys to a leaf, " << (IntBLinkMap::Inner::Capacity + 1) << " children to an inner node)\n";
+
+    if (failures == 0 && blinkHeight <= maxHeight && flat)
+        std::cout << "\nAll good\n";
+    else
+        std::cout << "\n" << failures << " wrong results" << (blinkHeight <= maxHeight ? "" : ", and the B-link tree is too tall")
+                  << (flat ? "" : ", and memory kept growing") << "\n";
 }
 
+// test32 (multi-get): getAll against a loop of get. first threads getAll
+// batches of even and odd keys (only the even ones are in) while others put
+// and remove keys of their own, and a sharded map gets the same batches.
+// then random keys in 10M (or as many as the first argument says) looked up
+// in batches of 32 to 256, by getAll and by get, with the cache misses per
+// key where perf_event_open can count them
+void test32()
+{
+    std::cout << "-------------- TEST32 -------------\n";
+    const int numThreads = numCores * 2;
+    const K keyRange = 100000;
+    std::atomic<int> failures(0);
+    std::atomic<bool> stop(false);
+    IntBSTMap bst;
+    IntShardedMap shards(IntShardedMap::evenSplits(0, keyRange, 8));
+    for (K k = 0; k < keyRange; k += 2)
+    {
+        bst.put(k, -k);
+        shards.put(k, -k);
+    }
+    std::cout << numThreads << " threads getAll batches of up to 600 of " << keyRange << " keys while " << numThreads << " threads put and remove others...\n";
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; ++t)
+        threads.push_back( std::thread([&, t]()
+        {
+            // keys past keyRange are never looked up
+            std::mt19937 gen(t);
+            std::uniform_int_distribution<K> key(keyRange, keyRange * 2);
+            while (!stop)
+            {
+                K k = key(gen);
+                bst.put(k, k);
+                bst.remove(key(gen));
+            }
+        }) );
+    std::vector<std::thread> getters;
+    for (int t = 0; t < numThreads; ++t)
+        getters.push_back( std::thread([&, t]()
+        {
+            std::mt19937 gen(t + numThreads);
+            std::uniform_int_distribution<K> key(0, keyRange - 1);
+            std::uniform_int_distribution<int> size(0, 600);
+            for (int round = 0; round < 200; ++round)
+            {
+                std::vector<K> batch(size(gen));
+                for (K& k : batch)
+                    k = key(gen);
+                std::vector<std::optional<V> > got = bst.getAll(batch.begin(), batch.end());
+                std::vector<std::optional<V> > sharded = shards.getAll(batch.begin(), batch.end());
+                if (got.size() != batch.size() || sharded.size() != batch.size())
+                    ++failures;
+                else
+                    for (std::size_t i = 0; i < batch.size(); ++i)
+                    {
+                        std::optional<V> expected = batch[i] % 2 == 0 ? std::optional<V>(-batch[i]) : std::nullopt;
+                        if (got[i] != expected || sharded[i] != expected)
+                            ++failures;
+                    }
+            }
+        }) );
+    for (std::thread& th : getters)
+        th.join();
+    stop = true;
+    for (std::thread& th : threads)
+        th.join();
+    threads.clear();
+    std::cout << failures << " wrong results\n";
 
-void (*pTests[])() = { test0, test1, test2, test3, test4, test5, test6, test7, test8, test9, test10, test11 };
+    const K numKeys = testArgs.size() > 0 ? std::atoi(testArgs[0].c_str()) : 10000000;
+    const int keysPerThread = 2000000 / numCores;
+    std::vector<std::pair<K,V> > sorted;
+    sorted.reserve(numKeys);
+    for (K k = 1; k <= numKeys; ++k)
+        sorted.push_back( std::make_pair(k, -k) );
+    IntBSTMap big;
+    big.bulkLoad(sorted.begin(), sorted.end());
+    sorted.clear();
+    sorted.shrink_to_fit();
+    std::vector<std::vector<K> > keys(numCores);
+    for (int t = 0; t < numCores; ++t)
+    {
+        std::mt19937 gen(t);
+        std::uniform_int_distribution<K> key(1, numKeys);
+        for (int i = 0; i < keysPerThread; ++i)
+            keys[t].push_back(key(gen));
+    }
+    // every thread counts its own lookups
+    auto timeBatches = [&](std::size_t batchSize, bool interleaved, PerfCounts& counts) -> long long
+    {
+        std::mutex countsMutex;
+        std::vector<std::thread> getters;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int t = 0; t < numCores; ++t)
+            getters.push_back( std::thread([&, t]()
+            {
+                PerfCounters counters;
+                counters.start();
+                for (std::size_t b = 0; b < keys[t].size(); b += batchSize)
+                {
+                    std::vector<K>::iterator first = keys[t].begin() + b;
+                    std::vector<K>::iterator last = keys[t].begin() + std::min(keys[t].size(), b + batchSize);
+                    if (interleaved)
+                    {
+                        std::vector<std::optional<V> > got = big.getAll(first, last);
+                        for (std::size_t i = 0; i < got.size(); ++i)
+                            if (got[i] != -first[i])
+                                ++failures;
+                    }
+                    else
+                        for (std::vector<K>::iterator k = first; k != last; ++k)
+                            if (big.get(*k) != -*k)
+                                ++failures;
+                }
+                counters.stop();
+                std::lock_guard<std::mutex> lock(countsMutex);
+                if (t == 0)
+                    counts = counters.read();
+                else
+                    counts += counters.read();
+            }) );
+        for (std::thread& th : getters)
+            th.join();
+        auto stop = std::chrono::high_resolution_clock::now();
+        return std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+    };
+
+    unsigned long long lookups = static_cast<unsigned long long>(keysPerThread) * numCores;
+    std::cout << "\n" << lookups << " random lookups by " << numCores << " threads in " << numKeys << " keys:\n";
+    for (std::size_t batchSize : { 32, 64, 128, 256 })
+    {
+        PerfCounts loopCounts, batchCounts;
+        long long loopTime = timeBatches(batchSize, false, loopCounts);
+        long long batchTime = timeBatches(batchSize, true, batchCounts);
+        std::cout << std::setw(33) << (std::to_string(batchSize) + " keys, get in a loop = ") << std::setw(7) << loopTime << " microseconds, ";
+        printPerOp(std::cout, loopCounts, lookups);
+        std::cout << "\n" << std::setw(33) << (std::to_string(batchSize) + " keys, getAll = ") << std::setw(7) << batchTime << " microseconds, ";
+        printPerOp(std::cout, batchCounts, lookups);
+        std::cout << "\n";
+    }
+
+    if (failures == 0)
+        std::cout << "\nAll good\n";
+    else
+        std::cout << "\n" << failures << " wrong results\n";
+}
+
+void (*pTests[])() = { test0, test1, test2, test3, test4, test5, test6, test7, test8, test9, test10, test11, test12, test13, test14, test15, test16, test17, test18, test19, test20, test21, test22, test23, test24, test25, test26, test27, test28, test29, test30, test31, test32 };
 
 int main(int argc, char** argv)
 {
@@ -357,19 +2206,68 @@ int main(int argc, char** argv)
                 << "-------------------------------------------------- THE REAL TESTS(TM) --------------------------------------------------\n"
                 << "5:  (correctness) " << numCores << " threads perform put, remove, get to check for correctness (no contention for same nodes)\n"
                 << "6:       (stress) " << numCores << " threads perform put, remove, get to check for deadlocks or infinite loops (contention for same nodes)\n"
-                << "7:  (performance) " << numCores << "-threaded concurrent BST vs single-threaded std::map with operation frequencies (1, 1, 1)\n"
-                << "8:  (performance) " << numCores << "-threaded concurrent BST vs single-threaded std::map with operation frequencies (8, 1, 1)\n"
-                << "9:  (performance) " << numCores << "-threaded concurrent BST vs single-threaded std::map with operation frequencies (1, 8, 1)\n"
-                << "10: (performance) " << numCores << "-threaded concurrent BST vs single-threaded std::map with operation frequencies (1, 1, 8)\n"
+                << "7:  (performance) " << numCores << "-threaded concurrent BST and B-link tree vs single-threaded std::map with operation frequencies (1, 1, 1)\n"
+                << "8:  (performance) " << numCores << "-threaded concurrent BST and B-link tree vs single-threaded std::map with operation frequencies (8, 1, 1)\n"
+                << "9:  (performance) " << numCores << "-threaded concurrent BST and B-link tree vs single-threaded std::map with operation frequencies (1, 8, 1)\n"
+                << "10: (performance) " << numCores << "-threaded concurrent BST and B-link tree vs single-threaded std::map with operation frequencies (1, 1, 8)\n"
                 << "---------------------------------------- FINDING THE SWEET SPOT (HUGE AND SLOW) ----------------------------------------\n"
                 << "11: (performance) " << (numCores / 2) << "-, " << numCores << "-, " << (numCores * 2) << "-, " << (numCores * 4) << "-, and " << (numCores * 8)
-                << "-threaded concurrent BST vs single-threaded std::map with operation frequencies (1, 1, 1)\n";
-    if (argc != 2)
+                << "-threaded concurrent BST (single, sharded, lock-free and B-link) vs single-threaded std::map with operation frequencies (1, 1, 1)\n"
+                << "----------------------------------------------------- BALANCING -----------------------------------------------------\n"
+                << "12: (performance) " << numCores << " threads put 1M keys in ascending order, then get them; check the tree height stays O(log n)\n"
+                << "---------------------------------------------------- RECLAMATION ----------------------------------------------------\n"
+                << "13:      (memory) " << numCores << " threads churn remove/put over 100K keys for 10 rounds, check that memory stays flat\n"
+                << "------------------------------------------------------- TYPES -------------------------------------------------------\n"
+                << "14:       (small) map with 64-bit keys, struct values, a custom comparator and allocator; store INT_MIN as a value\n"
+                << "15:      (memory) " << numCores << " threads put 1M keys into a slab-allocated map, check bytes per entry and that clear() frees everything\n"
+                << "----------------------------------------------------- ORDERED ------------------------------------------------------\n"
+                << "16: (correctness) floor/ceiling/successor/first/last/scan against std::map, then scans racing with " << numCores << " writers\n"
+                << "17: (performance) " << numCores << " threads put/remove 1M keys in sorted batches with putAll/removeAll vs one key at a time\n"
+                << "----------------------------------------------------- BENCHMARK -----------------------------------------------------\n"
+                << "18:   (benchmark) " << numCores << " threads, 1s per (put, remove, get) mix on 100K prefilled keys, locking, lock-free and B-link, vs mutex+std::map;\n"
+                << "                  \"18 [csv|json] [seconds] [prefill] [threads]\" to change these, results go to stdout;\n"
+                << "                  add \"perf\" (to any benchmark) for hardware counters per operation from perf_event_open\n"
+                << "------------------------------------------------------- STATS -------------------------------------------------------\n"
+                << "19:       (stats) " << numCores << " threads run 200K mixed ops each, print the map's counters and check they add up (make gcc0stats)\n"
+                << "20:   (benchmark) like 18 with (1, 1, 1), under uniform, zipf, hot-set, sequential and shifting-hotspot keys; same arguments\n"
+                << "---------------------------------------------------- COMPACTION ----------------------------------------------------\n"
+                << "21: (correctness) " << numCores << " threads alternate filling 200K keys and removing most of them; check routing nodes stay under half the tree\n"
+                << "----------------------------------------------------- BULK LOAD -----------------------------------------------------\n"
+                << "22: (performance) bulkLoad 10M sorted keys with 1 and " << numCores << " threads vs putAll; check the tree is perfectly balanced\n"
+                << "----------------------------------------------------- SNAPSHOTS -----------------------------------------------------\n"
+                << "23: (correctness) snapshots stay exactly as they were taken while " << numCores << " threads put/remove 1M keys\n"
+                << "-------------------------------------------------------- SIZE -------------------------------------------------------\n"
+                << "24: (correctness) size() stays between the writes before and after it while " << numCores << " threads fill and empty the map\n"
+                << "------------------------------------------------------- IMAGE -------------------------------------------------------\n"
+                << "25: (correctness) save 1M keys while " << numCores << " threads change others, then map the file back in and write to it\n"
+                << "------------------------------------------------------ SHARDED ------------------------------------------------------\n"
+                << "26: (correctness) " << numCores << " threads put/remove in a map split into 8 shards; check lookups, ranges, batches across shards\n"
+                << "----------------------------------------------------- PLACEMENT -----------------------------------------------------\n"
+                << "27:   (benchmark) test18's mixed workload with threads unpinned, one per core, SMT siblings packed, spread over NUMA nodes\n"
+                << "----------------------------------------------------- LOCK-FREE -----------------------------------------------------\n"
+                << "28: (correctness) 5 and 6 on the lock-free map, " << (numCores * 2) << " threads racing on 256 keys; then vs the locking map at "
+                << numCores << " and " << (numCores * 8) << " threads\n"
+                << "------------------------------------------------- READ-MODIFY-WRITE -------------------------------------------------\n"
+                << "29: (correctness) " << (numCores * 2) << " threads race fetchAdd, putIfAbsent, replace, compute on shared keys; then fetchAdd vs get + put\n"
+                << "------------------------------------------------------ FINGER -------------------------------------------------------\n"
+                << "30: (performance) " << numCores << " threads put/get ascending keys through the map vs a finger, snapshots in between; then clustered keys\n"
+                << "---------------------------------------------------- B-LINK TREE ----------------------------------------------------\n"
+                << "31: (correctness) 5 and 6 on the B-link tree, " << (numCores * 2) << " threads splitting its right edge, a sliding window merging leaves; then gets in 10M keys vs the BST\n"
+                << "----------------------------------------------------- MULTI-GET -----------------------------------------------------\n"
+                << "32: (performance) getAll vs get under concurrent writers and on shards; then batches of 32-256 random keys in 10M keys\n";
+    if (argc < 2)
     {
         std::cout << description.str() << std::endl;
         return 1;
     }
     int testNum = std::atoi(argv[1]);
+    testArgs.assign(argv + 2, argv + argc);
+    std::vector<std::string>::iterator perf = std::find(testArgs.begin(), testArgs.end(), "perf");
+    if (perf != testArgs.end())
+    {
+        perfCounters = true;
+        testArgs.erase(perf);
+    }
     pTests[testNum]();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,113 @@
+#include "epoch.h"
+
+EpochManager::EpochManager(Deleter deleter, void* context)
+    : deleter(deleter), context(context), globalEpoch(0), records()
+{}
+
+EpochManager::~EpochManager()
+{
+    reclaimAll();
+}
+
+void EpochManager::enter()
+{
+    Record& record = records.local();
+    if (record.nesting++ > 0)
+        return;
+    unsigned long e = globalEpoch.load(std::memory_order_relaxed);
+    while (true)
+    {
+        record.state.store((e << 1) | Active, std::memory_order_relaxed);
+        // the announcement must be visible before we read any shared pointer
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // the epoch may have moved on (more than once) between reading and
+        // announcing it; announcing a stale epoch would protect nothing
+        unsigned long current = globalEpoch.load(std::memory_order_relaxed);
+        if (current == e)
+            break;
+        e = current;
+    }
+}
+
+void EpochManager::exit()
+{
+    Record& record = records.local();
+    if (--record.nesting > 0)
+        return;
+    record.state.store(record.state.load(std::memory_order_relaxed) & ~Active, std::memory_order_release);
+}
+
+void EpochManager::retire(void* p)
+{
+    Record& record = records.local();
+    Retired r = { p, globalEpoch.load(std::memory_order_acquire) };
+    record.retired.push_back(r);
+    record.pendingCount.store(record.retired.size(), std::memory_order_relaxed);
+    if (++record.retiredSinceScan >= ReclaimThreshold)
+    {
+        record.retiredSinceScan = 0;
+        tryAdvance();
+        reclaim(record);
+    }
+}
+
+void EpochManager::quiescent()
+{
+    Record& record = records.local();
+    if (record.nesting > 0)
+        return;
+    // two advances are needed before anything retired right now is freeable
+    tryAdvance();
+    tryAdvance();
+    reclaim(record);
+}
+
+void EpochManager::reclaimAll()
+{
+    records.forEach([this](Record& record)
+    {
+        for (const Retired& r : record.retired)
+            deleter(context, r.p);
+        record.retired.clear();
+        record.retiredSinceScan = 0;
+        record.pendingCount.store(0, std::memory_order_relaxed);
+    });
+}
+
+std::size_t EpochManager::pending()
+{
+    std::size_t total = 0;
+    records.forEach([&total](Record& record)
+    {
+        total += record.pendingCount.load(std::memory_order_relaxed);
+    });
+    return total;
+}
+
+// moves the global epoch forward if every active thread has caught up with it
+bool EpochManager::tryAdvance()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    unsigned long e = globalEpoch.load(std::memory_order_acquire);
+    bool caughtUp = true;
+    records.forEach([e, &caughtUp](Record& record)
+    {
+        unsigned long s = record.state.load(std::memory_order_acquire);
+        if ((s & Active) && (s >> 1) != e)
+            caughtUp = false;
+    });
+    return caughtUp && globalEpoch.compare_exchange_strong(e, e + 1, std::memory_order_acq_rel);
+}
+
+void EpochManager::reclaim(Record& record)
+{
+    unsigned long e = globalEpoch.load(std::memory_order_acquire);
+    std::vector<Retired>::iterator it = record.retired.begin();
+    while (it != record.retired.end() && it->epoch + 2 <= e)
+    {
+        deleter(context, it->p);
+        ++it;
+    }
+    record.retired.erase(record.retired.begin(), it);
+    record.pendingCount.store(record.retired.size(), std::memory_order_relaxed);
+}
@@ -0,0 +1,89 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+#include "threadregistry.h"
+
+// epoch-based memory reclamation (Fraser, 2004)
+//
+// threads announce the global epoch when they enter a critical section. the
+// global epoch only advances when every thread inside a critical section has
+// announced the current one, so something retired in epoch e can't be
+// reachable by anybody once the global epoch reaches e + 2
+class EpochManager
+{
+public:
+    typedef void (*Deleter)(void* context, void* p);
+
+    EpochManager(Deleter deleter, void* context);
+    // frees everything that is still waiting; nobody may be in a critical section
+    ~EpochManager();
+
+    // critical sections nest; only the outermost enter/exit pair counts
+    void enter();
+    void exit();
+
+    // p has been unlinked and will be handed to the deleter once no
+    // critical section can still be looking at it
+    void retire(void* p);
+
+    // tells the manager the calling thread holds no references right now (it
+    // must not be in a critical section), and reclaims what it can
+    void quiescent();
+
+    // frees everything that is still waiting right away; nobody may be in a
+    // critical section
+    void reclaimAll();
+
+    // number of retired pointers not yet freed (approximate while other
+    // threads are retiring)
+    std::size_t pending();
+
+    class Guard
+    {
+    public:
+        explicit Guard(EpochManager& manager) : manager(manager) { manager.enter(); }
+        ~Guard() { manager.exit(); }
+    private:
+        Guard(const Guard& rhs);
+        Guard& operator=(const Guard& rhs);
+        EpochManager& manager;
+    };
+
+private:
+    struct Retired
+    {
+        void* p;
+        unsigned long epoch;
+    };
+    struct Record
+    {
+        Record() : state(0), nesting(0), retiredSinceScan(0), retired(), pendingCount(0) {}
+        // (epoch << 1) | Active, written by the owner and read by everyone
+        std::atomic<unsigned long> state;
+        unsigned nesting;
+        unsigned retiredSinceScan;
+        // oldest first; epochs never decrease along the list
+        std::vector<Retired> retired;
+        std::atomic<std::size_t> pendingCount;
+    };
+
+    bool tryAdvance();
+    void reclaim(Record& record);
+
+    EpochManager(const EpochManager& rhs);
+    EpochManager& operator=(const EpochManager& rhs);
+
+    Deleter deleter;
+    void* context;
+    alignas(CacheLineSize) std::atomic<unsigned long> globalEpoch;
+    PerThread<Record> records;
+};
+
+const unsigned long Active = 0x1UL;
+// how many retires a thread does between attempts to advance the epoch
+const unsigned ReclaimThreshold = 64;
+
+#endif
@@ -0,0 +1,38 @@
+#include "gate.h"
+#include <thread>
+
+WriterGate::WriterGate()
+    : closing(), closed(false), slots()
+{}
+
+void WriterGate::close()
+{
+    closing.lock();
+    closed.store(true, std::memory_order_relaxed);
+    // a writer either sees closed or has announced itself by now
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    slots.forEach([](Slot& slot)
+    {
+        while (slot.inside.load(std::memory_order_acquire))
+            std::this_thread::yield();
+    });
+}
+
+void WriterGate::open()
+{
+    closed.store(false, std::memory_order_release);
+    closing.unlock();
+}
+
+// steps back out so that close() can finish, and tries again once it's open
+void WriterGate::waitUntilOpen(Slot& slot)
+{
+    do
+    {
+        slot.inside.store(false, std::memory_order_release);
+        while (closed.load(std::memory_order_acquire))
+            std::this_thread::yield();
+        slot.inside.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    } while (closed.load(std::memory_order_acquire));
+}
@@ -0,0 +1,70 @@
+#ifndef GATE_H
+#define GATE_H
+
+#include <atomic>
+#include <mutex>
+#include "threadregistry.h"
+
+// lets any number of writers through at once until somebody closes it:
+// close() waits for the writers already inside to leave and keeps new ones
+// out until open(). a writer pays a store, a fence and a load on the way in
+// (the same handshake EpochManager::enter does with the global epoch);
+// closing is meant to be rare and short
+class WriterGate
+{
+    // one per writer thread
+    struct Slot
+    {
+        Slot() : inside(false) {}
+        std::atomic<bool> inside;
+    };
+
+public:
+    WriterGate();
+
+    // once close() returns, everything the writers did is visible to the
+    // caller and nobody gets in before open(). one thread at a time closes
+    // the gate; a writer must not close it
+    void close();
+    void open();
+
+    // a writer's pass through the gate; writers don't nest
+    class Guard
+    {
+    public:
+        explicit Guard(WriterGate& gate) : slot(gate.enter()) {}
+        ~Guard();
+    private:
+        Guard(const Guard& rhs);
+        Guard& operator=(const Guard& rhs);
+        Slot& slot;
+    };
+
+private:
+    Slot& enter()
+    {
+        Slot& slot = slots.local();
+        slot.inside.store(true, std::memory_order_relaxed);
+        // the announcement must be visible before we look at closed
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (closed.load(std::memory_order_acquire))
+            waitUntilOpen(slot);
+        return slot;
+    }
+
+    void waitUntilOpen(Slot& slot);
+
+    WriterGate(const WriterGate& rhs);
+    WriterGate& operator=(const WriterGate& rhs);
+
+    std::mutex closing;
+    std::atomic<bool> closed;
+    PerThread<Slot> slots;
+};
+
+inline WriterGate::Guard::~Guard()
+{
+    slot.inside.store(false, std::memory_order_release);
+}
+
+#endif
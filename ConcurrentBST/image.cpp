@@ -0,0 +1,140 @@
+#include "image.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static_assert(sizeof(ImageHeader) == ImageAlignment, "ImageHeader has to fill exactly the space before the first entry");
+
+static const char ImageMagic[8] = { 'C', 'B', 'S', 'T', 'I', 'M', 'G', '\0' };
+static const std::uint32_t ImageByteOrder = 0x01020304;
+// how much ImageWriter collects before it writes
+static const std::size_t ImageWriteBuffer = 1 << 20;
+
+static std::string imageError(const std::string& path, const char* what)
+{
+    return "ConcurrentBSTMap image " + path + ": " + what;
+}
+
+ImageWriter::ImageWriter(const std::string& path, std::size_t keySize, std::size_t valueSize, std::size_t entrySize)
+    : path(path), tmpPath(path + ".tmp"), fd(-1), header(), buffer(ImageWriteBuffer), used(0)
+{
+    std::memcpy(header.magic, ImageMagic, sizeof(ImageMagic));
+    header.version = ImageVersion;
+    header.byteOrder = ImageByteOrder;
+    header.keySize = static_cast<std::uint32_t>(keySize);
+    header.valueSize = static_cast<std::uint32_t>(valueSize);
+    header.entrySize = static_cast<std::uint32_t>(entrySize);
+    if (entrySize == 0 || entrySize > buffer.size())
+        throw std::runtime_error(imageError(path, "entries must be between 1 byte and 1MB"));
+    fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throw std::runtime_error(imageError(tmpPath, std::strerror(errno)));
+    // the header goes in last, once the count is known
+    used = sizeof(header);
+    std::memset(buffer.data(), 0, used);
+}
+
+ImageWriter::~ImageWriter()
+{
+    if (fd >= 0)
+    {
+        ::close(fd);
+        std::remove(tmpPath.c_str());
+    }
+}
+
+void ImageWriter::append(const void* entry)
+{
+    if (used + header.entrySize > buffer.size())
+        flush();
+    std::memcpy(buffer.data() + used, entry, header.entrySize);
+    used += header.entrySize;
+    ++header.count;
+}
+
+void ImageWriter::commit()
+{
+    flush();
+    if (::pwrite(fd, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header)))
+        fail("can't write the header");
+    if (::fsync(fd) != 0)
+        fail(std::strerror(errno));
+    int closed = ::close(fd);
+    fd = -1;
+    if (closed != 0 || std::rename(tmpPath.c_str(), path.c_str()) != 0)
+    {
+        std::string error = imageError(path, std::strerror(errno));
+        std::remove(tmpPath.c_str());
+        throw std::runtime_error(error);
+    }
+}
+
+void ImageWriter::flush()
+{
+    const char* p = buffer.data();
+    while (used > 0)
+    {
+        ssize_t written = ::write(fd, p, used);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            fail(std::strerror(errno));
+        p += written;
+        used -= static_cast<std::size_t>(written);
+    }
+}
+
+void ImageWriter::fail(const char* what)
+{
+    throw std::runtime_error(imageError(tmpPath, what));
+}
+
+ImageFile::ImageFile(const std::string& path, std::size_t keySize, std::size_t valueSize, std::size_t entrySize)
+    : base(nullptr), bytes(0)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error(imageError(path, std::strerror(errno)));
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(ImageHeader)))
+    {
+        ::close(fd);
+        throw std::runtime_error(imageError(path, "not an image (too short)"));
+    }
+    bytes = static_cast<std::size_t>(st.st_size);
+    base = ::mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+    // the mapping keeps the file open
+    ::close(fd);
+    if (base == MAP_FAILED)
+    {
+        base = nullptr;
+        throw std::runtime_error(imageError(path, std::strerror(errno)));
+    }
+    const ImageHeader& h = header();
+    const char* problem = nullptr;
+    if (std::memcmp(h.magic, ImageMagic, sizeof(ImageMagic)) != 0)
+        problem = "not an image";
+    else if (h.version != ImageVersion)
+        problem = "unsupported version";
+    else if (h.byteOrder != ImageByteOrder)
+        problem = "saved on a machine with a different byte order";
+    else if (h.keySize != keySize || h.valueSize != valueSize || h.entrySize != entrySize)
+        problem = "saved from a map with different key or value types";
+    else if (h.count != (bytes - sizeof(ImageHeader)) / entrySize || (bytes - sizeof(ImageHeader)) % entrySize != 0)
+        problem = "truncated or corrupt";
+    if (problem != nullptr)
+    {
+        ::munmap(base, bytes);
+        throw std::runtime_error(imageError(path, problem));
+    }
+}
+
+ImageFile::~ImageFile()
+{
+    ::munmap(base, bytes);
+}
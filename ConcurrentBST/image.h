@@ -0,0 +1,82 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// the on-disk image of a map: a header, then the entries in key order as an
+// array of fixed-size records with no pointers in them, so that a mapping
+// of the file can be searched as it is. the header records the record
+// layout; nothing else about the key and value types is checked, and the
+// file is only readable on a machine with the same byte order
+const std::uint32_t ImageVersion = 1;
+// the header's size, and the alignment of the first entry
+const std::size_t ImageAlignment = 64;
+
+struct ImageHeader
+{
+    char magic[8];
+    std::uint32_t version;
+    // ImageByteOrder as the saving machine stores it
+    std::uint32_t byteOrder;
+    std::uint32_t keySize;
+    std::uint32_t valueSize;
+    std::uint32_t entrySize;
+    std::uint32_t reserved;
+    std::uint64_t count;
+    char padding[ImageAlignment - 40];
+};
+
+// writes an image front to back, so entries can be streamed in as they are
+// found. everything goes to a temporary file next to path that replaces path
+// only once commit() has flushed it to disk; a writer destroyed before that
+// removes it. throws std::runtime_error if a write fails
+class ImageWriter
+{
+public:
+    ImageWriter(const std::string& path, std::size_t keySize, std::size_t valueSize, std::size_t entrySize);
+    ~ImageWriter();
+
+    void append(const void* entry);
+    void commit();
+
+private:
+    ImageWriter(const ImageWriter& rhs);
+    ImageWriter& operator=(const ImageWriter& rhs);
+
+    void flush();
+    void fail(const char* what);
+
+    std::string path;
+    std::string tmpPath;
+    int fd;
+    ImageHeader header;
+    std::vector<char> buffer;
+    std::size_t used;
+};
+
+// a read-only mapping of an image. the constructor checks the header against
+// the record layout the caller expects, and the file's size against the
+// header, and throws std::runtime_error if anything doesn't match
+class ImageFile
+{
+public:
+    ImageFile(const std::string& path, std::size_t keySize, std::size_t valueSize, std::size_t entrySize);
+    ~ImageFile();
+
+    std::uint64_t count() const { return header().count; }
+    const void* entries() const { return static_cast<const char*>(base) + ImageAlignment; }
+
+private:
+    ImageFile(const ImageFile& rhs);
+    ImageFile& operator=(const ImageFile& rhs);
+
+    const ImageHeader& header() const { return *static_cast<const ImageHeader*>(base); }
+
+    void* base;
+    std::size_t bytes;
+};
+
+#endif
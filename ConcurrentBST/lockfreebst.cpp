@@ -0,0 +1,3 @@
+#include "lockfreebst.h"
+
+template class LockFreeBSTMap<int, int>;
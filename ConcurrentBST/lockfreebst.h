@@ -0,0 +1,391 @@
+#ifndef LOCKFREEBST_H
+#define LOCKFREEBST_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "epoch.h"
+#include "slab.h"
+
+// the low bits of a child link, which nodes' alignment leaves free. a
+// flagged link leads to a leaf that is being removed; a tagged link belongs
+// to a node that is being removed, and leads to the subtree that takes its
+// place. neither link changes again once it's marked
+const std::uintptr_t EdgeFlag = 0x1;
+const std::uintptr_t EdgeTag = 0x2;
+const std::uintptr_t EdgeMarks = EdgeFlag | EdgeTag;
+
+// a node of the lock-free tree. keys and values live in the leaves; internal
+// nodes only route, and always have two children. nothing but the links
+// ever changes: a put on a key that is already there swaps in a new leaf.
+// the three sentinels have keys above every real key (infinity 1 < 2 < 3),
+// so the tree never runs out of nodes to hang the real ones from
+template <typename K, typename V>
+struct alignas(SlabSizeClass) LockFreeNode
+{
+    std::atomic<std::uintptr_t> left;
+    std::atomic<std::uintptr_t> right;
+    const K key;
+    const int infinity;
+    const V value;
+
+    LockFreeNode(const K& k, const V& v, int inf, LockFreeNode* l, LockFreeNode* r)
+        : left(reinterpret_cast<std::uintptr_t>(l)), right(reinterpret_cast<std::uintptr_t>(r)), key(k), infinity(inf), value(v) {}
+
+    static LockFreeNode* address(std::uintptr_t edge) { return reinterpret_cast<LockFreeNode*>(edge & ~EdgeMarks); }
+    bool isLeaf() const { return left.load(std::memory_order_relaxed) == 0; }
+};
+
+// an unbalanced external BST that takes no locks (Natarajan and Mittal,
+// "Fast Concurrent Lock-Free Binary Search Trees", 2014), with the same
+// get/put/remove as ConcurrentBSTMap. a put adds a leaf and its parent with
+// one CAS; a remove flags the link to its leaf with one CAS, which is when
+// the key is gone, and then unlinks the leaf and its parent with another.
+// whoever finds a removal half done finishes it, so a thread stalled
+// anywhere (preempted, say) holds nobody up. unlinked nodes are reclaimed by
+// epochs, like ConcurrentBSTMap's
+//
+// the tree isn't rebalanced, so it's only as good as its keys are random:
+// keys in sorted order make it a list. no ordered queries, batches or
+// snapshots either
+template <typename K, typename V, typename Compare = std::less<K>, typename Alloc = std::allocator<std::pair<const K, V> > >
+class LockFreeBSTMap
+{
+public:
+    typedef LockFreeNode<K, V>* NodePtr;
+
+    explicit LockFreeBSTMap(const Compare& comp = Compare(), const Alloc& alloc = Alloc());
+    ~LockFreeBSTMap();
+
+    // put and remove return the value the key had, if it had one
+    std::optional<V> get(const K& k);
+    std::optional<V> put(const K& k, const V& v);
+    std::optional<V> remove(const K& k);
+    // as ConcurrentBSTMap::quiescent and ::clear
+    void quiescent();
+    void clear();
+
+private:
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<char> RegionAlloc;
+    typedef std::allocator_traits<RegionAlloc> RegionAllocTraits;
+
+    // where a seek for a key ends: the leaf it reaches and its parent, and
+    // the last link on the way that wasn't tagged (from ancestor to
+    // successor); a cleanup swings that link past everything below it that
+    // is being removed
+    struct SeekRecord
+    {
+        NodePtr ancestor;
+        NodePtr successor;
+        NodePtr parent;
+        NodePtr leaf;
+    };
+
+    void seek(const K& k, SeekRecord& record);
+    bool cleanup(const K& k, const SeekRecord& record);
+    void retireExcised(const K& k, NodePtr successor, NodePtr parent, NodePtr kept);
+    // does k belong in node's left subtree, is leaf k's leaf
+    bool goesLeft(const K& k, NodePtr node) const;
+    bool matches(const K& k, NodePtr leaf) const;
+    std::atomic<std::uintptr_t>& edge(NodePtr node, const K& k) { return goesLeft(k, node) ? node->left : node->right; }
+    static std::uintptr_t link(NodePtr node) { return reinterpret_cast<std::uintptr_t>(node); }
+
+    NodePtr newNode(const K& k, const V& v, int infinity, NodePtr l, NodePtr r);
+    void destroyNode(NodePtr node);
+    void makeSentinels();
+    void destroyTree();
+    static void deleteNode(void* context, void* p);
+    static void* allocateRegion(void* context, std::size_t bytes);
+    static void deallocateRegion(void* context, void* p, std::size_t bytes);
+    LockFreeBSTMap(const LockFreeBSTMap& rhs);
+    LockFreeBSTMap& operator=(const LockFreeBSTMap& rhs);
+
+    Compare comp;
+    RegionAlloc regionAlloc;
+    SlabPool nodePool;
+    // the sentinel with infinity 3; its left child, the one with infinity 2,
+    // is never removed and holds every real key in its left subtree
+    NodePtr root;
+    EpochManager epoch;
+};
+
+template <typename K, typename V, typename Compare, typename Alloc>
+LockFreeBSTMap<K, V, Compare, Alloc>::LockFreeBSTMap(const Compare& comp, const Alloc& alloc)
+    : comp(comp), regionAlloc(alloc), nodePool(sizeof(LockFreeNode<K, V>), allocateRegion, deallocateRegion, this),
+      root(nullptr), epoch(deleteNode, this)
+{
+    makeSentinels();
+}
+
+// as in ConcurrentBSTMap, retired nodes go first, with epoch, and the memory
+// with nodePool after it
+template <typename K, typename V, typename Compare, typename Alloc>
+LockFreeBSTMap<K, V, Compare, Alloc>::~LockFreeBSTMap()
+{
+    destroyTree();
+}
+
+// a flagged link means the leaf is already gone, even if it's still there
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<V> LockFreeBSTMap<K, V, Compare, Alloc>::get(const K& k)
+{
+    EpochManager::Guard guard(epoch);
+    std::uintptr_t childLink = edge(root, k).load(std::memory_order_acquire);
+    NodePtr node = LockFreeNode<K, V>::address(childLink);
+    while (!node->isLeaf())
+    {
+        childLink = edge(node, k).load(std::memory_order_acquire);
+        node = LockFreeNode<K, V>::address(childLink);
+    }
+    if ((childLink & EdgeFlag) == 0 && matches(k, node))
+        return node->value;
+    return std::nullopt;
+}
+
+// a new key comes with a new internal node, the larger of the two keys,
+// that takes the place of the leaf the seek ended on; a key that is there
+// already gets a new leaf in the old one's place. either way the link must
+// still be unmarked for the CAS to succeed, and a marked one is cleaned up
+// before trying again
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<V> LockFreeBSTMap<K, V, Compare, Alloc>::put(const K& k, const V& v)
+{
+    EpochManager::Guard guard(epoch);
+    NodePtr fresh = newNode(k, v, 0, nullptr, nullptr);
+    while (true)
+    {
+        SeekRecord record;
+        seek(k, record);
+        NodePtr leaf = record.leaf;
+        std::atomic<std::uintptr_t>& parentEdge = edge(record.parent, k);
+        std::uintptr_t expected = link(leaf);
+        if (matches(k, leaf))
+        {
+            if (parentEdge.compare_exchange_strong(expected, link(fresh), std::memory_order_acq_rel, std::memory_order_acquire))
+            {
+                V old = leaf->value;
+                epoch.retire(leaf);
+                return old;
+            }
+        }
+        else
+        {
+            NodePtr internal = goesLeft(k, leaf) ? newNode(leaf->key, V(), leaf->infinity, fresh, leaf)
+                                                 : newNode(k, V(), 0, leaf, fresh);
+            if (parentEdge.compare_exchange_strong(expected, link(internal), std::memory_order_acq_rel, std::memory_order_acquire))
+                return std::nullopt;
+            destroyNode(internal);
+        }
+        if (LockFreeNode<K, V>::address(expected) == leaf && (expected & EdgeMarks) != 0)
+            cleanup(k, record);
+    }
+}
+
+// injection flags the link to the leaf, and from then on the key is gone;
+// cleanup unlinks it. if another thread's cleanup beats ours to it, the
+// next seek no longer finds the leaf
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<V> LockFreeBSTMap<K, V, Compare, Alloc>::remove(const K& k)
+{
+    EpochManager::Guard guard(epoch);
+    NodePtr leaf = nullptr;
+    while (true)
+    {
+        SeekRecord record;
+        seek(k, record);
+        if (leaf == nullptr)
+        {
+            if (!matches(k, record.leaf))
+                return std::nullopt;
+            std::atomic<std::uintptr_t>& parentEdge = edge(record.parent, k);
+            std::uintptr_t expected = link(record.leaf);
+            if (parentEdge.compare_exchange_strong(expected, link(record.leaf) | EdgeFlag, std::memory_order_acq_rel, std::memory_order_acquire))
+            {
+                leaf = record.leaf;
+                if (cleanup(k, record))
+                    return leaf->value;
+            }
+            else if (LockFreeNode<K, V>::address(expected) == record.leaf && (expected & EdgeMarks) != 0)
+                cleanup(k, record);
+        }
+        else if (record.leaf != leaf || cleanup(k, record))
+            return leaf->value;
+    }
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+void LockFreeBSTMap<K, V, Compare, Alloc>::quiescent()
+{
+    epoch.quiescent();
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+void LockFreeBSTMap<K, V, Compare, Alloc>::clear()
+{
+    epoch.reclaimAll();
+    destroyTree();
+    nodePool.release();
+    makeSentinels();
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+void LockFreeBSTMap<K, V, Compare, Alloc>::seek(const K& k, SeekRecord& record)
+{
+    NodePtr top = LockFreeNode<K, V>::address(root->left.load(std::memory_order_relaxed));
+    record.ancestor = root;
+    record.successor = top;
+    record.parent = top;
+    std::uintptr_t parentLink = top->left.load(std::memory_order_acquire);
+    record.leaf = LockFreeNode<K, V>::address(parentLink);
+    std::uintptr_t currentLink = edge(record.leaf, k).load(std::memory_order_acquire);
+    NodePtr current = LockFreeNode<K, V>::address(currentLink);
+    while (current != nullptr)
+    {
+        if ((parentLink & EdgeTag) == 0)
+        {
+            record.ancestor = record.parent;
+            record.successor = record.leaf;
+        }
+        record.parent = record.leaf;
+        record.leaf = current;
+        parentLink = currentLink;
+        currentLink = edge(current, k).load(std::memory_order_acquire);
+        current = LockFreeNode<K, V>::address(currentLink);
+    }
+}
+
+// the flagged leaf under the record's parent (k's own, or its sibling, if
+// this is helping somebody else's remove) goes, and the other child takes
+// the parent's place: the link to it is tagged so that it can't change,
+// then the ancestor's link is swung from the successor to it in one CAS,
+// which drops everything in between. false if somebody else changed that
+// link first
+template <typename K, typename V, typename Compare, typename Alloc>
+bool LockFreeBSTMap<K, V, Compare, Alloc>::cleanup(const K& k, const SeekRecord& record)
+{
+    NodePtr parent = record.parent;
+    std::atomic<std::uintptr_t>* child = &parent->left;
+    std::atomic<std::uintptr_t>* sibling = &parent->right;
+    if (!goesLeft(k, parent))
+        std::swap(child, sibling);
+    if ((child->load(std::memory_order_acquire) & EdgeFlag) == 0)
+        sibling = child;
+    // a flag on the kept link stays, so that its own remove carries on
+    // from the new place
+    std::uintptr_t kept = sibling->fetch_or(EdgeTag, std::memory_order_acq_rel) & ~EdgeTag;
+    std::uintptr_t expected = link(record.successor);
+    if (!edge(record.ancestor, k).compare_exchange_strong(expected, kept, std::memory_order_acq_rel, std::memory_order_acquire))
+        return false;
+    retireExcised(k, record.successor, parent, LockFreeNode<K, V>::address(kept));
+    return true;
+}
+
+// the successful cleanup owns what it cut out: the nodes from successor down
+// to parent along k's path, and the flagged leaf hanging off each of them.
+// every link in there is marked, so none of them changes under us
+template <typename K, typename V, typename Compare, typename Alloc>
+void LockFreeBSTMap<K, V, Compare, Alloc>::retireExcised(const K& k, NodePtr successor, NodePtr parent, NodePtr kept)
+{
+    NodePtr node = successor;
+    while (true)
+    {
+        NodePtr l = LockFreeNode<K, V>::address(node->left.load(std::memory_order_acquire));
+        NodePtr r = LockFreeNode<K, V>::address(node->right.load(std::memory_order_acquire));
+        epoch.retire(node);
+        if (node == parent)
+        {
+            epoch.retire(l == kept ? r : l);
+            return;
+        }
+        bool left = goesLeft(k, node);
+        epoch.retire(left ? r : l);
+        node = left ? l : r;
+    }
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+inline bool LockFreeBSTMap<K, V, Compare, Alloc>::goesLeft(const K& k, NodePtr node) const
+{
+    return node->infinity != 0 || comp(k, node->key);
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+inline bool LockFreeBSTMap<K, V, Compare, Alloc>::matches(const K& k, NodePtr leaf) const
+{
+    return leaf->infinity == 0 && !comp(k, leaf->key) && !comp(leaf->key, k);
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+typename LockFreeBSTMap<K, V, Compare, Alloc>::NodePtr LockFreeBSTMap<K, V, Compare, Alloc>::newNode(const K& k, const V& v, int infinity, NodePtr l, NodePtr r)
+{
+    return ::new (nodePool.allocate()) LockFreeNode<K, V>(k, v, infinity, l, r);
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+void LockFreeBSTMap<K, V, Compare, Alloc>::destroyNode(NodePtr node)
+{
+    node->~LockFreeNode();
+    nodePool.deallocate(node);
+}
+
+// root (infinity 3) has top (2) on its left and a leaf 3 on its right; top
+// has leaves 1 and 2. real keys all go to the left of both
+template <typename K, typename V, typename Compare, typename Alloc>
+void LockFreeBSTMap<K, V, Compare, Alloc>::makeSentinels()
+{
+    NodePtr top = newNode(K(), V(), 2, newNode(K(), V(), 1, nullptr, nullptr), newNode(K(), V(), 2, nullptr, nullptr));
+    root = newNode(K(), V(), 3, top, newNode(K(), V(), 3, nullptr, nullptr));
+}
+
+// runs the destructors of the nodes still in the tree, if they have any;
+// the memory goes back with the pool
+template <typename K, typename V, typename Compare, typename Alloc>
+void LockFreeBSTMap<K, V, Compare, Alloc>::destroyTree()
+{
+    if (!std::is_trivially_destructible<LockFreeNode<K, V> >::value && root != nullptr)
+    {
+        std::vector<NodePtr> stack(1, root);
+        while (!stack.empty())
+        {
+            NodePtr node = stack.back();
+            stack.pop_back();
+            if (!node->isLeaf())
+            {
+                stack.push_back(LockFreeNode<K, V>::address(node->left.load(std::memory_order_relaxed)));
+                stack.push_back(LockFreeNode<K, V>::address(node->right.load(std::memory_order_relaxed)));
+            }
+            destroyNode(node);
+        }
+    }
+    root = nullptr;
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+void LockFreeBSTMap<K, V, Compare, Alloc>::deleteNode(void* context, void* p)
+{
+    static_cast<LockFreeBSTMap*>(context)->destroyNode(static_cast<NodePtr>(p));
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+void* LockFreeBSTMap<K, V, Compare, Alloc>::allocateRegion(void* context, std::size_t bytes)
+{
+    LockFreeBSTMap* map = static_cast<LockFreeBSTMap*>(context);
+    return RegionAllocTraits::allocate(map->regionAlloc, bytes);
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+void LockFreeBSTMap<K, V, Compare, Alloc>::deallocateRegion(void* context, void* p, std::size_t bytes)
+{
+    LockFreeBSTMap* map = static_cast<LockFreeBSTMap*>(context);
+    RegionAllocTraits::deallocate(map->regionAlloc, static_cast<char*>(p), bytes);
+}
+
+// the int/int map is compiled once, in lockfreebst.cpp
+extern template class LockFreeBSTMap<int, int>;
+
+#endif
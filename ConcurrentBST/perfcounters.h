@@ -0,0 +1,179 @@
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+#include <cstdint>
+#include <cstring>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// the hardware (and one software) events a benchmark thread counts
+enum PerfEvent { PerfCycles, PerfInstructions, PerfL1DMisses, PerfLLCMisses, PerfBranchMisses, PerfContextSwitches, NumPerfEvents };
+
+const char* perfEventName(int event)
+{
+    static const char* names[NumPerfEvents] = { "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses", "context_switches" };
+    return names[event];
+}
+
+// counts for some threads; -1 for an event that couldn't be counted
+struct PerfCounts
+{
+    PerfCounts()
+    {
+        for (int e = 0; e < NumPerfEvents; ++e)
+            values[e] = -1;
+    }
+
+    bool counted(int event) const { return values[event] >= 0; }
+
+    bool any() const
+    {
+        for (int e = 0; e < NumPerfEvents; ++e)
+            if (counted(e))
+                return true;
+        return false;
+    }
+
+    // an event only adds up if every thread counted it
+    PerfCounts& operator+=(const PerfCounts& rhs)
+    {
+        for (int e = 0; e < NumPerfEvents; ++e)
+            values[e] = counted(e) && rhs.counted(e) ? values[e] + rhs.values[e] : -1;
+        return *this;
+    }
+
+    long long values[NumPerfEvents];
+};
+
+// the calling thread's counters, user and kernel time if the kernel allows
+// it and user time only otherwise (perf_event_paranoid 2). opening them
+// takes a few system calls, so do it before the timed region and only
+// start() and stop() around it. counters the kernel won't give us (no PMU
+// in a VM, perf_event_open blocked by seccomp in a container, ...) read as
+// -1; context switches then come from getrusage instead. a counter must be
+// started, stopped and read on the thread that opened it
+class PerfCounters
+{
+public:
+    PerfCounters()
+    {
+        for (int e = 0; e < NumPerfEvents; ++e)
+            fds[e] = open(e);
+        switchesAtStart = -1;
+        switchesAtStop = -1;
+    }
+
+    ~PerfCounters()
+    {
+#ifdef __linux__
+        for (int e = 0; e < NumPerfEvents; ++e)
+            if (fds[e] >= 0)
+                ::close(fds[e]);
+#endif
+    }
+
+    void start()
+    {
+#ifdef __linux__
+        switchesAtStart = rusageSwitches();
+        for (int e = 0; e < NumPerfEvents; ++e)
+            if (fds[e] >= 0)
+            {
+                ioctl(fds[e], PERF_EVENT_IOC_RESET, 0);
+                ioctl(fds[e], PERF_EVENT_IOC_ENABLE, 0);
+            }
+#endif
+    }
+
+    void stop()
+    {
+#ifdef __linux__
+        for (int e = 0; e < NumPerfEvents; ++e)
+            if (fds[e] >= 0)
+                ioctl(fds[e], PERF_EVENT_IOC_DISABLE, 0);
+        switchesAtStop = rusageSwitches();
+#endif
+    }
+
+    // the counts between start() and stop(), scaled up where the kernel had
+    // to multiplex more events than the PMU has counters
+    PerfCounts read() const
+    {
+        PerfCounts counts;
+#ifdef __linux__
+        for (int e = 0; e < NumPerfEvents; ++e)
+        {
+            // value, time enabled, time running
+            std::uint64_t data[3];
+            if (fds[e] < 0 || ::read(fds[e], data, sizeof(data)) != static_cast<ssize_t>(sizeof(data)))
+                continue;
+            if (data[2] == 0)
+                counts.values[e] = data[1] == 0 ? 0 : -1;
+            else
+                counts.values[e] = static_cast<long long>(static_cast<double>(data[0]) * data[1] / data[2]);
+        }
+        if (!counts.counted(PerfContextSwitches) && switchesAtStart >= 0 && switchesAtStop >= 0)
+            counts.values[PerfContextSwitches] = switchesAtStop - switchesAtStart;
+#endif
+        return counts;
+    }
+
+private:
+    PerfCounters(const PerfCounters& rhs);
+    PerfCounters& operator=(const PerfCounters& rhs);
+
+#ifdef __linux__
+    static int open(int event)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.disabled = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        switch (event)
+        {
+            case PerfCycles: attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+            case PerfInstructions: attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+            case PerfL1DMisses:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+                break;
+            case PerfLLCMisses: attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_CACHE_MISSES; break;
+            case PerfBranchMisses: attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+            case PerfContextSwitches: attr.type = PERF_TYPE_SOFTWARE; attr.config = PERF_COUNT_SW_CONTEXT_SWITCHES; break;
+        }
+        // this thread, on whichever CPU it runs
+        int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        // a context switch happens in the kernel, so user time only would
+        // always count 0 of them
+        if (fd < 0 && event != PerfContextSwitches)
+        {
+            attr.exclude_kernel = 1;
+            fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        }
+        return fd;
+    }
+
+    static long long rusageSwitches()
+    {
+        rusage usage;
+        if (getrusage(RUSAGE_THREAD, &usage) != 0)
+            return -1;
+        return usage.ru_nvcsw + usage.ru_nivcsw;
+    }
+#else
+    static int open(int) { return -1; }
+#endif
+
+    int fds[NumPerfEvents];
+    long long switchesAtStart;
+    long long switchesAtStop;
+};
+
+#endif
@@ -0,0 +1,368 @@
+#ifndef SHARDEDBST_H
+#define SHARDEDBST_H
+
+#include <algorithm>
+#include <cassert>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "concurrentbst.h"
+
+// the key space cut into ranges at fixed split keys, each range kept in a
+// ConcurrentBSTMap of its own. every map has its own rootHolder, epochs and
+// slab chunks, so operations on different shards share no cache lines at
+// all, where in one big map every descent passes through the same few nodes
+// at the top. shard i holds the keys in [splits[i-1], splits[i]); the first
+// and last shards are open-ended. a key finds its shard in log2(shards)
+// comparisons with no branches on their outcome, however big the map
+//
+// single-key operations, batches and ordered queries behave as they do on
+// one map; size() adds up exact per-shard sizes, each taken at a different
+// instant. snapshots and images aren't offered, since neither would be of
+// the whole map at one instant
+template <typename K, typename V, typename Compare = std::less<K>, typename Alloc = std::allocator<std::pair<const K, V> > >
+class ShardedBSTMap
+{
+public:
+    typedef ConcurrentBSTMap<K, V, Compare, Alloc> Shard;
+    typedef typename Shard::Entry Entry;
+
+    // splits must be strictly ascending; there is one more shard than splits
+    explicit ShardedBSTMap(const std::vector<K>& splits, const Compare& comp = Compare(), const Alloc& alloc = Alloc());
+
+    // a power of two no smaller than the number of threads that will use the
+    // map, so that threads working on random keys seldom meet in the same
+    // shard; defaultShards() assumes one thread per hardware thread
+    static unsigned shardsFor(unsigned threads);
+    static unsigned defaultShards() { return shardsFor(std::thread::hardware_concurrency()); }
+    // splits that cut [lo, hi) into shards ranges of (nearly) equal width,
+    // for arithmetic keys
+    static std::vector<K> evenSplits(const K& lo, const K& hi, unsigned shards = defaultShards());
+
+    std::optional<V> get(const K& k) { return shard(k).get(k); }
+    std::optional<V> put(const K& k, const V& v) { return shard(k).put(k, v); }
+    std::optional<V> remove(const K& k) { return shard(k).remove(k); }
+    std::optional<V> putIfAbsent(const K& k, const V& v) { return shard(k).putIfAbsent(k, v); }
+    bool replace(const K& k, const V& expected, const V& desired) { return shard(k).replace(k, expected, desired); }
+    template <typename Fn>
+    std::optional<V> compute(const K& k, Fn fn) { return shard(k).compute(k, fn); }
+    V fetchAdd(const K& k, const V& delta) { return shard(k).fetchAdd(k, delta); }
+    // the batch is handed to each shard as the run of consecutive keys that
+    // belong to it, so sorted input keeps the sharing putAll/removeAll do
+    template <typename RandomIt>
+    std::vector<std::optional<V> > putAll(RandomIt first, RandomIt last);
+    template <typename RandomIt>
+    std::vector<std::optional<V> > removeAll(RandomIt first, RandomIt last);
+    // keys in any order; each shard gets the keys that belong to it as one
+    // batch
+    template <typename RandomIt>
+    std::vector<std::optional<V> > getAll(RandomIt first, RandomIt last);
+    // sorted input, as for ConcurrentBSTMap::bulkLoad; each shard's tree is
+    // built from its part of the range in turn, with all the threads, and the
+    // trees are linked in together. returns false, and leaves the map as it
+    // was, if any shard had nodes in it by then; if building a tree throws,
+    // the trees built so far are freed before the exception goes on
+    template <typename RandomIt>
+    bool bulkLoad(RandomIt first, RandomIt last, unsigned threads = std::thread::hardware_concurrency());
+
+    // one callback object sees the whole range, so one that keeps state
+    // (a count, a collector) keeps it from shard to shard
+    template <typename Callback>
+    void scan(const K& lo, const K& hi, Callback&& callback);
+    std::optional<Entry> floor(const K& k);
+    std::optional<Entry> ceiling(const K& k);
+    std::optional<Entry> successor(const K& k);
+    std::optional<Entry> first();
+    std::optional<Entry> last();
+
+    std::size_t size();
+    bool empty() { return size() == 0; }
+    std::size_t approximateSize();
+    void quiescent();
+    // no other thread may be using the map
+    void clear();
+
+    unsigned shardCount() const { return static_cast<unsigned>(shards.size()); }
+    unsigned shardOf(const K& k) const;
+    Shard& shardAt(unsigned i) { return *shards[i]; }
+
+private:
+    ShardedBSTMap(const ShardedBSTMap& rhs);
+    ShardedBSTMap& operator=(const ShardedBSTMap& rhs);
+
+    Shard& shard(const K& k) { return *shards[shardOf(k)]; }
+    // the end of the run of keys from first on that belong to shard i
+    template <typename RandomIt, typename KeyOf>
+    RandomIt runEnd(unsigned i, RandomIt first, RandomIt last, KeyOf keyOf) const;
+    // links roots[i] on into shards i on, each under the locks of the shards
+    // before it; true only if every shard was still empty
+    bool linkShards(unsigned i, const std::vector<typename Shard::NodePtr>& roots, const std::vector<long long>& nodes);
+
+    Compare comp;
+    std::vector<K> splits;
+    // the largest power of two <= splits.size(), where shardOf starts
+    unsigned firstStep;
+    std::vector<std::unique_ptr<Shard> > shards;
+};
+
+template <typename K, typename V, typename Compare, typename Alloc>
+ShardedBSTMap<K, V, Compare, Alloc>::ShardedBSTMap(const std::vector<K>& splits, const Compare& comp, const Alloc& alloc)
+    : comp(comp), splits(splits), firstStep(0), shards()
+{
+    for (std::size_t i = 1; i < splits.size(); ++i)
+        if (!comp(splits[i - 1], splits[i]))
+            throw std::invalid_argument("ShardedBSTMap: split keys must be strictly ascending");
+    if (!splits.empty())
+    {
+        firstStep = 1;
+        while (firstStep * 2 <= splits.size())
+            firstStep *= 2;
+    }
+    for (std::size_t i = 0; i <= splits.size(); ++i)
+        shards.emplace_back(new Shard(comp, alloc));
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+unsigned ShardedBSTMap<K, V, Compare, Alloc>::shardsFor(unsigned threads)
+{
+    unsigned shards = 1;
+    while (shards < threads)
+        shards *= 2;
+    return shards;
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+std::vector<K> ShardedBSTMap<K, V, Compare, Alloc>::evenSplits(const K& lo, const K& hi, unsigned shards)
+{
+    static_assert(std::is_arithmetic<K>::value, "evenSplits needs arithmetic keys; pass split keys to the constructor instead");
+    std::vector<K> result;
+    // in long double, so that hi - lo can't overflow K
+    long double width = (static_cast<long double>(hi) - static_cast<long double>(lo)) / shards;
+    for (unsigned i = 1; i < shards; ++i)
+    {
+        K split = static_cast<K>(lo + width * i);
+        // narrow ranges just get fewer shards
+        if (result.empty() ? lo < split : result.back() < split)
+            result.push_back(split);
+    }
+    return result;
+}
+
+// counts the splits <= k by binary lifting: each step either takes step more
+// splits or doesn't, and the number of steps only depends on the shard count
+template <typename K, typename V, typename Compare, typename Alloc>
+unsigned ShardedBSTMap<K, V, Compare, Alloc>::shardOf(const K& k) const
+{
+    unsigned i = 0;
+    for (unsigned step = firstStep; step > 0; step /= 2)
+        if (i + step <= splits.size())
+            i += comp(k, splits[i + step - 1]) ? 0 : step;
+    return i;
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename RandomIt, typename KeyOf>
+RandomIt ShardedBSTMap<K, V, Compare, Alloc>::runEnd(unsigned i, RandomIt first, RandomIt last, KeyOf keyOf) const
+{
+    while (first != last && (i == 0 || !comp(keyOf(*first), splits[i - 1])) && (i == splits.size() || comp(keyOf(*first), splits[i])))
+        ++first;
+    return first;
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename RandomIt>
+std::vector<std::optional<V> > ShardedBSTMap<K, V, Compare, Alloc>::putAll(RandomIt first, RandomIt last)
+{
+    std::vector<std::optional<V> > results;
+    results.reserve(last - first);
+    auto keyOf = [](const typename std::iterator_traits<RandomIt>::value_type& entry) -> const K& { return entry.first; };
+    while (first != last)
+    {
+        unsigned i = shardOf(first->first);
+        RandomIt end = runEnd(i, first, last, keyOf);
+        std::vector<std::optional<V> > run = shards[i]->putAll(first, end);
+        results.insert(results.end(), run.begin(), run.end());
+        first = end;
+    }
+    return results;
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename RandomIt>
+std::vector<std::optional<V> > ShardedBSTMap<K, V, Compare, Alloc>::removeAll(RandomIt first, RandomIt last)
+{
+    std::vector<std::optional<V> > results;
+    results.reserve(last - first);
+    auto keyOf = [](const K& k) -> const K& { return k; };
+    while (first != last)
+    {
+        unsigned i = shardOf(*first);
+        RandomIt end = runEnd(i, first, last, keyOf);
+        std::vector<std::optional<V> > run = shards[i]->removeAll(first, end);
+        results.insert(results.end(), run.begin(), run.end());
+        first = end;
+    }
+    return results;
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename RandomIt>
+std::vector<std::optional<V> > ShardedBSTMap<K, V, Compare, Alloc>::getAll(RandomIt first, RandomIt last)
+{
+    std::size_t n = last - first;
+    std::vector<std::optional<V> > results(n);
+    std::vector<std::vector<K> > keys(shards.size());
+    std::vector<std::vector<std::size_t> > positions(shards.size());
+    for (std::size_t j = 0; j < n; ++j)
+    {
+        unsigned i = shardOf(first[j]);
+        keys[i].push_back(first[j]);
+        positions[i].push_back(j);
+    }
+    for (std::size_t i = 0; i < shards.size(); ++i)
+        if (!keys[i].empty())
+        {
+            std::vector<std::optional<V> > found = shards[i]->getAll(keys[i].begin(), keys[i].end());
+            for (std::size_t j = 0; j < found.size(); ++j)
+                results[positions[i][j]] = found[j];
+        }
+    return results;
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename RandomIt>
+bool ShardedBSTMap<K, V, Compare, Alloc>::bulkLoad(RandomIt first, RandomIt last, unsigned threads)
+{
+    for (const std::unique_ptr<Shard>& s : shards)
+        if (s->height() != 0)
+            return false;
+    assert(shards[0]->ascending(first, last) && "bulkLoad needs keys in strictly ascending order");
+    auto keyOf = [](const typename std::iterator_traits<RandomIt>::value_type& entry) -> const K& { return entry.first; };
+    std::vector<typename Shard::NodePtr> roots;
+    std::vector<long long> nodes;
+    roots.reserve(shards.size());
+    nodes.reserve(shards.size());
+    try
+    {
+        for (unsigned i = 0; i < shards.size(); ++i)
+        {
+            RandomIt end = runEnd(i, first, last, keyOf);
+            shards[i]->ensureNodes();
+            roots.push_back(shards[i]->buildSubtreeParallel(shards[i]->rootHolder, first, end, threads));
+            nodes.push_back(end - first);
+            first = end;
+        }
+    }
+    catch (...)
+    {
+        for (unsigned i = 0; i < roots.size(); ++i)
+            shards[i]->deleteTree(roots[i]);
+        throw;
+    }
+    if (linkShards(0, roots, nodes))
+        return true;
+    for (unsigned i = 0; i < shards.size(); ++i)
+        shards[i]->deleteTree(roots[i]);
+    return false;
+}
+
+// nothing else holds the locks of two shards at once, so taking the roots'
+// locks in shard order can't deadlock
+template <typename K, typename V, typename Compare, typename Alloc>
+bool ShardedBSTMap<K, V, Compare, Alloc>::linkShards(unsigned i, const std::vector<typename Shard::NodePtr>& roots, const std::vector<long long>& nodes)
+{
+    if (i == shards.size())
+        return true;
+    return shards[i]->linkRoot(roots[i], nodes[i], [&]() { return linkShards(i + 1, roots, nodes); });
+}
+
+// a shard's scan stops at hi or at the end of the shard, whichever is first.
+// the shards get a reference to the callback, which they copy instead of it
+template <typename K, typename V, typename Compare, typename Alloc>
+template <typename Callback>
+void ShardedBSTMap<K, V, Compare, Alloc>::scan(const K& lo, const K& hi, Callback&& callback)
+{
+    for (unsigned i = shardOf(lo); i < shards.size() && (i == 0 || comp(splits[i - 1], hi)); ++i)
+        shards[i]->scan(lo, hi, std::ref(callback));
+}
+
+// anything a shard finds beats whatever the shards past it would
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<typename ShardedBSTMap<K, V, Compare, Alloc>::Entry> ShardedBSTMap<K, V, Compare, Alloc>::floor(const K& k)
+{
+    unsigned i = shardOf(k);
+    std::optional<Entry> found = shards[i]->floor(k);
+    while (!found && i > 0)
+        found = shards[--i]->last();
+    return found;
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<typename ShardedBSTMap<K, V, Compare, Alloc>::Entry> ShardedBSTMap<K, V, Compare, Alloc>::ceiling(const K& k)
+{
+    unsigned i = shardOf(k);
+    std::optional<Entry> found = shards[i]->ceiling(k);
+    while (!found && i + 1 < shards.size())
+        found = shards[++i]->first();
+    return found;
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<typename ShardedBSTMap<K, V, Compare, Alloc>::Entry> ShardedBSTMap<K, V, Compare, Alloc>::successor(const K& k)
+{
+    unsigned i = shardOf(k);
+    std::optional<Entry> found = shards[i]->successor(k);
+    while (!found && i + 1 < shards.size())
+        found = shards[++i]->first();
+    return found;
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<typename ShardedBSTMap<K, V, Compare, Alloc>::Entry> ShardedBSTMap<K, V, Compare, Alloc>::first()
+{
+    std::optional<Entry> found;
+    for (unsigned i = 0; !found && i < shards.size(); ++i)
+        found = shards[i]->first();
+    return found;
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+std::optional<typename ShardedBSTMap<K, V, Compare, Alloc>::Entry> ShardedBSTMap<K, V, Compare, Alloc>::last()
+{
+    std::optional<Entry> found;
+    for (unsigned i = shardCount(); !found && i > 0; --i)
+        found = shards[i - 1]->last();
+    return found;
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+std::size_t ShardedBSTMap<K, V, Compare, Alloc>::size()
+{
+    std::size_t total = 0;
+    for (const std::unique_ptr<Shard>& s : shards)
+        total += s->size();
+    return total;
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+std::size_t ShardedBSTMap<K, V, Compare, Alloc>::approximateSize()
+{
+    std::size_t total = 0;
+    for (const std::unique_ptr<Shard>& s : shards)
+        total += s->approximateSize();
+    return total;
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+void ShardedBSTMap<K, V, Compare, Alloc>::quiescent()
+{
+    for (const std::unique_ptr<Shard>& s : shards)
+        s->quiescent();
+}
+template <typename K, typename V, typename Compare, typename Alloc>
+void ShardedBSTMap<K, V, Compare, Alloc>::clear()
+{
+    for (const std::unique_ptr<Shard>& s : shards)
+        s->clear();
+}
+
+#endif
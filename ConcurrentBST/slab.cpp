@@ -0,0 +1,103 @@
+#include "slab.h"
+
+// the header takes the first size class of every chunk
+static const std::size_t ChunkHeaderBytes = SlabSizeClass;
+
+SlabPool::SlabPool(std::size_t blockSize, RegionAllocator allocateRegion, RegionDeallocator deallocateRegion, void* context)
+    : blockSize((blockSize + SlabSizeClass - 1) / SlabSizeClass * SlabSizeClass), chunkBytes(SlabChunkBytes), blocksPerChunk(0),
+      allocateRegion(allocateRegion), deallocateRegion(deallocateRegion), context(context),
+      regionMutex(), regions(), nextChunk(nullptr), regionEnd(nullptr), caches()
+{
+    if (this->blockSize < sizeof(Block))
+        this->blockSize = SlabSizeClass;
+    while ((chunkBytes - ChunkHeaderBytes) / this->blockSize < MinBlocksPerChunk)
+        chunkBytes *= 2;
+    blocksPerChunk = (chunkBytes - ChunkHeaderBytes) / this->blockSize;
+}
+
+SlabPool::~SlabPool()
+{
+    release();
+}
+
+void* SlabPool::allocate()
+{
+    unsigned self = ThreadRegistry::index();
+    Cache& cache = caches.at(self);
+    Block* block = cache.freeList;
+    if (block == nullptr && cache.remoteFree.load(std::memory_order_relaxed) != nullptr)
+        block = cache.remoteFree.exchange(nullptr, std::memory_order_acquire);
+    if (block != nullptr)
+    {
+        cache.freeList = block->next;
+        return block;
+    }
+    if (cache.bump == cache.end)
+    {
+        cache.bump = newChunk(self) + ChunkHeaderBytes;
+        cache.end = cache.bump + blocksPerChunk * blockSize;
+    }
+    void* p = cache.bump;
+    cache.bump += blockSize;
+    return p;
+}
+
+void SlabPool::deallocate(void* p)
+{
+    std::size_t chunk = reinterpret_cast<std::size_t>(p) & ~(chunkBytes - 1);
+    unsigned owner = reinterpret_cast<ChunkHeader*>(chunk)->owner;
+    Block* block = static_cast<Block*>(p);
+    if (owner == ThreadRegistry::index())
+    {
+        Cache& cache = caches.at(owner);
+        block->next = cache.freeList;
+        cache.freeList = block;
+        return;
+    }
+    // only the owner ever takes blocks off this list, and it takes all of
+    // them at once, so a plain push can't suffer from ABA
+    std::atomic<Block*>& remoteFree = caches.at(owner).remoteFree;
+    Block* head = remoteFree.load(std::memory_order_relaxed);
+    do
+        block->next = head;
+    while (!remoteFree.compare_exchange_weak(head, block, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void SlabPool::release()
+{
+    caches.forEach([](Cache& cache)
+    {
+        cache.freeList = nullptr;
+        cache.bump = nullptr;
+        cache.end = nullptr;
+        cache.remoteFree.store(nullptr, std::memory_order_relaxed);
+    });
+    for (const Region& region : regions)
+        deallocateRegion(context, region.p, region.bytes);
+    regions.clear();
+    nextChunk = nullptr;
+    regionEnd = nullptr;
+}
+
+// chunks are handed out under a lock, but a thread only comes here once
+// every blocksPerChunk allocations
+char* SlabPool::newChunk(unsigned owner)
+{
+    std::unique_lock<std::mutex> regionLock(regionMutex);
+    if (nextChunk == regionEnd)
+    {
+        // one chunk of slack so that ChunksPerRegion aligned chunks always fit
+        std::size_t bytes = (ChunksPerRegion + 1) * chunkBytes;
+        Region region = { allocateRegion(context, bytes), bytes };
+        regions.push_back(region);
+        std::size_t start = reinterpret_cast<std::size_t>(region.p);
+        std::size_t first = (start + chunkBytes - 1) & ~(chunkBytes - 1);
+        std::size_t last = (start + bytes) & ~(chunkBytes - 1);
+        nextChunk = reinterpret_cast<char*>(first);
+        regionEnd = reinterpret_cast<char*>(last);
+    }
+    char* chunk = nextChunk;
+    nextChunk += chunkBytes;
+    reinterpret_cast<ChunkHeader*>(chunk)->owner = owner;
+    return chunk;
+}
@@ -0,0 +1,87 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+#include "threadregistry.h"
+
+// fixed-size block allocator with per-thread caches
+//
+// blocks are carved out of chunks, and every thread allocates from chunks it
+// owns, so the nodes a thread inserts sit next to each other instead of being
+// scattered across the heap. a chunk is aligned to its size, which lets a
+// block find its chunk (and the thread that owns it) by masking its address;
+// a block freed by any other thread is pushed onto the owner's remote list
+// and picked up the next time the owner runs out. chunks are cut from
+// regions taken from the caller's allocator, and regions are only given back
+// all at once, by release() or the destructor
+class SlabPool
+{
+public:
+    typedef void* (*RegionAllocator)(void* context, std::size_t bytes);
+    typedef void (*RegionDeallocator)(void* context, void* p, std::size_t bytes);
+
+    // blockSize is rounded up to a multiple of SlabSizeClass
+    SlabPool(std::size_t blockSize, RegionAllocator allocateRegion, RegionDeallocator deallocateRegion, void* context);
+    ~SlabPool();
+
+    void* allocate();
+    // p can be freed by any thread, not just the one that allocated it
+    void deallocate(void* p);
+    // forgets every block and gives all regions back; nobody may be using the
+    // pool, and nothing still in it is destroyed
+    void release();
+
+private:
+    struct Block
+    {
+        Block* next;
+    };
+    struct ChunkHeader
+    {
+        unsigned owner;
+    };
+    struct Cache
+    {
+        Cache() : freeList(nullptr), bump(nullptr), end(nullptr), remoteFree(nullptr) {}
+        // only touched by the owning thread
+        Block* freeList;
+        char* bump;
+        char* end;
+        // pushed to by every other thread, emptied in one go by the owner
+        std::atomic<Block*> remoteFree;
+    };
+    struct Region
+    {
+        void* p;
+        std::size_t bytes;
+    };
+
+    char* newChunk(unsigned owner);
+
+    SlabPool(const SlabPool& rhs);
+    SlabPool& operator=(const SlabPool& rhs);
+
+    std::size_t blockSize;
+    std::size_t chunkBytes;
+    std::size_t blocksPerChunk;
+    RegionAllocator allocateRegion;
+    RegionDeallocator deallocateRegion;
+    void* context;
+    std::mutex regionMutex;
+    std::vector<Region> regions;
+    char* nextChunk;
+    char* regionEnd;
+    PerThread<Cache> caches;
+};
+
+const std::size_t SlabSizeClass = 16;
+// chunks grow past this (in powers of two) for blocks too big to fit
+// MinBlocksPerChunk of them
+const std::size_t SlabChunkBytes = 16 * 1024;
+const std::size_t MinBlocksPerChunk = 32;
+const std::size_t ChunksPerRegion = 16;
+
+#endif
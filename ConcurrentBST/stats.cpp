@@ -0,0 +1,136 @@
+#include "stats.h"
+#include <iomanip>
+
+unsigned long long MapStats::latencySamples(StatOp op) const
+{
+    unsigned long long total = 0;
+    for (unsigned b = 0; b < LatencyBuckets; ++b)
+        total += latency[op][b];
+    return total;
+}
+
+unsigned long long MapStats::latencyQuantile(StatOp op, double q) const
+{
+    unsigned long long total = latencySamples(op);
+    if (total == 0)
+        return 0;
+    unsigned long long seen = 0;
+    for (unsigned b = 0; b < LatencyBuckets; ++b)
+    {
+        seen += latency[op][b];
+        if (seen >= q * total)
+            return 2ULL << b;
+    }
+    return 2ULL << (LatencyBuckets - 1);
+}
+
+std::ostream& operator<<(std::ostream& os, const MapStats& stats)
+{
+    const char* names[] = { "get", "put", "remove", "scan" };
+    os << std::setw(8) << "op" << std::setw(12) << "ops" << std::setw(12) << "retries"
+       << std::setw(10) << "p50 ns" << std::setw(10) << "p99 ns" << std::setw(10) << "p99.9 ns" << "\n";
+    for (int op = 0; op < StatOpCount; ++op)
+    {
+        StatOp o = static_cast<StatOp>(op);
+        os << std::setw(8) << names[op] << std::setw(12) << stats.ops[op] << std::setw(12) << stats.retries[op]
+           << std::setw(10) << stats.latencyQuantile(o, 0.5) << std::setw(10) << stats.latencyQuantile(o, 0.99)
+           << std::setw(10) << stats.latencyQuantile(o, 0.999) << "\n";
+    }
+    os << "locks " << stats.lockAcquisitions << " (" << stats.contendedLocks << " contended), removes "
+       << stats.unlinked << " unlinked / " << stats.routed << " routed, " << stats.compacted << " routing nodes compacted, "
+       << stats.copied << " nodes copied for snapshots, mean depth " << stats.meanDepth() << " ("
+       << stats.meanSteps() << " levels walked)\n";
+    return os;
+}
+
+StatsRecord::StatsRecord()
+    : untilSample(LatencySampleRate), sampling(false)
+{
+    reset();
+}
+
+void StatsRecord::addTo(MapStats& total) const
+{
+    for (int op = 0; op < StatOpCount; ++op)
+    {
+        total.ops[op] += ops[op].load(std::memory_order_relaxed);
+        total.retries[op] += retries[op].load(std::memory_order_relaxed);
+        for (unsigned b = 0; b < LatencyBuckets; ++b)
+            total.latency[op][b] += latency[op][b].load(std::memory_order_relaxed);
+    }
+    total.lockAcquisitions += lockAcquisitions.load(std::memory_order_relaxed);
+    total.contendedLocks += contendedLocks.load(std::memory_order_relaxed);
+    total.unlinked += unlinked.load(std::memory_order_relaxed);
+    total.routed += routed.load(std::memory_order_relaxed);
+    total.compacted += compacted.load(std::memory_order_relaxed);
+    total.copied += copied.load(std::memory_order_relaxed);
+    total.depthSum += depthSum.load(std::memory_order_relaxed);
+    total.stepsSum += stepsSum.load(std::memory_order_relaxed);
+    total.depthSamples += depthSamples.load(std::memory_order_relaxed);
+}
+
+void StatsRecord::reset()
+{
+    for (int op = 0; op < StatOpCount; ++op)
+    {
+        ops[op].store(0, std::memory_order_relaxed);
+        retries[op].store(0, std::memory_order_relaxed);
+        for (unsigned b = 0; b < LatencyBuckets; ++b)
+            latency[op][b].store(0, std::memory_order_relaxed);
+    }
+    lockAcquisitions.store(0, std::memory_order_relaxed);
+    contendedLocks.store(0, std::memory_order_relaxed);
+    unlinked.store(0, std::memory_order_relaxed);
+    routed.store(0, std::memory_order_relaxed);
+    compacted.store(0, std::memory_order_relaxed);
+    copied.store(0, std::memory_order_relaxed);
+    depthSum.store(0, std::memory_order_relaxed);
+    stepsSum.store(0, std::memory_order_relaxed);
+    depthSamples.store(0, std::memory_order_relaxed);
+}
+
+// ids start at 1; 0 is what a thread that hasn't used any collector has cached
+std::atomic<unsigned long long> StatsCollector::nextId(1);
+
+StatsCollector::StatsCollector()
+    : id(nextId++), records()
+{}
+
+MapStats StatsCollector::snapshot()
+{
+    MapStats total = MapStats();
+    records.forEach([&total](StatsRecord& record)
+    {
+        record.addTo(total);
+    });
+    return total;
+}
+
+void StatsCollector::reset()
+{
+    records.forEach([](StatsRecord& record)
+    {
+        record.reset();
+    });
+}
+
+void LatencySample::begin(StatsRecord* sampled)
+{
+    record = sampled;
+    record->untilSample = LatencySampleRate;
+    record->sampling = true;
+    start = std::chrono::steady_clock::now();
+}
+
+void LatencySample::end()
+{
+    long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    unsigned b = 0;
+    while (ns > 1 && b + 1 < LatencyBuckets)
+    {
+        ns >>= 1;
+        ++b;
+    }
+    StatsRecord::bump(record->latency[op][b]);
+    record->sampling = false;
+}
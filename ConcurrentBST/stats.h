@@ -0,0 +1,172 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <ostream>
+#include "threadregistry.h"
+
+// build with -DCONCURRENTBST_STATS to count what the map does. without it
+// StatsEnabled is false, every recording call below is dead code, and
+// stats() returns zeros
+#ifdef CONCURRENTBST_STATS
+const bool StatsEnabled = true;
+#else
+const bool StatsEnabled = false;
+#endif
+
+enum StatOp { StatGet, StatPut, StatRemove, StatScan, StatOpCount };
+
+// latencies go into power-of-two buckets of nanoseconds: bucket b counts
+// operations that took [2^b, 2^(b+1)) ns (bucket 0 also gets 0 and 1 ns)
+const unsigned LatencyBuckets = 40;
+// one operation in this many per thread is timed (and has its depth
+// recorded); reading the clock on every operation would cost more than the
+// operations we're measuring
+const unsigned LatencySampleRate = 64;
+
+// a point-in-time sum of every thread's counters
+struct MapStats
+{
+    unsigned long long ops[StatOpCount];
+    // descents that had to back up or start over, by operation
+    unsigned long long retries[StatOpCount];
+    unsigned long long lockAcquisitions;
+    // acquisitions that found the lock taken
+    unsigned long long contendedLocks;
+    // removes that unlinked their node vs ones that left a routing node behind
+    unsigned long long unlinked;
+    unsigned long long routed;
+    // routing nodes unlinked later, once they were down to one child
+    unsigned long long compacted;
+    // frozen nodes writers had to copy because a snapshot shared them
+    unsigned long long copied;
+    // levels below rootHolder at which get/put/remove found their key or
+    // link, for the operations whose latency was sampled
+    unsigned long long depthSum;
+    // levels they actually walked down to get there, fewer than the depth
+    // when they started partway down (from a Finger, or a batch's last key)
+    unsigned long long stepsSum;
+    unsigned long long depthSamples;
+    unsigned long long latency[StatOpCount][LatencyBuckets];
+
+    double meanDepth() const { return depthSamples == 0 ? 0 : static_cast<double>(depthSum) / depthSamples; }
+    double meanSteps() const { return depthSamples == 0 ? 0 : static_cast<double>(stepsSum) / depthSamples; }
+    unsigned long long latencySamples(StatOp op) const;
+    // upper bound (ns) of the bucket the q-th quantile of op's sampled latencies falls in
+    unsigned long long latencyQuantile(StatOp op, double q) const;
+};
+
+std::ostream& operator<<(std::ostream& os, const MapStats& stats);
+
+// one thread's counters. only the owning thread writes them, so an increment
+// is a plain load and store; they're atomic so that stats() can read them
+// while the owner is running
+struct StatsRecord
+{
+    StatsRecord();
+
+    std::atomic<unsigned long long> ops[StatOpCount];
+    std::atomic<unsigned long long> retries[StatOpCount];
+    std::atomic<unsigned long long> lockAcquisitions;
+    std::atomic<unsigned long long> contendedLocks;
+    std::atomic<unsigned long long> unlinked;
+    std::atomic<unsigned long long> routed;
+    std::atomic<unsigned long long> compacted;
+    std::atomic<unsigned long long> copied;
+    std::atomic<unsigned long long> depthSum;
+    std::atomic<unsigned long long> stepsSum;
+    std::atomic<unsigned long long> depthSamples;
+    std::atomic<unsigned long long> latency[StatOpCount][LatencyBuckets];
+    unsigned untilSample;
+    // the operation running now is being timed
+    bool sampling;
+
+    static void bump(std::atomic<unsigned long long>& counter, unsigned long long n = 1)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    void addTo(MapStats& total) const;
+    void reset();
+};
+
+// every thread's records for one map
+class StatsCollector
+{
+public:
+    StatsCollector();
+
+    // a thread remembers the last collector it used (by id, since a new
+    // collector may reuse an old one's address), which saves looking up its
+    // slot on every counter bump
+    StatsRecord& local()
+    {
+        Cached& c = cached();
+        if (c.id != id)
+        {
+            c.id = id;
+            c.record = &records.local();
+        }
+        return *c.record;
+    }
+    MapStats snapshot();
+    // counts from operations running at the same time may survive a reset
+    void reset();
+
+private:
+    struct Cached
+    {
+        unsigned long long id;
+        StatsRecord* record;
+    };
+
+    StatsCollector(const StatsCollector& rhs);
+    StatsCollector& operator=(const StatsCollector& rhs);
+
+    // a constant-initialized local, so that reaching it doesn't go through
+    // the wrapper function an extern thread_local would need
+    static Cached& cached()
+    {
+        static thread_local Cached c = { 0, nullptr };
+        return c;
+    }
+
+    static std::atomic<unsigned long long> nextId;
+    unsigned long long id;
+    PerThread<StatsRecord> records;
+};
+
+// counts one operation, and times it if it's the calling thread's turn to be
+// sampled; the common case stays inline
+class LatencySample
+{
+public:
+    LatencySample(StatsRecord* record, StatOp op)
+        : record(nullptr), op(op), start()
+    {
+        if (record == nullptr)
+            return;
+        StatsRecord::bump(record->ops[op]);
+        if (--record->untilSample == 0)
+            begin(record);
+    }
+    ~LatencySample()
+    {
+        if (record != nullptr)
+            end();
+    }
+
+private:
+    void begin(StatsRecord* sampled);
+    void end();
+
+    LatencySample(const LatencySample& rhs);
+    LatencySample& operator=(const LatencySample& rhs);
+
+    StatsRecord* record;
+    StatOp op;
+    std::chrono::steady_clock::time_point start;
+};
+
+#endif
@@ -0,0 +1,48 @@
+#include "threadregistry.h"
+#include <mutex>
+#include <vector>
+#include <stdexcept>
+
+static std::mutex registryMutex;
+static std::vector<unsigned> freeIndices;
+static unsigned nextIndex = 0;
+
+thread_local unsigned ThreadRegistry::cachedIndex = ThreadRegistry::Unassigned;
+
+// gives the index back when its thread exits
+struct ThreadIndexReleaser
+{
+    unsigned index;
+    ThreadIndexReleaser() : index(ThreadRegistry::Unassigned) {}
+    ~ThreadIndexReleaser()
+    {
+        if (index != ThreadRegistry::Unassigned)
+            ThreadRegistry::release(index);
+    }
+};
+static thread_local ThreadIndexReleaser releaser;
+
+unsigned ThreadRegistry::acquire()
+{
+    unsigned index = Unassigned;
+    {
+        std::unique_lock<std::mutex> registryLock(registryMutex);
+        if (!freeIndices.empty())
+        {
+            index = freeIndices.back();
+            freeIndices.pop_back();
+        }
+        else if (nextIndex < MaxThreads)
+            index = nextIndex++;
+    }
+    if (index == Unassigned)
+        throw std::runtime_error("ThreadRegistry: too many threads");
+    releaser.index = index;
+    return index;
+}
+
+void ThreadRegistry::release(unsigned index)
+{
+    std::unique_lock<std::mutex> registryLock(registryMutex);
+    freeIndices.push_back(index);
+}
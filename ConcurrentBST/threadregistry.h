@@ -0,0 +1,124 @@
+#ifndef THREADREGISTRY_H
+#define THREADREGISTRY_H
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+
+const std::size_t CacheLineSize = 64;
+
+// hands out small, dense thread indices; a thread keeps its index until it
+// exits, after which the index goes to the next thread that asks for one
+class ThreadRegistry
+{
+public:
+    static const unsigned MaxThreads = 4096;
+
+    // the calling thread's index, in [0, MaxThreads)
+    static unsigned index()
+    {
+        if (cachedIndex == Unassigned)
+            cachedIndex = acquire();
+        return cachedIndex;
+    }
+
+private:
+    static const unsigned Unassigned = ~0u;
+    static unsigned acquire();
+    static void release(unsigned index);
+
+    static thread_local unsigned cachedIndex;
+    friend struct ThreadIndexReleaser;
+};
+
+// one cache-line-aligned T per thread index, allocated lazily in chunks so
+// that a handful of threads doesn't pay for MaxThreads slots
+template <typename T>
+class PerThread
+{
+public:
+    PerThread()
+    {
+        for (std::atomic<Chunk*>& chunk : chunks)
+            chunk.store(nullptr, std::memory_order_relaxed);
+    }
+    ~PerThread()
+    {
+        for (std::atomic<Chunk*>& chunk : chunks)
+            destroyChunk(chunk.load(std::memory_order_relaxed));
+    }
+
+    // the calling thread's slot
+    T& local()
+    {
+        return at(ThreadRegistry::index());
+    }
+
+    T& at(unsigned index)
+    {
+        std::atomic<Chunk*>& chunk = chunks[index / ChunkSize];
+        Chunk* c = chunk.load(std::memory_order_acquire);
+        if (c == nullptr)
+        {
+            Chunk* fresh = createChunk();
+            if (chunk.compare_exchange_strong(c, fresh, std::memory_order_acq_rel))
+                c = fresh;
+            else
+                destroyChunk(fresh);
+        }
+        return c->slots[index % ChunkSize].value;
+    }
+
+    // visits every slot that has been allocated so far; other threads may be
+    // using their slots while this runs
+    template <typename Visitor>
+    void forEach(Visitor visit)
+    {
+        for (std::atomic<Chunk*>& chunk : chunks)
+        {
+            Chunk* c = chunk.load(std::memory_order_acquire);
+            if (c == nullptr)
+                continue;
+            for (Slot& slot : c->slots)
+                visit(slot.value);
+        }
+    }
+
+private:
+    static const unsigned ChunkSize = 64;
+    struct alignas(CacheLineSize) Slot
+    {
+        T value;
+    };
+    struct Chunk
+    {
+        Slot slots[ChunkSize];
+        void* raw;
+    };
+
+    // operator new doesn't honor over-aligned types before C++17
+    static Chunk* createChunk()
+    {
+        void* raw = ::operator new(sizeof(Chunk) + CacheLineSize);
+        std::size_t addr = reinterpret_cast<std::size_t>(raw);
+        addr = (addr + CacheLineSize - 1) & ~(CacheLineSize - 1);
+        Chunk* c = new (reinterpret_cast<void*>(addr)) Chunk();
+        c->raw = raw;
+        return c;
+    }
+    static void destroyChunk(Chunk* c)
+    {
+        if (c == nullptr)
+            return;
+        void* raw = c->raw;
+        c->~Chunk();
+        ::operator delete(raw);
+    }
+
+    PerThread(const PerThread& rhs);
+    PerThread& operator=(const PerThread& rhs);
+
+    std::atomic<Chunk*> chunks[ThreadRegistry::MaxThreads / ChunkSize];
+};
+
+#endif
@@ -0,0 +1,219 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+#ifdef __linux__
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// one hardware thread as sysfs describes it. core ids are only unique
+// within a package; smt is the thread's position among its core's siblings
+struct Cpu
+{
+    int id;
+    int package;
+    int core;
+    int node;
+    int smt;
+};
+
+struct Topology
+{
+    // the CPUs this process may run on, by id
+    std::vector<Cpu> cpus;
+    int packages;
+    int nodes;
+    int cores;
+};
+
+// how benchmark threads are pinned; thread t gets the t-th CPU of the
+// placement's order (wrapping around when there are more threads than CPUs)
+//   Unpinned: left to the scheduler
+//   Cores: one thread per physical core, SMT siblings only once every core
+//          has a thread, filling one package (and NUMA node) before the next
+//   Packed: both (all) SMT siblings of a core before the next core
+//   Spread: like Cores, but taking turns between NUMA nodes (packages, if
+//           there's no NUMA information)
+enum class Placement { Unpinned, Cores, Packed, Spread };
+
+const char* placementName(Placement placement)
+{
+    switch (placement)
+    {
+        case Placement::Unpinned: return "unpinned";
+        case Placement::Cores: return "cores";
+        case Placement::Packed: return "smt-packed";
+        case Placement::Spread: return "spread";
+    }
+    return "";
+}
+
+// sysfs lists CPUs as ranges: "0-3,8,10-11"
+std::vector<int> parseCpuList(const std::string& list)
+{
+    std::vector<int> result;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ','))
+    {
+        if (range.empty() || range[0] == '\n')
+            continue;
+        std::size_t dash = range.find('-');
+        int first = std::atoi(range.c_str());
+        int last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+        for (int cpu = first; cpu <= last; ++cpu)
+            result.push_back(cpu);
+    }
+    return result;
+}
+
+// the first line of a sysfs file, or "" if it can't be read
+std::string readSysfs(const std::string& path)
+{
+    std::ifstream in(path);
+    std::string line;
+    std::getline(in, line);
+    return line;
+}
+
+// reads the CPUs this process is allowed on from sysfs. where sysfs says
+// nothing (or this isn't Linux), every hardware thread counts as a core of
+// its own in one package and node
+Topology readTopology()
+{
+    Topology topology = Topology();
+    std::vector<int> ids;
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    bool haveMask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+    for (int id : parseCpuList(readSysfs("/sys/devices/system/cpu/online")))
+        if (!haveMask || CPU_ISSET(id, &allowed))
+            ids.push_back(id);
+#endif
+    if (ids.empty())
+        for (unsigned id = 0; id < std::max(1u, std::thread::hardware_concurrency()); ++id)
+            ids.push_back(static_cast<int>(id));
+
+    std::map<int, int> nodeOf;
+#ifdef __linux__
+    if (DIR* dir = opendir("/sys/devices/system/node"))
+    {
+        while (dirent* entry = readdir(dir))
+        {
+            std::string name = entry->d_name;
+            if (name.compare(0, 4, "node") != 0 || name.size() == 4 || name[4] < '0' || name[4] > '9')
+                continue;
+            for (int cpu : parseCpuList(readSysfs("/sys/devices/system/node/" + name + "/cpulist")))
+                nodeOf[cpu] = std::atoi(name.c_str() + 4);
+        }
+        closedir(dir);
+    }
+#endif
+    for (int id : ids)
+    {
+        std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(id) + "/topology/";
+        std::string package = readSysfs(dir + "physical_package_id");
+        std::string core = readSysfs(dir + "core_id");
+        Cpu cpu;
+        cpu.id = id;
+        cpu.package = package.empty() ? 0 : std::atoi(package.c_str());
+        cpu.core = core.empty() ? id : std::atoi(core.c_str());
+        cpu.node = nodeOf.count(id) != 0 ? nodeOf[id] : -1;
+        cpu.smt = 0;
+        topology.cpus.push_back(cpu);
+    }
+
+    // number the siblings of each core, and fall back on packages for nodes
+    std::map<std::pair<int, int>, int> siblings;
+    std::map<int, int> packages, nodes;
+    for (Cpu& cpu : topology.cpus)
+    {
+        cpu.smt = siblings[std::make_pair(cpu.package, cpu.core)]++;
+        if (cpu.node < 0)
+            cpu.node = cpu.package;
+        ++packages[cpu.package];
+        ++nodes[cpu.node];
+    }
+    topology.packages = static_cast<int>(packages.size());
+    topology.nodes = static_cast<int>(nodes.size());
+    topology.cores = static_cast<int>(siblings.size());
+    return topology;
+}
+
+// the CPU ids in the order threads are placed on them; empty for Unpinned
+std::vector<int> placementOrder(const Topology& topology, Placement placement)
+{
+    std::vector<Cpu> cpus = topology.cpus;
+    std::vector<int> order;
+    switch (placement)
+    {
+        case Placement::Unpinned:
+            return order;
+        case Placement::Cores:
+            std::sort(cpus.begin(), cpus.end(), [](const Cpu& a, const Cpu& b)
+            {
+                return std::make_tuple(a.smt, a.node, a.package, a.core, a.id) < std::make_tuple(b.smt, b.node, b.package, b.core, b.id);
+            });
+            break;
+        case Placement::Packed:
+            std::sort(cpus.begin(), cpus.end(), [](const Cpu& a, const Cpu& b)
+            {
+                return std::make_tuple(a.node, a.package, a.core, a.smt, a.id) < std::make_tuple(b.node, b.package, b.core, b.smt, b.id);
+            });
+            break;
+        case Placement::Spread:
+        {
+            // each node's CPUs in Cores order, then dealt out one node at a time
+            std::map<int, std::vector<Cpu> > byNode;
+            for (const Cpu& cpu : cpus)
+                byNode[cpu.node].push_back(cpu);
+            std::vector<std::vector<Cpu> > lists;
+            for (std::pair<const int, std::vector<Cpu> >& node : byNode)
+            {
+                std::sort(node.second.begin(), node.second.end(), [](const Cpu& a, const Cpu& b)
+                {
+                    return std::make_tuple(a.smt, a.package, a.core, a.id) < std::make_tuple(b.smt, b.package, b.core, b.id);
+                });
+                lists.push_back(node.second);
+            }
+            cpus.clear();
+            for (std::size_t i = 0; cpus.size() < topology.cpus.size(); ++i)
+                for (const std::vector<Cpu>& list : lists)
+                    if (i < list.size())
+                        cpus.push_back(list[i]);
+            break;
+        }
+    }
+    for (const Cpu& cpu : cpus)
+        order.push_back(cpu.id);
+    return order;
+}
+
+// pins the calling thread to one CPU; false if that didn't work (or isn't
+// supported here)
+bool pinCurrentThread(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+#endif
@@ -0,0 +1,232 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <random>
+#include <thread>
+#include <vector>
+
+// where the keys of a generated workload come from. Zipf and HotSet scatter
+// their popular keys over the whole key range; Sequential and
+// ShiftingHotspot are about key order, so they don't
+enum class KeyDist { Uniform, Zipf, HotSet, Sequential, ShiftingHotspot };
+
+const char* distName(KeyDist dist)
+{
+    switch (dist)
+    {
+        case KeyDist::Uniform: return "uniform";
+        case KeyDist::Zipf: return "zipf";
+        case KeyDist::HotSet: return "hot-set";
+        case KeyDist::Sequential: return "sequential";
+        case KeyDist::ShiftingHotspot: return "shifting-hotspot";
+    }
+    return "";
+}
+
+struct Workload
+{
+    KeyDist dist;
+    // keys are drawn from [1, keyRange]
+    K keyRange;
+    float ratioPut, ratioRemove, ratioGet;
+    // Zipf: the i-th most popular key is drawn with probability ~ 1 / i^theta
+    double theta;
+    // HotSet and ShiftingHotspot: hotProbability of the operations go to a
+    // hot set of hotFraction of the keys, the rest anywhere
+    double hotFraction;
+    double hotProbability;
+    // ShiftingHotspot: every stream moves its hot set on to the next keys
+    // after this many operations
+    unsigned shiftEvery;
+};
+
+// theta 0.99 is YCSB's default; 90% of the operations on 10% of the keys
+Workload workload(KeyDist dist, K keyRange, float ratioPut, float ratioRemove, float ratioGet)
+{
+    Workload w = { dist, keyRange, ratioPut, ratioRemove, ratioGet, 0.99, 0.1, 0.9, 100000 };
+    return w;
+}
+
+// Zipf-distributed ranks in [1, n] by rejection-inversion (Hörmann and
+// Derflinger), which needs no table and no O(n) setup, so a generator for
+// millions of keys is as cheap to build as one for ten
+class ZipfDistribution
+{
+public:
+    ZipfDistribution(unsigned long long n, double theta)
+        : n(n), theta(theta), hIntegralX1(hIntegral(1.5) - 1), hIntegralN(hIntegral(n + 0.5)),
+          s(2 - hIntegralInverse(hIntegral(2.5) - h(2)))
+    {}
+
+    template <typename Generator>
+    unsigned long long operator()(Generator& gen) const
+    {
+        std::uniform_real_distribution<double> uniform(0, 1);
+        while (true)
+        {
+            double u = hIntegralN + uniform(gen) * (hIntegralX1 - hIntegralN);
+            double x = hIntegralInverse(u);
+            double k = std::floor(x + 0.5);
+            if (k < 1)
+                k = 1;
+            else if (k > n)
+                k = static_cast<double>(n);
+            if (k - x <= s || u >= hIntegral(k + 0.5) - h(k))
+                return static_cast<unsigned long long>(k);
+        }
+    }
+
+private:
+    double h(double x) const
+    {
+        return std::exp(-theta * std::log(x));
+    }
+    // integral of h, and its inverse
+    double hIntegral(double x) const
+    {
+        double logX = std::log(x);
+        return expm1OverX((1 - theta) * logX) * logX;
+    }
+    double hIntegralInverse(double x) const
+    {
+        double t = x * (1 - theta);
+        if (t < -1)
+            t = -1;
+        return std::exp(log1pOverX(t) * x);
+    }
+    // both are 1 at x = 0, where the plain formulas divide by zero
+    static double log1pOverX(double x)
+    {
+        return std::fabs(x) > 1e-8 ? std::log1p(x) / x : 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+    }
+    static double expm1OverX(double x)
+    {
+        return std::fabs(x) > 1e-8 ? std::expm1(x) / x : 1 + x * 0.5 * (1 + x * (1.0 / 3) * (1 + 0.25 * x));
+    }
+
+    unsigned long long n;
+    double theta;
+    double hIntegralX1;
+    double hIntegralN;
+    double s;
+};
+
+// one stream of operations of a workload, produced on demand. stream i of
+// count streams is the same sequence wherever and however often it's
+// generated, so every thread can generate its own share in parallel and a
+// single-threaded run can replay all of them later
+class OpGenerator
+{
+public:
+    OpGenerator(const Workload& w, unsigned stream, unsigned streams, unsigned seed)
+        : w(w), stream(stream), streams(streams), index(0), gen(seed * 0x9e3779b9u + stream),
+          zipf(w.keyRange, w.theta), stride(1), hotKeys(static_cast<K>(std::max(1.0, w.hotFraction * w.keyRange)))
+    {
+        // any stride coprime to keyRange makes rank -> key a bijection
+        unsigned long long n = w.keyRange;
+        stride = static_cast<unsigned long long>(n * 0.6180339887) | 1;
+        while (gcd(stride, n) != 1)
+            stride += 2;
+    }
+
+    Operation next()
+    {
+        float total = w.ratioPut + w.ratioRemove + w.ratioGet;
+        float r = std::uniform_real_distribution<float>(0, total)(gen);
+        int op = r < w.ratioPut ? Put : (r < w.ratioPut + w.ratioRemove ? Remove : Get);
+        K k = key();
+        ++index;
+        Operation result = { op, std::make_pair(k, k) };
+        return result;
+    }
+
+    // appends the next n operations to ops
+    void fill(std::vector<Operation>& ops, std::size_t n)
+    {
+        ops.reserve(ops.size() + n);
+        for (std::size_t i = 0; i < n; ++i)
+            ops.push_back(next());
+    }
+
+private:
+    K key()
+    {
+        unsigned long long n = w.keyRange;
+        switch (w.dist)
+        {
+            case KeyDist::Zipf:
+                return scatter(zipf(gen) - 1);
+            case KeyDist::HotSet:
+                if (coin() < w.hotProbability)
+                    return scatter(below(hotKeys));
+                return scatter(hotKeys + below(n - hotKeys));
+            // the streams interleave, so together they move one frontier
+            // through the key range
+            case KeyDist::Sequential:
+                return static_cast<K>(1 + (index * streams + stream) % n);
+            case KeyDist::ShiftingHotspot:
+                if (coin() < w.hotProbability)
+                    return static_cast<K>(1 + ((index / w.shiftEvery) * hotKeys + below(hotKeys)) % n);
+                return static_cast<K>(1 + below(n));
+            case KeyDist::Uniform:
+                break;
+        }
+        return static_cast<K>(1 + below(n));
+    }
+    unsigned long long below(unsigned long long n)
+    {
+        return std::uniform_int_distribution<unsigned long long>(0, n - 1)(gen);
+    }
+    double coin()
+    {
+        return std::uniform_real_distribution<double>(0, 1)(gen);
+    }
+    K scatter(unsigned long long rank) const
+    {
+        return static_cast<K>(1 + rank * stride % w.keyRange);
+    }
+    static unsigned long long gcd(unsigned long long a, unsigned long long b)
+    {
+        while (b != 0)
+        {
+            unsigned long long t = a % b;
+            a = b;
+            b = t;
+        }
+        return a;
+    }
+
+    Workload w;
+    unsigned stream;
+    unsigned streams;
+    unsigned long long index;
+    std::mt19937_64 gen;
+    ZipfDistribution zipf;
+    unsigned long long stride;
+    unsigned long long hotKeys;
+};
+
+// operations a stream generates at a time in runStream: a few dozen KB,
+// which stay in the cache while they run
+const std::size_t StreamChunk = 4096;
+
+// runs numOps operations of gen's stream on map as they are generated, a
+// chunk at a time, so a run holds no more than StreamChunk operations
+// however long it is
+template <typename Map>
+void runStream(Map& map, OpGenerator gen, std::size_t numOps, bool concurrent)
+{
+    std::vector<Operation> chunk;
+    chunk.reserve(StreamChunk);
+    for (std::size_t done = 0; done < numOps; done += chunk.size())
+    {
+        chunk.clear();
+        gen.fill(chunk, std::min(StreamChunk, numOps - done));
+        run(map, chunk, TestMode::None, concurrent);
+    }
+}
+
+#endif